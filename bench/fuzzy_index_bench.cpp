@@ -0,0 +1,105 @@
+/**
+ * Measures how long FuzzyIndex takes to build and to look up near matches, on
+ * a synthetic translation memory. Words follow a Zipf distribution over a
+ * vocabulary of 20000, like natural text, and some segments have a number or
+ * product code in them. Queries are segments from the memory with that code
+ * changed, or a word appended: the near matches a translator would hope for.
+ *
+ * Usage: fuzzy_index_bench [segments] [queries] [threshold]
+ * Defaults to 1000000 segments, 1000 queries and a threshold of 0.7.
+ */
+#include "tm/FuzzyIndex.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+using translateLocally::FuzzyIndex;
+
+namespace {
+
+const std::size_t kVocabulary = 20000;
+const std::size_t kCandidates = 64; // Same as TranslationMemory
+
+std::vector<std::string> makeSegments(std::size_t count, std::mt19937 &rng) {
+    std::vector<double> weights;
+    for (std::size_t i = 1; i <= kVocabulary; ++i)
+        weights.push_back(1.0 / i);
+    std::discrete_distribution<std::size_t> zipf(weights.begin(), weights.end());
+
+    std::vector<std::string> segments;
+    segments.reserve(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        std::string segment;
+        std::size_t length = 6 + rng() % 14;
+        for (std::size_t j = 0; j < length; ++j) {
+            segment += "w" + std::to_string(zipf(rng)) + " ";
+            if (rng() % 5 == 0)
+                segment += "X" + std::to_string(rng() % 100000) + " ";
+        }
+        segment += ".";
+        segments.push_back(std::move(segment));
+    }
+    return segments;
+}
+
+double seconds(std::chrono::steady_clock::duration duration) {
+    return std::chrono::duration<double>(duration).count();
+}
+
+} // Anonymous namespace
+
+int main(int argc, char **argv) {
+    std::size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+    std::size_t queries = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 1000;
+    double threshold = argc > 3 ? std::strtod(argv[3], nullptr) : 0.7;
+    if (count == 0 || queries == 0 || threshold <= 0.0 || threshold > 1.0) {
+        std::fprintf(stderr, "Usage: %s [segments] [queries] [threshold (0 to 1)]\n", argv[0]);
+        return 8;
+    }
+
+    std::mt19937 rng(1);
+    std::vector<std::string> segments = makeSegments(count, rng);
+
+    auto start = std::chrono::steady_clock::now();
+    FuzzyIndex index;
+    for (std::size_t i = 0; i < segments.size(); ++i)
+        index.add(i, segments[i]);
+    index.finish();
+    double build = seconds(std::chrono::steady_clock::now() - start);
+
+    std::vector<double> times;
+    std::size_t found = 0;
+    for (std::size_t i = 0; i < queries; ++i) {
+        std::string query = segments[rng() % segments.size()];
+        std::size_t code = query.find('X');
+        if (code != std::string::npos)
+            query[code + 1] = query[code + 1] == '9' ? '8' : '9';
+        else
+            query += " now";
+
+        auto begin = std::chrono::steady_clock::now();
+        double best = 0.0;
+        for (std::uint64_t id : index.candidates(query, threshold, kCandidates))
+            best = std::max(best, FuzzyIndex::similarity(query, segments[id]));
+        times.push_back(seconds(std::chrono::steady_clock::now() - begin) * 1000.0);
+
+        if (best >= threshold)
+            ++found;
+    }
+
+    std::sort(times.begin(), times.end());
+    double total = 0.0;
+    for (double time : times)
+        total += time;
+
+    std::printf("segments:  %zu\n", count);
+    std::printf("build:     %.2f s\n", build);
+    std::printf("lookups:   %zu, mean %.2f ms, median %.2f ms, p99 %.2f ms, max %.2f ms\n",
+                queries, total / queries, times[times.size() / 2], times[times.size() * 99 / 100], times.back());
+    std::printf("found:     %zu of %zu near matches at threshold %.2f\n", found, queries, threshold);
+    return 0;
+}
@@ -7,6 +7,10 @@ import json
 import time
 import sys
 import csv
+import os
+import random
+import re
+import tempfile
 from pathlib import Path
 from pprint import pprint
 from tqdm import tqdm
@@ -95,28 +99,42 @@ class TranslateLocally(Client):
     """TranslateLocally wrapper around Client that translates
     our defined messages into functions with arguments.
     """
-    async def list_models(self, *, include_remote=False):
-        return await self.request("ListModels", {"includeRemote": bool(include_remote)})
-
-    async def translate(self, text, src=None, trg=None, *, model=None, pivot=None, html=False):
+    @staticmethod
+    def model_spec(src, trg, *, model, pivot):
         if src and trg:
             if model or pivot:
                 raise InvalidArgumentException("Cannot combine src + trg and model + pivot arguments")
-            spec = {"src": str(src), "trg": str(trg)}
+            return {"src": str(src), "trg": str(trg)}
         elif model:
             if pivot:
-                spec = {"model": str(model), "pivot": str(pivot)}
+                return {"model": str(model), "pivot": str(pivot)}
             else:
-                spec = {"model": str(model)}
+                return {"model": str(model)}
         else:
             raise InvalidArgumentException("Missing src + trg or model argument")
 
-        result = await self.request("Translate", {**spec, "text": str(text), "html": bool(html)})
+    async def list_models(self, *, include_remote=False):
+        return await self.request("ListModels", {"includeRemote": bool(include_remote)})
+
+    async def translate(self, text, src=None, trg=None, *, model=None, pivot=None, html=False, update=None):
+        spec = self.model_spec(src, trg, model=model, pivot=pivot)
+        if update is None:
+            result = await self.request("Translate", {**spec, "text": str(text), "html": bool(html)})
+        else:
+            result = await self.request("Translate", {**spec, "text": str(text), "html": bool(html), "stream": True}, update=update)
         return result["target"]["text"]
 
+    async def translate_batch(self, texts, src=None, trg=None, *, model=None, pivot=None, html=False, update=lambda data: None):
+        spec = self.model_spec(src, trg, model=model, pivot=pivot)
+        result = await self.request("TranslateBatch", {**spec, "texts": list(texts), "html": bool(html)}, update=update)
+        return [target["text"] for target in result["target"]]
+
     async def download_model(self, model_id, *, update=lambda data: None):
         return await self.request("DownloadModel", {"modelID": str(model_id)}, update=update)
 
+    async def get_stats(self, *, interval=0, update=lambda data: None):
+        return await self.request("GetStats", {"interval": int(interval)}, update=update)
+
 
 def first(iterable, *default):
     """Returns the first value of anything iterable, or throws StopIteration
@@ -332,6 +350,89 @@ async def test_concurrent_download():
         await asyncio.gather(*downloads)
 
 
+async def test_batch():
+    """Translate all lines from stdin as a single batch, printing them as they come in."""
+    lines = [line.strip() for line in sys.stdin]
+    async with get_build() as tl:
+        translations = await tl.translate_batch(lines, "en", "de",
+            update=lambda data: print(data["index"], data["target"]["text"], file=sys.stderr))
+        pprint(list(zip(lines, translations)))
+
+
+async def test_stream():
+    """Translate stdin as a single text, printing the partial translations as they come in."""
+    text = sys.stdin.read()
+    async with get_build() as tl:
+        await tl.translate(text, "en", "de", update=lambda data: print(data["target"]["text"], end="", flush=True))
+        print()
+
+
+async def test_stats():
+    """Translate a couple of lines from stdin while printing stats updates."""
+    async with get_build() as tl:
+        await tl.get_stats(interval=500, update=lambda data: pprint(data))
+        await asyncio.gather(*(
+            tl.translate(line.strip(), "en", "de")
+            for line in sys.stdin
+        ))
+        pprint(await tl.get_stats())
+
+
+async def test_fuzzy():
+    """Benchmark fuzzy translation memory lookups: import a million (or argv[2])
+    generated segments, then look up segments that differ from one of them in
+    a number. Uses a temporary translation memory, by pointing XDG_DATA_HOME
+    elsewhere, so Linux only. Needs en-de-tiny.
+    """
+    count = int(sys.argv[2]) if len(sys.argv) > 2 else 1000000
+    rng = random.Random(1)
+
+    # Zipf distributed words, and a product number in each segment
+    vocabulary = [f"w{n}" for n in range(20000)]
+    weights = list(itertools.accumulate(1 / (n + 1) for n in range(len(vocabulary))))
+
+    def segment():
+        words = rng.choices(vocabulary, cum_weights=weights, k=rng.randint(6, 20))
+        words.insert(rng.randrange(len(words)), f"X{rng.randrange(100000)}")
+        return " ".join(words) + "."
+
+    with tempfile.TemporaryDirectory() as data_home:
+        os.environ["XDG_DATA_HOME"] = data_home
+
+        sources = [segment() for _ in range(count)]
+        memory = Path(data_home) / "memory.tsv"
+        with open(memory, "w") as fh:
+            for n, source in enumerate(sources):
+                fh.write(f"{source}\tsegment {n}\n")
+
+        async with get_build() as tl:
+            start = time.perf_counter()
+            proc = await asyncio.create_subprocess_exec(tl.args[0], "-m", "en-de-tiny", "--tm-import", str(memory))
+            await proc.wait()
+            print(f"Import of {count} segments: {time.perf_counter() - start:.2f}s")
+
+            def lookup(text):
+                return tl.request("Translate", {"src": "en", "trg": "de", "text": text, "fuzzy": 0.8, "fuzzyReplace": True})
+
+            # Load the model first, so that isn't timed.
+            await tl.translate("Hello world!", "en", "de")
+
+            queries = [re.sub(r"X\d+", f"X{rng.randrange(100000, 200000)}", rng.choice(sources)) for _ in range(1001)]
+
+            start = time.perf_counter()
+            await lookup(queries[0])
+            print(f"First lookup, which builds the index: {time.perf_counter() - start:.2f}s")
+
+            timer = Timer()
+            found = 0
+            for query in queries[1:]:
+                result = await timer.measure(lookup(query))
+                found += bool(result.get("matches"))
+
+            times = sorted(measurement[0] * 1000 for measurement in timer.measurements)
+            print(f"{len(times)} lookups, {found} found: median {times[len(times) // 2]:.2f}ms, 99th percentile {times[len(times) * 99 // 100]:.2f}ms")
+
+
 def main():
     tests = {
         "test": test,
@@ -339,7 +440,11 @@ def main():
         "latency": test_latency,
         "concurrency": test_concurrency,
         "shutdown": test_shutdown,
-        "concurrent-downloads": test_concurrent_download
+        "concurrent-downloads": test_concurrent_download,
+        "stats": test_stats,
+        "batch": test_batch,
+        "stream": test_stream,
+        "fuzzy": test_fuzzy
     }
 
     if len(sys.argv) == 1 or sys.argv[1] not in tests:
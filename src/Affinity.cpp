@@ -0,0 +1,246 @@
+#include "Affinity.h"
+#include <QDir>
+#include <QFile>
+#include <QRegularExpression>
+#include <algorithm>
+#include <exception>
+#include <iterator>
+#include <thread>
+
+#if defined(Q_OS_LINUX)
+#include <sched.h>
+#endif
+
+#if defined(Q_OS_WIN)
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
+
+namespace translateLocally::affinity {
+
+namespace {
+
+#if defined(Q_OS_LINUX)
+QString readSysFile(QString const &path) {
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly))
+        return QString();
+    return QString::fromLatin1(file.readAll()).trimmed();
+}
+#endif
+
+CpuSet intersect(CpuSet const &a, CpuSet const &b) {
+    CpuSet out;
+    std::set_intersection(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(out));
+    return out;
+}
+
+// Splits cpus into count contiguous parts, the first ones one larger if it
+// doesn't divide evenly. Neighbouring CPU numbers tend to share caches.
+void split(CpuSet const &cpus, std::size_t count, std::vector<CpuSet> &out) {
+    std::size_t offset = 0;
+    for (std::size_t i = 0; i < count; ++i) {
+        std::size_t size = cpus.size() / count + (i < cpus.size() % count ? 1 : 0);
+        if (size == 0)
+            break;
+        out.emplace_back(cpus.begin() + offset, cpus.begin() + offset + size);
+        offset += size;
+    }
+}
+
+} // Anonymous namespace
+
+CpuSet parseCpuList(QString const &list) {
+    CpuSet cpus;
+    for (auto &&part : list.split(',')) {
+        QStringList range = part.trimmed().split('-');
+        if (range.size() > 2)
+            continue;
+
+        bool okFirst = false, okLast = false;
+        int first = range.first().toInt(&okFirst);
+        int last = range.last().toInt(&okLast); // Same as first if not a range
+        if (!okFirst || !okLast || first < 0 || last < first)
+            continue;
+        for (int cpu = first; cpu <= last; ++cpu)
+            cpus.push_back(cpu);
+    }
+
+    std::sort(cpus.begin(), cpus.end());
+    cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+    return cpus;
+}
+
+CpuSet allowedCpus() {
+    CpuSet cpus;
+#if defined(Q_OS_LINUX)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0)
+        return cpus;
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        if (CPU_ISSET(cpu, &set))
+            cpus.push_back(cpu);
+#endif
+    return cpus;
+}
+
+std::vector<CpuSet> numaNodes() {
+    CpuSet allowed = allowedCpus();
+    std::vector<CpuSet> nodes;
+
+#if defined(Q_OS_LINUX)
+    QDir dir("/sys/devices/system/node");
+    QStringList entries = dir.entryList({"node*"}, QDir::Dirs);
+    static const QRegularExpression nodePattern("^node(\\d+)$");
+
+    // Sort numerically, node10 comes after node9.
+    std::vector<std::pair<int, QString>> numbered;
+    for (auto &&entry : entries) {
+        auto match = nodePattern.match(entry);
+        if (match.hasMatch())
+            numbered.emplace_back(match.captured(1).toInt(), entry);
+    }
+    std::sort(numbered.begin(), numbered.end());
+
+    for (auto &&node : numbered) {
+        CpuSet cpus = intersect(parseCpuList(readSysFile(dir.filePath(node.second + "/cpulist"))), allowed);
+        if (!cpus.empty())
+            nodes.push_back(std::move(cpus));
+    }
+#endif
+
+    if (nodes.empty() && !allowed.empty())
+        nodes.push_back(std::move(allowed));
+
+    return nodes;
+}
+
+CpuSet withoutSmtSiblings(CpuSet const &cpus) {
+#if defined(Q_OS_LINUX)
+    CpuSet out;
+    for (int cpu : cpus) {
+        CpuSet siblings = parseCpuList(readSysFile(QString("/sys/devices/system/cpu/cpu%1/topology/thread_siblings_list").arg(cpu)));
+
+        // Keep it unless a sibling with a lower number is kept already
+        CpuSet taken = intersect(siblings, out);
+        if (taken.empty())
+            out.push_back(cpu);
+    }
+    return out;
+#else
+    return cpus;
+#endif
+}
+
+CpuSet workerCpus(CpuSet const &requested, bool avoidSmt) {
+    if (requested.empty() && !avoidSmt)
+        return CpuSet();
+
+    CpuSet cpus = allowedCpus();
+    if (!requested.empty())
+        cpus = intersect(cpus, requested);
+
+    if (avoidSmt)
+        cpus = withoutSmtSiblings(cpus);
+
+    return cpus;
+}
+
+std::vector<CpuSet> coreGroups(std::size_t count, CpuSet const &cpus) {
+    std::vector<CpuSet> nodes = numaNodes();
+    if (!cpus.empty()) {
+        std::vector<CpuSet> restricted;
+        for (auto &&node : nodes) {
+            CpuSet part = intersect(node, cpus);
+            if (!part.empty())
+                restricted.push_back(std::move(part));
+        }
+        nodes = std::move(restricted);
+    }
+
+    if (count == 0 || nodes.empty())
+        return nodes;
+
+    std::vector<CpuSet> groups;
+    if (count % nodes.size() == 0) {
+        for (auto &&node : nodes)
+            split(node, count / nodes.size(), groups);
+    } else {
+        CpuSet all;
+        for (auto &&node : nodes)
+            all.insert(all.end(), node.begin(), node.end());
+        split(all, count, groups);
+    }
+    return groups;
+}
+
+bool setNice(int nice) {
+    if (nice <= 0)
+        return true;
+
+#if defined(Q_OS_LINUX)
+    // On Linux, 0 means the calling thread.
+    return setpriority(PRIO_PROCESS, 0, std::min(nice, 19)) == 0;
+#else
+    // Elsewhere priorities are per process, or not inherited by new threads.
+    return false;
+#endif
+}
+
+bool setProcessNice(int nice) {
+#if defined(Q_OS_LINUX)
+    // Workers get setNice() instead.
+    Q_UNUSED(nice);
+    return true;
+#else
+    if (nice <= 0)
+        return true;
+
+#if defined(Q_OS_WIN)
+    return SetPriorityClass(GetCurrentProcess(), nice >= 15 ? IDLE_PRIORITY_CLASS : BELOW_NORMAL_PRIORITY_CLASS) != 0;
+#else
+    return setpriority(PRIO_PROCESS, 0, std::min(nice, 19)) == 0;
+#endif
+#endif
+}
+
+bool pinCurrentThread(CpuSet const &cpus) {
+#if defined(Q_OS_LINUX)
+    if (cpus.empty())
+        return false;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus)
+        if (cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &set);
+
+    // With pid 0, this applies to the calling thread only.
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    Q_UNUSED(cpus);
+    return false;
+#endif
+}
+
+void runPinned(CpuSet const &cpus, int nice, std::function<void()> const &fun) {
+    std::exception_ptr error;
+    std::thread([&]() {
+        pinCurrentThread(cpus);
+        setNice(nice);
+        try {
+            fun();
+        } catch (...) {
+            error = std::current_exception();
+        }
+    }).join();
+
+    if (error)
+        std::rethrow_exception(error);
+}
+
+} // namespace translateLocally::affinity
@@ -0,0 +1,91 @@
+#pragma once
+#include <cstddef>
+#include <functional>
+#include <vector>
+#include <QString>
+
+/**
+ * Which CPUs threads run on, and at which priority. Used to keep translation
+ * workers on a fixed set of cores, and to split them into groups that each
+ * stay on one NUMA node (or one group of cores), so the model replica they
+ * use lives in memory close to them.
+ *
+ * CPU topology and pinning are only implemented on Linux. Elsewhere, all CPUs
+ * form a single group and pinning does nothing.
+ */
+namespace translateLocally::affinity {
+
+using CpuSet = std::vector<int>; // Sorted CPU numbers
+
+/**
+ * @brief The CPUs this process is allowed to run on. Empty if unknown.
+ */
+CpuSet allowedCpus();
+
+/**
+ * @brief The allowed CPUs of each NUMA node that has any. A single node if
+ * the machine isn't NUMA or the topology is unknown.
+ */
+std::vector<CpuSet> numaNodes();
+
+/**
+ * @brief Leaves out all but the first logical CPU of each physical core, so
+ * no two workers end up on hyperthreads (SMT siblings) of the same core.
+ */
+CpuSet withoutSmtSiblings(CpuSet const &cpus);
+
+/**
+ * @brief The CPUs to run translation workers on: the allowed CPUs that are
+ * in requested (all of them if requested is empty), one per physical core if
+ * avoidSmt. Empty if workers can run anywhere.
+ */
+CpuSet workerCpus(CpuSet const &requested, bool avoidSmt);
+
+/**
+ * @brief Splits cpus (all allowed CPUs if empty) into count groups of
+ * (nearly) equal size. Groups don't cross NUMA nodes if count is a multiple
+ * of the number of nodes. With count 0, there is one group per NUMA node.
+ * Returns fewer groups if there are fewer CPUs, and none if the allowed CPUs
+ * are unknown.
+ */
+std::vector<CpuSet> coreGroups(std::size_t count, CpuSet const &cpus = CpuSet());
+
+/**
+ * @brief Restricts the calling thread to cpus. Threads it starts afterwards
+ * inherit this.
+ * @return false if not supported, or cpus is empty.
+ */
+bool pinCurrentThread(CpuSet const &cpus);
+
+/**
+ * @brief Lowers the priority of the calling thread and threads it starts
+ * afterwards. nice is 0 for normal priority up to 19 for the lowest, like the
+ * nice command.
+ * @return false if the priority could not be changed, or this is not
+ * supported (anywhere but Linux).
+ */
+bool setNice(int nice);
+
+/**
+ * @brief Where setNice() is not supported, lowers the priority of the whole
+ * process instead. Without privileges there is no going back, and it slows
+ * down everything in the process, so this is only for command line jobs that
+ * do nothing but translate. Does nothing on Linux.
+ * @return false if the priority could not be changed.
+ */
+bool setProcessNice(int nice);
+
+/**
+ * @brief Runs fun on a new thread restricted to cpus (anywhere if empty) and
+ * at priority nice, and waits for it. Threads started by fun inherit both,
+ * which is how the translation workers get them. Exceptions are passed on.
+ */
+void runPinned(CpuSet const &cpus, int nice, std::function<void()> const &fun);
+
+/**
+ * @brief Parses the Linux cpulist format, e.g. "0-3,8,10-11". Invalid parts
+ * are skipped.
+ */
+CpuSet parseCpuList(QString const &list);
+
+} // namespace translateLocally::affinity
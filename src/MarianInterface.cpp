@@ -2,24 +2,39 @@
 #include "3rd_party/bergamot-translator/src/translator/service.h"
 #include "3rd_party/bergamot-translator/src/translator/parser.h"
 #include "3rd_party/bergamot-translator/src/translator/response.h"
-#include <future>
+#include "TranslationCache.h"
+#include "SplitLines.h"
+#include "Tracing.h"
+#include "Affinity.h"
+#include "tm/TranslationMemory.h"
+#include "cli/DaemonClient.h"
+#include <QDebug>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <algorithm>
+#include <cctype>
+#include <functional>
 #include <memory>
 #include <mutex>
+#include <optional>
+#include <string_view>
 #include <thread>
 #include <chrono>
+#include <vector>
 
-namespace  {
-
-std::shared_ptr<marian::Options> makeOptions(const std::string &path_to_model_dir, const translateLocally::marianSettings &settings) {
+std::shared_ptr<marian::Options> makeOptions(const std::string &path_to_model_dir, const translateLocally::marianSettings &settings, bool alignment) {
     std::shared_ptr<marian::Options> options(marian::bergamot::parseOptionsFromFilePath(path_to_model_dir + "/config.intgemm8bitalpha.yml"));
     options->set("cpu-threads", settings.cpu_threads,
                  "workspace", settings.workspace,
-                 "mini-batch-words", 1000,
-                 "alignment", "soft",
+                 "mini-batch-words", translateLocally::kMiniBatchWords,
                  "quiet", true);
+    if (alignment)
+        options->set("alignment", "soft");
     return options;
 }
 
+namespace  {
+
 int countWords(std::string input) {
     const char * str = input.c_str();
 
@@ -38,18 +53,186 @@ int countWords(std::string input) {
     return numWords;
 }
 
+/**
+ * Lines are cached per model, so the key is the model's path plus the line.
+ * Lines are already normalised by splitLines() stripping the whitespace around
+ * them.
+ */
+std::string cacheKey(std::string const &modelPath, std::string const &line) {
+    std::string key;
+    key.reserve(modelPath.size() + 1 + line.size());
+    key += modelPath;
+    key += '\0';
+    key += line;
+    return key;
+}
+
+/**
+ * Rough estimate of the memory a response takes, for keeping the line cache
+ * within its size limit. Alignments (a source x target matrix per sentence)
+ * dominate for all but the shortest lines.
+ */
+std::size_t estimateSize(marian::bergamot::Response const &response) {
+    std::size_t size = sizeof(marian::bergamot::Response) + response.source.text.size() + response.target.text.size();
+
+    for (auto &&alignment : response.alignments)
+        for (auto &&row : alignment)
+            size += row.size() * sizeof(float);
+
+    // Token offsets in source and target annotations
+    for (std::size_t sentenceIdx = 0; sentenceIdx < response.source.numSentences(); ++sentenceIdx)
+        size += 2 * sizeof(marian::bergamot::ByteRange) * (response.source.numWords(sentenceIdx) + response.target.numWords(sentenceIdx));
+
+    return size;
+}
+
+// Aligned source words per target word to ask the daemon for, the most it
+// sends. Enough for highlighting: the rest are below its threshold anyway.
+const int constexpr kDaemonAlignments = 8;
+
+/**
+ * Byte offset in UTF-8 text of every UTF-16 position (as used by the daemon),
+ * plus one for the end of the text.
+ */
+std::vector<std::size_t> utf16ToByteOffsets(std::string const &text) {
+    std::vector<std::size_t> offsets;
+    offsets.reserve(text.size() + 1);
+    for (std::size_t i = 0; i < text.size(); ++i) {
+        unsigned char c = text[i];
+        if ((c & 0xc0) == 0x80) // Continuation byte
+            continue;
+        offsets.push_back(i);
+        if (c >= 0xf0) // Four byte characters are surrogate pairs in UTF-16
+            offsets.push_back(i);
+    }
+    offsets.push_back(text.size());
+    return offsets;
+}
+
+/**
+ * Annotates text with words, pairs of UTF-16 begin and end offsets, as a
+ * single sentence.
+ * @return the number of words.
+ */
+std::size_t annotateWords(marian::bergamot::AnnotatedText &text, QJsonArray const &words) {
+    std::vector<std::size_t> offsets = utf16ToByteOffsets(text.text);
+    auto offset = [&](QJsonValue const &position) {
+        return offsets[std::min<std::size_t>(std::max(position.toInt(), 0), offsets.size() - 1)];
+    };
+
+    std::vector<std::string_view> views;
+    for (int i = 0; i + 1 < words.size(); i += 2) {
+        std::size_t begin = offset(words[i]);
+        std::size_t end = std::max(begin, offset(words[i + 1]));
+        views.emplace_back(text.text.data() + begin, end - begin);
+    }
+
+    if (!views.empty())
+        text.recordExistingSentence(views.begin(), views.end(), views.front().data());
+
+    return views.size();
+}
+
+/**
+ * Turns the data of a Translate response from the daemon back into a response
+ * like the service gives. The daemon numbers words across sentences, so all
+ * of it becomes a single sentence.
+ */
+std::shared_ptr<marian::bergamot::Response> responseFromJson(std::string &&source, QJsonObject const &data) {
+    auto response = std::make_shared<marian::bergamot::Response>();
+    response->source = marian::bergamot::AnnotatedText(std::move(source));
+    response->target = marian::bergamot::AnnotatedText(data.value("target").toObject().value("text").toString().toStdString());
+
+    // No words when it came out of the translation memory, and then there is
+    // nothing to align either.
+    QJsonArray sourceWords = data.value("source").toObject().value("words").toArray();
+    QJsonArray targetWords = data.value("target").toObject().value("words").toArray();
+    if (sourceWords.size() < 2 || targetWords.size() < 2)
+        return response;
+
+    std::size_t sourceCount = annotateWords(response->source, sourceWords);
+    std::size_t targetCount = annotateWords(response->target, targetWords);
+
+    QJsonObject alignments = data.value("alignments").toObject();
+    int k = alignments.value("k").toInt();
+    QJsonArray indices = alignments.value("source").toArray();
+    QJsonArray weights = alignments.value("weights").toArray();
+
+    std::vector<std::vector<float>> sentence(targetCount, std::vector<float>(sourceCount, 0.0f));
+    for (std::size_t t = 0; t < targetCount; ++t) {
+        for (int i = 0; i < k; ++i) {
+            int index = static_cast<int>(t) * k + i;
+            if (index >= indices.size() || index >= weights.size())
+                break;
+
+            int s = indices[index].toInt(-1);
+            if (s >= 0 && static_cast<std::size_t>(s) < sourceCount)
+                sentence[t][s] = weights[index].toInt() / 255.0f;
+        }
+    }
+    response->alignments.push_back(std::move(sentence));
+
+    return response;
+}
+
+/**
+ * Has the daemon translate lines with models modelID and pivotID (if not
+ * empty), with alignments.
+ * @return nothing if that didn't work out, error says why. Also nothing if
+ * cancelled returned true before all lines were back, with error empty.
+ */
+std::optional<std::vector<std::shared_ptr<marian::bergamot::Response>>> translateWithDaemon(DaemonClient &daemon, QString const &modelID, QString const &pivotID, std::vector<std::string> &&lines, QString &error, std::function<bool()> cancelled) {
+    std::vector<QJsonObject> requests;
+    requests.reserve(lines.size());
+    for (auto &&line : lines) {
+        QJsonObject data{
+            {"model", modelID},
+            {"text", QString::fromStdString(line)},
+            {"alignments", kDaemonAlignments}
+        };
+        if (!pivotID.isEmpty())
+            data["pivot"] = pivotID;
+        requests.push_back(std::move(data));
+    }
+
+    std::optional<std::vector<QJsonValue>> results = daemon.requestAll("Translate", requests, error, std::move(cancelled));
+    if (!results)
+        return std::nullopt;
+
+    std::vector<std::shared_ptr<marian::bergamot::Response>> responses;
+    responses.reserve(lines.size());
+    for (std::size_t i = 0; i < lines.size(); ++i)
+        responses.push_back(responseFromJson(std::move(lines[i]), (*results)[i].toObject()));
+    return responses;
+}
+
+/**
+ * Responses for the lines of a single input, as they come back from the
+ * service. Shared between the worker and the translate callbacks.
+ */
+struct PendingTranslation {
+    std::vector<std::shared_ptr<marian::bergamot::Response>> responses;
+    std::size_t remaining;
+};
+
 } // Anonymous namespace
 
 struct ModelDescription {
     std::string config_file;
     translateLocally::marianSettings settings;
+    QString translation_memory;
+    std::string pivot_config_file; // Empty if translating directly
+    QString model_id; // Of the model in config_file, to have the daemon translate with it
+    QString pivot_id;
 };
 
 MarianInterface::MarianInterface(QObject *parent)
     : QObject(parent)
     , pendingInput_(nullptr)
     , pendingModel_(nullptr)
-    , pendingShutdown_(false) {
+    , pendingShutdown_(false)
+    , cacheHits_(0)
+    , cacheMisses_(0) {
 
     // This worker is the only thread that can interact with Marian. Right now
     // it basically uses marian::bergamot::Service's non-blocking interface
@@ -66,8 +249,22 @@ MarianInterface::MarianInterface(QObject *parent)
     worker_ = std::thread([&]() {
         std::unique_ptr<marian::bergamot::AsyncService> service;
         std::shared_ptr<marian::bergamot::TranslationModel> model;
+        std::shared_ptr<marian::bergamot::TranslationModel> pivotModel; // Or nullptr
+        std::string modelPath;
+
+        // Translated lines of all models used in this session. Keyed on model
+        // and line, so switching back to a model can still make use of it.
+        TranslationCache<std::string, std::shared_ptr<marian::bergamot::Response>> cache;
 
-        std::mutex internal_mutex;
+        // Earlier translations of the model's language pair, if there are any.
+        std::shared_ptr<translateLocally::TranslationMemory const> memory;
+
+        // Translates instead of service if a daemon is running, see setModel().
+        // daemonModel is kept to load the models here if the daemon fails.
+        std::unique_ptr<DaemonClient> daemon;
+        std::unique_ptr<ModelDescription> daemonModel;
+
+        [[maybe_unused]] std::uint64_t inputs = 0; // to match up trace events
 
         while (true) {
             std::unique_ptr<ModelDescription> modelChange;
@@ -97,59 +294,229 @@ MarianInterface::MarianInterface(QObject *parent)
 
             try {
                 if (modelChange) {
-                    // Reconstruct the service because cpu_threads might have changed.
-                    // @TODO: don't recreate Service if cpu_threads didn't change?
-                    marian::bergamot::AsyncService::Config serviceConfig;
-                    serviceConfig.numWorkers = modelChange->settings.cpu_threads;
-                    serviceConfig.cacheSize = modelChange->settings.translation_cache ? kTranslationCacheSize : 0;
+                    TRACE_SPAN("marian", "loadModel");
+
+                    // With a daemon running, it has the models, and this
+                    // process doesn't have to load them as well.
+                    daemon.reset();
+                    daemonModel.reset();
+                    if (!modelChange->model_id.isEmpty()) {
+                        daemon = std::make_unique<DaemonClient>();
+                        if (daemon->connectToDaemon())
+                            daemonModel = std::make_unique<ModelDescription>(*modelChange);
+                        else
+                            daemon.reset();
+                    }
+
+                    if (daemon) {
+                        // The daemon has its own translation memory as well.
+                        service.reset();
+                        model.reset();
+                        pivotModel.reset();
+                        memory.reset();
+                    } else {
+                        // More workers than CPUs to run them on would only get
+                        // in each other's way.
+                        translateLocally::affinity::CpuSet cpus = translateLocally::affinity::workerCpus(modelChange->settings.cpu_affinity, modelChange->settings.avoid_smt);
+                        if (!cpus.empty())
+                            modelChange->settings.cpu_threads = std::min(modelChange->settings.cpu_threads, cpus.size());
+
+                        // Reconstruct the service because cpu_threads might have changed.
+                        // @TODO: don't recreate Service if cpu_threads didn't change?
+                        marian::bergamot::AsyncService::Config serviceConfig;
+                        serviceConfig.numWorkers = modelChange->settings.cpu_threads;
+                        serviceConfig.cacheSize = translationCacheEntries(modelChange->settings, true);
                     
-                    // Free up old service first (see https://github.com/browsermt/bergamot-translator/issues/290)
-                    // Calling clear to remove any pending translations so we
-                    // do not have to wait for those when AsyncService is destroyed.
-                    service.reset();
-
-                    service = std::make_unique<marian::bergamot::AsyncService>(serviceConfig);
-
-                    // Initialise a new model. Old model will be released if
-                    // service is done with it, which it is since all translation
-                    // requests are effectively blocking in this thread.
-                    auto modelConfig = makeOptions(modelChange->config_file, modelChange->settings);
-                    model = std::make_shared<marian::bergamot::TranslationModel>(modelConfig, modelChange->settings.cpu_threads);
-                } else if (input) {
-                    if (model) {
-                        std::future<int> wordCount = std::async(countWords, *input); // @TODO we're doing an "unnecessary" string copy here (necessary because we std::move input into service->translate)
+                        // Free up old service first (see https://github.com/browsermt/bergamot-translator/issues/290)
+                        // Calling clear to remove any pending translations so we
+                        // do not have to wait for those when AsyncService is destroyed.
+                        service.reset();
+
+                        // Workers inherit the CPUs and priority of the thread
+                        // that starts them.
+                        translateLocally::affinity::runPinned(cpus, modelChange->settings.nice, [&]() {
+                            service = std::make_unique<marian::bergamot::AsyncService>(serviceConfig);
+                        });
 
+                        // Initialise a new model. Old model will be released if
+                        // service is done with it, which it is since all translation
+                        // requests are effectively blocking in this thread.
+                        auto modelConfig = makeOptions(modelChange->config_file, modelChange->settings, true);
+                        model = std::make_shared<marian::bergamot::TranslationModel>(modelConfig, modelChange->settings.cpu_threads);
+
+                        pivotModel.reset();
+                        if (!modelChange->pivot_config_file.empty()) {
+                            auto pivotConfig = makeOptions(modelChange->pivot_config_file, modelChange->settings, true);
+                            pivotModel = std::make_shared<marian::bergamot::TranslationModel>(pivotConfig, modelChange->settings.cpu_threads);
+                        }
+                    }
+
+                    // Cached lines are keyed on the models that translated
+                    // them, here or in the daemon.
+                    modelPath = modelChange->config_file;
+                    if (!modelChange->pivot_config_file.empty()) {
+                        modelPath += '\0';
+                        modelPath += modelChange->pivot_config_file;
+                    }
+
+                    cache.setCapacity(lineCacheBytes(modelChange->settings));
+                    cache.setEviction(modelChange->settings.translation_cache_eviction);
+                    if (!daemon)
+                        memory = translateLocally::TranslationMemory::open(modelChange->translation_memory);
+                } else if (input) {
+                    if (model || daemon) {
+                        TRACE_SPAN("marian", "translate");
                         marian::bergamot::ResponseOptions options;
                         options.alignment = true;
 
-                        Translation translation;
+                        // Split the input into lines. Lines we've translated
+                        // before with this model come out of the cache, the
+                        // rest is sent off to the service. The whitespace in
+                        // between is copied to the translation as is.
+                        std::vector<Translation::Segment> segments;
+                        std::vector<std::pair<std::size_t, std::string>> misses; // index in segments, cache key
+                        std::vector<std::string> missingText;
+                        int words = 0; // words that actually need translating
+
+                        for (auto &&part : translateLocally::splitLines(*input)) {
+                            std::string text = input->substr(part.begin, part.end - part.begin);
+
+                            if (!part.translate) {
+                                segments.emplace_back(std::move(text));
+                                continue;
+                            }
+
+                            std::string key = cacheKey(modelPath, text);
+                            if (auto cached = cache.find(key)) {
+                                segments.emplace_back(std::move(*cached));
+                                continue;
+                            }
+
+                            // Without alignments, as it was never decoded.
+                            if (memory) {
+                                if (std::optional<std::string> match = memory->find(text)) {
+                                    auto response = std::make_shared<marian::bergamot::Response>();
+                                    response->target = marian::bergamot::AnnotatedText(std::move(*match));
+                                    response->source = marian::bergamot::AnnotatedText(std::move(text));
+                                    segments.emplace_back(std::move(response));
+                                    continue;
+                                }
+                            }
+
+                            words += countWords(text);
+                            misses.emplace_back(segments.size(), std::move(key));
+                            missingText.push_back(std::move(text));
+                            segments.emplace_back(std::shared_ptr<marian::bergamot::Response>()); // filled in once translated
+                        }
+
+                        cacheHits_ = cache.stats().hits;
+                        cacheMisses_ = cache.stats().misses;
 
                         // Measure the time it takes to queue and respond to the
-                        // translation request
+                        // translation requests
                         auto start = std::chrono::steady_clock::now(); // Time the translation
-                        service->translate(model, std::move(*input), [&] (auto &&val) {
-                            auto end = std::chrono::steady_clock::now();
-                            // Calculate translation speed in terms of words per second
-                            double words = wordCount.get();
-                            std::chrono::duration<double> elapsedSeconds = end - start;
-                            int translationSpeed = std::ceil(words / elapsedSeconds.count());
-                            
-                            std::unique_lock<std::mutex> lock(internal_mutex);
-                            translation = Translation(std::move(val), translationSpeed);
-                            cv_.notify_one();
-                        }, options);
-                        
-                        
-                        // Wait for either translate lambda to call back, or a reason to cancel
-                        std::unique_lock<std::mutex> lock(internal_mutex);
-                        cv_.wait(lock, [&] { return translation || pendingShutdown_ || pendingModel_; });
-                        
-                        if (translation)
-                            emit translationReady(translation);
-                        else
-                            service->clear(); // translation was interrupted. Clear pending batches
-                                              // now to free any references to things that will go
-                                              // out of scope.
+                        TRACE_ASYNC_BEGIN("marian", "decode", ++inputs);
+
+                        std::vector<std::shared_ptr<marian::bergamot::Response>> responses;
+                        bool complete = false;
+
+                        if (daemon) {
+                            // Stop waiting for the daemon once there is
+                            // something newer to do, like with the service.
+                            auto superseded = [this]() {
+                                std::lock_guard<std::mutex> lock(mutex_);
+                                return pendingShutdown_ || pendingModel_ || pendingInput_;
+                            };
+
+                            // The daemon being too busy is retried. Only give up on
+                            // it when it doesn't translate.
+                            QString daemonError;
+                            if (auto translated = translateWithDaemon(*daemon, daemonModel->model_id, daemonModel->pivot_id, std::move(missingText), daemonError, superseded)) {
+                                responses = std::move(*translated);
+                                complete = true;
+                            } else if (daemonError.isEmpty()) {
+                                // Superseded. What the daemon still sends
+                                // back for this input is skipped next time.
+                            } else {
+                                // Load the models here after all, and have
+                                // another go at this input unless there is
+                                // a newer one.
+                                qWarning() << "The translateLocally daemon could not translate:" << daemonError;
+                                daemon.reset();
+                                daemonModel->model_id.clear();
+                                daemonModel->pivot_id.clear();
+
+                                std::lock_guard<std::mutex> lock(mutex_);
+                                if (!pendingModel_)
+                                    pendingModel_ = std::move(daemonModel);
+                                if (!pendingInput_)
+                                    pendingInput_ = std::move(input);
+                                daemonModel.reset();
+                            }
+                            TRACE_ASYNC_END("marian", "decode", inputs);
+                        } else {
+                            // Shared with the callbacks: if this input is
+                            // superseded, the batch that is currently being
+                            // decoded can still call back after we've moved on.
+                            auto pending = std::make_shared<PendingTranslation>();
+                            pending->responses.resize(misses.size());
+                            pending->remaining = misses.size();
+
+                            for (std::size_t i = 0; i < missingText.size(); ++i) {
+                                // Under the same lock as the pending commands, so
+                                // the wait below sees both without missing a
+                                // notification.
+                                auto callback = [this, pending, i] (auto &&val) {
+                                    std::unique_lock<std::mutex> lock(mutex_);
+                                    pending->responses[i] = std::make_shared<marian::bergamot::Response>(std::move(val));
+                                    --pending->remaining;
+                                    cv_.notify_one();
+                                };
+
+                                // Every line is pivoted on its own, so the second
+                                // model can start on the first lines while the
+                                // first model is still busy with the rest.
+                                if (pivotModel)
+                                    service->pivot(model, pivotModel, std::move(missingText[i]), callback, options);
+                                else
+                                    service->translate(model, std::move(missingText[i]), callback, options);
+                            }
+
+                            // Wait for all translate lambdas to call back, or a reason to cancel.
+                            // A newer input is also a reason to cancel: the user will never see
+                            // the output of this one, so don't spend any more CPU on it.
+                            bool done;
+                            {
+                                std::unique_lock<std::mutex> lock(mutex_);
+                                cv_.wait(lock, [&] { return pending->remaining == 0 || pendingShutdown_ || pendingModel_ || pendingInput_; });
+                                done = pending->remaining == 0;
+                            }
+                            TRACE_ASYNC_END("marian", "decode", inputs);
+
+                            if (done) {
+                                responses = std::move(pending->responses);
+                                complete = true;
+                            } else {
+                                service->clear(); // translation was interrupted. Clear pending batches
+                                                  // now so the workers can move on to the next input.
+                                                  // The batch that is currently being decoded can't
+                                                  // be interrupted, but it is at most one batch.
+                            }
+                        }
+
+                        if (complete) {
+                            for (std::size_t i = 0; i < misses.size(); ++i) {
+                                cache.insert(misses[i].second, responses[i], ::estimateSize(*responses[i]) + misses[i].second.size());
+                                segments[misses[i].first] = std::move(responses[i]);
+                            }
+
+                            // Calculate translation speed in terms of words per second.
+                            // If everything came from the cache, there is no speed to speak of.
+                            std::chrono::duration<double> elapsedSeconds = std::chrono::steady_clock::now() - start;
+                            int translationSpeed = words > 0 ? std::ceil(words / elapsedSeconds.count()) : 0;
+
+                            emit translationReady(Translation(std::move(segments), translationSpeed));
+                        }
                     } else {
                         // TODO: What? Raise error? Set model_ to ""?
                     }
@@ -160,14 +527,22 @@ MarianInterface::MarianInterface(QObject *parent)
 
             emit pendingChanged(false);
         }
+
+        // Wait for the batch that may still be decoding, while everything
+        // its callback touches is still around.
+        service.reset();
     });
 }
 
+translateLocally::CacheStats MarianInterface::cacheStats() const {
+    return {cacheHits_, cacheMisses_};
+}
+
 QString const &MarianInterface::model() const {
     return model_;
 }
 
-void MarianInterface::setModel(QString path_to_model_dir, const translateLocally::marianSettings &settings) {
+void MarianInterface::setModel(QString path_to_model_dir, const translateLocally::marianSettings &settings, QString translationMemory, QString path_to_pivot_model_dir, QString modelID, QString pivotID) {
     model_ = path_to_model_dir;
 
     // Empty model string means just "unload" the model. We don't do that (yet),
@@ -177,7 +552,7 @@ void MarianInterface::setModel(QString path_to_model_dir, const translateLocally
 
     // move my shared_ptr from stack to heap
     std::unique_lock<std::mutex> lock(mutex_);
-    std::unique_ptr<ModelDescription> model(new ModelDescription{model_.toStdString(), settings});
+    std::unique_ptr<ModelDescription> model(new ModelDescription{model_.toStdString(), settings, translationMemory, path_to_pivot_model_dir.toStdString(), modelID, pivotID});
     std::swap(pendingModel_, model);
 
     // notify worker if there wasn't already a pending model
@@ -185,13 +560,17 @@ void MarianInterface::setModel(QString path_to_model_dir, const translateLocally
 }
 
 void MarianInterface::translate(QString in) {
+    translate(in.toStdString());
+}
+
+void MarianInterface::translate(std::string &&in) {
     // If we don't have a model yet (loaded, or queued to be loaded, doesn't matter)
     // then don't bother trying to translate something.
     if (model_.isEmpty())
         return;
 
     std::unique_lock<std::mutex> lock(mutex_);
-    std::unique_ptr<std::string> input(new std::string(in.toStdString()));
+    std::unique_ptr<std::string> input(new std::string(std::move(in)));
     std::swap(pendingInput_, input);
     
     cv_.notify_one();
@@ -5,14 +5,55 @@
 #include <QObject>
 #include "types.h"
 #include "Translation.h"
+#include <atomic>
 #include <condition_variable>
 #include <mutex>
 #include <thread>
 #include <memory>
+#include <string>
 
 struct ModelDescription;
 
-constexpr const size_t kTranslationCacheSize = 1 << 16;
+namespace marian {
+    class Options;
+}
+
+// The bergamot service's cache is sized in sentences, our settings in MB. A
+// cached sentence takes roughly a kilobyte, which makes the default of 64 MB
+// about the 1 << 16 sentences we used to hard-code.
+constexpr const size_t kTranslationCacheEntriesPerMB = 1024;
+
+// Where translations are also cached by line (the GUI and native messaging),
+// the line cache gets this share of the cache size and the bergamot service
+// the rest, so together they stay within the size the settings ask for.
+constexpr const size_t kLineCachePercent = 50;
+
+/**
+ * Number of sentences the bergamot service should cache given our settings.
+ * @param lineCache whether it shares the budget with a line cache.
+ */
+inline size_t translationCacheEntries(translateLocally::marianSettings const &settings, bool lineCache = false) {
+    if (!settings.translation_cache)
+        return 0;
+
+    size_t entries = settings.translation_cache_size * kTranslationCacheEntriesPerMB;
+    return lineCache ? entries * (100 - kLineCachePercent) / 100 : entries;
+}
+
+/**
+ * Bytes the line cache next to the bergamot service may use.
+ */
+inline size_t lineCacheBytes(translateLocally::marianSettings const &settings) {
+    return settings.translation_cache ? settings.translation_cache_size * 1024 * 1024 * kLineCachePercent / 100 : 0;
+}
+
+/**
+ * Options to load the model in path_to_model_dir with for the bergamot
+ * service. Shared by the GUI, the command line and native messaging.
+ * @param alignment whether translations come with word alignments, which
+ * costs a bit of time.
+ */
+std::shared_ptr<marian::Options> makeOptions(const std::string &path_to_model_dir, const translateLocally::marianSettings &settings, bool alignment);
 
 class MarianInterface : public QObject {
     Q_OBJECT
@@ -27,12 +68,33 @@ private:
 
     std::thread worker_;
     QString model_;
+
+    // Copies of the line cache's counters, which lives in worker_.
+    std::atomic<size_t> cacheHits_;
+    std::atomic<size_t> cacheMisses_;
 public:
     MarianInterface(QObject * parent);
     ~MarianInterface();
     QString const &model() const;
-    void setModel(QString path_to_model_dir, const translateLocally::marianSettings& settings);
+    /**
+     * Loads the model in path_to_model_dir. Lines found in translationMemory
+     * (see TranslationMemory::pathFor()) are not translated again. If
+     * path_to_pivot_model_dir is given, translations go through that model
+     * as well, e.g. from German through English into French.
+     * If modelID (and pivotID, with a pivot) are given and the translateLocally
+     * daemon is running, the daemon translates with those models instead and
+     * they are not loaded in this process. If the daemon fails, they are
+     * loaded after all.
+     */
+    void setModel(QString path_to_model_dir, const translateLocally::marianSettings& settings, QString translationMemory = QString(), QString path_to_pivot_model_dir = QString(), QString modelID = QString(), QString pivotID = QString());
     void translate(QString in);
+    void translate(std::string &&in); // UTF-8
+
+    /**
+     * Hit and miss counters of the line cache, counted in lines, since this
+     * MarianInterface was created.
+     */
+    translateLocally::CacheStats cacheStats() const;
 signals:
     void translationReady(Translation translation);
     void pendingChanged(bool isBusy); // Disables issuing another translation while we are busy.
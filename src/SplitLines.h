@@ -0,0 +1,53 @@
+#pragma once
+#include <cctype>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace translateLocally {
+
+/**
+ * Part of the input as found by splitLines(). Either the content of a line, or
+ * the whitespace (including line breaks) in between.
+ */
+struct LineSegment {
+    std::size_t begin; // byte offsets in input
+    std::size_t end;
+    bool translate; // false for whitespace
+};
+
+/**
+ * Splits input into the content of each line, stripped of leading and trailing
+ * whitespace, and the whitespace in between. Together the segments cover all
+ * of the input.
+ */
+inline std::vector<LineSegment> splitLines(std::string const &input) {
+    std::vector<LineSegment> segments;
+    std::size_t pos = 0;
+
+    while (pos < input.size()) {
+        std::size_t begin = pos;
+        while (pos < input.size() && std::isspace(static_cast<unsigned char>(input[pos])))
+            ++pos;
+
+        if (pos > begin)
+            segments.push_back({begin, pos, false});
+
+        if (pos == input.size())
+            break;
+
+        std::size_t end = input.find('\n', pos);
+        if (end == std::string::npos)
+            end = input.size();
+
+        while (end > pos && std::isspace(static_cast<unsigned char>(input[end - 1])))
+            --end;
+
+        segments.push_back({pos, end, true});
+        pos = end;
+    }
+
+    return segments;
+}
+
+} // namespace translateLocally
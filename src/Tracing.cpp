@@ -0,0 +1,198 @@
+#include "Tracing.h"
+#include <QCoreApplication>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QThread>
+#include <QDebug>
+#include <algorithm>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace translateLocally::tracing {
+
+namespace detail {
+std::atomic<bool> enabled(false);
+}
+
+namespace {
+
+struct Event {
+    const char *category;
+    const char *name;
+    char phase; // 'X' for complete, 'b' and 'e' for async begin and end
+    std::int64_t timestamp; // microseconds since start()
+    std::int64_t duration; // microseconds, complete events only
+    std::uint64_t id; // async events only
+};
+
+/**
+ * Events of a single thread. Only that thread writes to it, the mutex is for
+ * dump() reading it from another thread. Uncontended, so cheap.
+ */
+struct ThreadBuffer {
+    std::mutex mutex;
+    std::vector<Event> events;
+    std::size_t capacity;
+    std::size_t next; // where the next event goes once the buffer is full
+    int tid;
+    QString name;
+
+    void push(Event const &event) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (events.size() < capacity) {
+            events.push_back(event);
+        } else {
+            events[next] = event;
+            next = (next + 1) % capacity;
+        }
+    }
+
+    // In chronological order
+    std::vector<Event> snapshot() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<Event> out(events.begin() + next, events.end());
+        out.insert(out.end(), events.begin(), events.begin() + next);
+        return out;
+    }
+};
+
+struct Registry {
+    std::mutex mutex;
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+    QString path;
+    std::size_t eventsPerThread = kDefaultEventsPerThread;
+    Clock::time_point epoch;
+
+    std::shared_ptr<ThreadBuffer> add() {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto buffer = std::make_shared<ThreadBuffer>();
+        buffer->capacity = eventsPerThread;
+        buffer->events.reserve(eventsPerThread);
+        buffer->next = 0;
+        buffer->tid = static_cast<int>(buffers.size()) + 1;
+
+        QCoreApplication *app = QCoreApplication::instance();
+        if (app && QThread::currentThread() == app->thread())
+            buffer->name = "main";
+        else
+            buffer->name = QString("thread %1").arg(buffer->tid);
+
+        buffers.push_back(buffer);
+        return buffer;
+    }
+};
+
+Registry &registry() {
+    static Registry instance;
+    return instance;
+}
+
+// Buffers are owned by the registry as well so events of threads that have
+// already finished still end up in the trace.
+ThreadBuffer &localBuffer() {
+    thread_local std::shared_ptr<ThreadBuffer> buffer = registry().add();
+    return *buffer;
+}
+
+std::int64_t sinceEpoch(Clock::time_point time) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(time - registry().epoch).count();
+}
+
+void dumpAtExit() {
+    dump();
+}
+
+} // Anonymous namespace
+
+bool start(QString const &path, std::size_t eventsPerThread) {
+#ifdef TRANSLATELOCALLY_TRACING
+    Registry &instance = registry(); // Constructed before atexit() so it outlives dumpAtExit
+    {
+        std::lock_guard<std::mutex> lock(instance.mutex);
+        instance.path = path;
+        instance.eventsPerThread = std::max<std::size_t>(eventsPerThread, 1);
+        instance.epoch = Clock::now();
+    }
+
+    if (!detail::enabled.exchange(true))
+        std::atexit(dumpAtExit);
+
+    return true;
+#else
+    Q_UNUSED(path);
+    Q_UNUSED(eventsPerThread);
+    return false;
+#endif
+}
+
+bool dump() {
+    if (!enabled())
+        return false;
+
+    Registry &instance = registry();
+
+    QJsonArray events;
+    QString path;
+    {
+        std::lock_guard<std::mutex> lock(instance.mutex);
+        path = instance.path;
+
+        for (auto &&buffer : instance.buffers) {
+            events.append(QJsonObject{
+                {"ph", "M"},
+                {"name", "thread_name"},
+                {"pid", 1},
+                {"tid", buffer->tid},
+                {"args", QJsonObject{{"name", buffer->name}}}
+            });
+
+            for (auto &&event : buffer->snapshot()) {
+                QJsonObject json{
+                    {"ph", QString(QChar(event.phase))},
+                    {"cat", QString::fromLatin1(event.category)},
+                    {"name", QString::fromLatin1(event.name)},
+                    {"pid", 1},
+                    {"tid", buffer->tid},
+                    {"ts", static_cast<qint64>(event.timestamp)}
+                };
+
+                if (event.phase == 'X')
+                    json["dur"] = static_cast<qint64>(event.duration);
+                else
+                    json["id"] = QString::number(event.id);
+
+                events.append(json);
+            }
+        }
+    }
+
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning() << "Could not write trace to" << path << ":" << file.errorString();
+        return false;
+    }
+
+    file.write(QJsonDocument(QJsonObject{
+        {"traceEvents", events},
+        {"displayTimeUnit", "ms"}
+    }).toJson(QJsonDocument::Compact));
+    return true;
+}
+
+void complete(const char *category, const char *name, Clock::time_point begin, Clock::time_point end) {
+    localBuffer().push(Event{category, name, 'X', sinceEpoch(begin), std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count(), 0});
+}
+
+void asyncBegin(const char *category, const char *name, std::uint64_t id) {
+    localBuffer().push(Event{category, name, 'b', sinceEpoch(Clock::now()), 0, id});
+}
+
+void asyncEnd(const char *category, const char *name, std::uint64_t id) {
+    localBuffer().push(Event{category, name, 'e', sinceEpoch(Clock::now()), 0, id});
+}
+
+} // namespace translateLocally::tracing
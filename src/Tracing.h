@@ -0,0 +1,101 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <QString>
+
+/**
+ * Lightweight tracing of where the time goes in a session: reading requests,
+ * parsing, finding and loading models, waiting for the translation service,
+ * writing responses. Spans are recorded into a ring buffer per thread and
+ * written as a Chrome trace (open in chrome://tracing or ui.perfetto.dev) when
+ * the program exits.
+ *
+ * The TRACE_* macros only record anything when translateLocally is built with
+ * -DTRACING=ON, otherwise they compile to nothing. Even then nothing is recorded
+ * until tracing::start() is called, which `--trace out.json` does.
+ *
+ * Names and categories must be string literals: only the pointers are stored.
+ */
+namespace translateLocally::tracing {
+
+using Clock = std::chrono::steady_clock;
+
+// Per thread. The oldest events are overwritten once the buffer is full.
+static const std::size_t constexpr kDefaultEventsPerThread = 1 << 16;
+
+namespace detail {
+extern std::atomic<bool> enabled;
+}
+
+/**
+ * @brief Starts recording events, and writes them to path when the program exits.
+ * @return false if this build does not support tracing.
+ */
+bool start(QString const &path, std::size_t eventsPerThread = kDefaultEventsPerThread);
+
+/**
+ * @brief Writes all events recorded so far to the path passed to start().
+ * @return false if tracing wasn't started or the file could not be written.
+ */
+bool dump();
+
+inline bool enabled() {
+    return detail::enabled.load(std::memory_order_relaxed);
+}
+
+/**
+ * @brief Records a span that started and ended on the current thread.
+ */
+void complete(const char *category, const char *name, Clock::time_point begin, Clock::time_point end);
+
+/**
+ * @brief Records the start and end of a span that may end on another thread
+ *        than it started on, e.g. a request waiting for the translation service.
+ *        Begin and end are matched on category, name and id.
+ */
+void asyncBegin(const char *category, const char *name, std::uint64_t id);
+void asyncEnd(const char *category, const char *name, std::uint64_t id);
+
+/**
+ * Records the lifetime of the object as a span.
+ */
+class Span {
+public:
+    Span(const char *category, const char *name)
+    : category_(category)
+    , name_(name)
+    , active_(enabled())
+    , begin_(active_ ? Clock::now() : Clock::time_point()) {
+        //
+    }
+
+    ~Span() {
+        if (active_)
+            complete(category_, name_, begin_, Clock::now());
+    }
+
+    Span(Span const &) = delete;
+    Span &operator=(Span const &) = delete;
+
+private:
+    const char *category_;
+    const char *name_;
+    bool active_;
+    Clock::time_point begin_;
+};
+
+} // namespace translateLocally::tracing
+
+#ifdef TRANSLATELOCALLY_TRACING
+#define TRACE_CONCAT_IMPL(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_IMPL(a, b)
+#define TRACE_SPAN(category, name) translateLocally::tracing::Span TRACE_CONCAT(traceSpan_, __LINE__)(category, name)
+#define TRACE_ASYNC_BEGIN(category, name, id) do { if (translateLocally::tracing::enabled()) translateLocally::tracing::asyncBegin(category, name, id); } while (0)
+#define TRACE_ASYNC_END(category, name, id) do { if (translateLocally::tracing::enabled()) translateLocally::tracing::asyncEnd(category, name, id); } while (0)
+#else
+#define TRACE_SPAN(category, name) do {} while (0)
+#define TRACE_ASYNC_BEGIN(category, name, id) do {} while (0)
+#define TRACE_ASYNC_END(category, name, id) do {} while (0)
+#endif
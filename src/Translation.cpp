@@ -1,5 +1,6 @@
 #include "Translation.h"
 #include "3rd_party/bergamot-translator/src/translator/response.h"
+#include <algorithm>
 
 namespace {
 
@@ -67,84 +68,63 @@ marian::bergamot::AnnotatedText const &_target(marian::bergamot::Response const
         return response.source;
 }
 
-} // Anonymous namespace
-
-Translation::Translation()
-: response_(nullptr)
-, speed_(-1) {
-    //
-}
-
-Translation::Translation(marian::bergamot::Response &&response, int speed)
-: response_(std::make_shared<marian::bergamot::Response>(std::move(response)))
-, speed_(speed) {
-    //
-}
-
-QString Translation::translation() const {
-    return QString::fromStdString(response_->target.text);
-}
-
-QVector<WordAlignment> Translation::alignments(Direction direction, int sourcePosFirst, int sourcePosLast) const {
+/**
+ * Alignment lookup for a single response. See Translation::alignments().
+ */
+QVector<WordAlignment> alignments(marian::bergamot::Response const &response, Translation::Direction direction, int sourcePosFirst, int sourcePosLast) {
     QVector<WordAlignment> alignments;
     std::size_t sentenceIdxFirst, sentenceIdxLast, wordIdxFirst, wordIdxLast;
 
-    if (!response_)
+    std::size_t sourceOffsetFirst = ::positionToOffset(::_source(response, direction).text, sourcePosFirst);
+    if (!::findWordByByteOffset(::_source(response, direction).annotation, sourceOffsetFirst, sentenceIdxFirst, wordIdxFirst))
         return alignments;
 
-    if (sourcePosFirst > sourcePosLast)
-        std::swap(sourcePosFirst, sourcePosLast);
-
-    std::size_t sourceOffsetFirst = ::positionToOffset(::_source(*response_, direction).text, sourcePosFirst);
-    if (!::findWordByByteOffset(::_source(*response_, direction).annotation, sourceOffsetFirst, sentenceIdxFirst, wordIdxFirst))
-        return alignments;
-
-    std::size_t sourceOffsetLast = ::positionToOffset(::_source(*response_, direction).text, sourcePosLast);
-    if (!::findWordByByteOffset(::_source(*response_, direction).annotation, sourceOffsetLast, sentenceIdxLast, wordIdxLast))
+    std::size_t sourceOffsetLast = ::positionToOffset(::_source(response, direction).text, sourcePosLast);
+    if (!::findWordByByteOffset(::_source(response, direction).annotation, sourceOffsetLast, sentenceIdxLast, wordIdxLast))
         return alignments;
 
     assert(sentenceIdxFirst <= sentenceIdxLast);
     assert(sentenceIdxFirst != sentenceIdxLast || wordIdxFirst <= wordIdxLast);
-    assert(sentenceIdxLast < response_->alignments.size());
+    assert(sentenceIdxLast < response.alignments.size());
 
     // Format:
-    // response_->alignments[sentence:size_t][target token:size_t][source token:size_t] = probability:float
+    // response.alignments[sentence:size_t][target token:size_t][source token:size_t] = probability:float
 
     auto append = [&](marian::bergamot::ByteRange const &span, float prob) {
         WordAlignment alignment;
-        alignment.begin = ::offsetToPosition(::_target(*response_, direction).text, span.begin);
-        alignment.end = ::offsetToPosition(::_target(*response_, direction).text, span.end);
+        alignment.begin = ::offsetToPosition(::_target(response, direction).text, span.begin);
+        alignment.end = ::offsetToPosition(::_target(response, direction).text, span.end);
         alignment.prob = prob;
         alignments.append(alignment);
     };
 
     for (std::size_t sentenceIdx = sentenceIdxFirst; sentenceIdx <= sentenceIdxLast; ++sentenceIdx) {
-        assert(sentenceIdx < response_->alignments.size());
+        assert(sentenceIdx < response.alignments.size());
         std::size_t firstWord = sentenceIdx == sentenceIdxFirst ? wordIdxFirst : 0;
-        std::size_t lastWord = sentenceIdx == sentenceIdxLast ? wordIdxLast : ::_source(*response_, direction).numWords(sentenceIdx) - 1;
+        std::size_t lastWord = sentenceIdx == sentenceIdxLast ? wordIdxLast : ::_source(response, direction).numWords(sentenceIdx) - 1;
         
         // If no alignments were provided by the model, this array will be empty
-        if (response_->alignments[sentenceIdx].empty())
+        if (response.alignments[sentenceIdx].empty())
             continue;
 
         if (direction == Translation::source_to_translation) {
-            assert(firstWord < response_->source.numWords(sentenceIdx));
-            assert(lastWord <= response_->source.numWords(sentenceIdx));
+            assert(firstWord < response.source.numWords(sentenceIdx));
+            assert(lastWord <= response.source.numWords(sentenceIdx));
 
-            for (size_t t = 0; t < response_->target.numWords(sentenceIdx); ++t) {
+            for (size_t t = 0; t < response.target.numWords(sentenceIdx); ++t) {
                 for (size_t s = firstWord; s <= lastWord; ++s) {
-                    if (response_->alignments[sentenceIdx][t][s] >= 0.1f) // TODO top N or something?
-                        append(response_->target.wordAsByteRange(sentenceIdx, t), response_->alignments[sentenceIdx][t][s]);
+                    if (response.alignments[sentenceIdx][t][s] >= 0.1f) // TODO top N or something?
+                        append(response.target.wordAsByteRange(sentenceIdx, t), response.alignments[sentenceIdx][t][s]);
                 }
             }
         } else {
-            assert(firstWord < response_->target.numWords(sentenceIdx));
-            assert(lastWord < response_->target.numWords(sentenceIdx));
+            assert(firstWord < response.target.numWords(sentenceIdx));
+            assert(lastWord < response.target.numWords(sentenceIdx));
 
             for (size_t t = firstWord; t <= lastWord; ++t) {
-                for (size_t s = 0; s < response_->source.numWords(sentenceIdx); ++s) {
-                    if (response_->alignments[sentenceIdx][t][s] >= 0.1f) // TODO top N or something?
-                        append(response_->source.wordAsByteRange(sentenceIdx, s), response_->alignments[sentenceIdx][t][s]);
+                for (size_t s = 0; s < response.source.numWords(sentenceIdx); ++s) {
+                    if (response.alignments[sentenceIdx][t][s] >= 0.1f) // TODO top N or something?
+                        append(response.source.wordAsByteRange(sentenceIdx, s), response.alignments[sentenceIdx][t][s]);
                 }
             }
         }
@@ -157,3 +137,92 @@ QVector<WordAlignment> Translation::alignments(Direction direction, int sourcePo
 
     return alignments;
 }
+
+} // Anonymous namespace
+
+Translation::Translation()
+: spans_(nullptr)
+, speed_(-1) {
+    //
+}
+
+Translation::Translation(marian::bergamot::Response &&response, int speed)
+: Translation(std::vector<Segment>{std::make_shared<marian::bergamot::Response>(std::move(response))}, speed) {
+    //
+}
+
+Translation::Translation(std::vector<Segment> &&segments, int speed)
+: spans_(std::make_shared<std::vector<Span>>())
+, speed_(speed) {
+    int sourcePos = 0;
+    int targetPos = 0;
+
+    spans_->reserve(segments.size());
+
+    for (auto &&segment : segments) {
+        Span span{std::move(segment), sourcePos, targetPos, 0, 0};
+
+        if (auto response = std::get_if<std::shared_ptr<marian::bergamot::Response>>(&span.segment)) {
+            span.sourceLength = ::offsetToPosition((*response)->source.text, (*response)->source.text.size());
+            span.targetLength = ::offsetToPosition((*response)->target.text, (*response)->target.text.size());
+        } else {
+            std::string const &text = std::get<std::string>(span.segment);
+            span.sourceLength = span.targetLength = ::offsetToPosition(text, text.size());
+        }
+
+        sourcePos += span.sourceLength;
+        targetPos += span.targetLength;
+        spans_->push_back(std::move(span));
+    }
+}
+
+QString Translation::translation() const {
+    return QString::fromStdString(translationUtf8());
+}
+
+std::string Translation::translationUtf8() const {
+    if (!spans_)
+        return std::string();
+
+    std::string text;
+    for (auto &&span : *spans_) {
+        if (auto response = std::get_if<std::shared_ptr<marian::bergamot::Response>>(&span.segment))
+            text += (*response)->target.text;
+        else
+            text += std::get<std::string>(span.segment);
+    }
+
+    return text;
+}
+
+QVector<WordAlignment> Translation::alignments(Direction direction, int sourcePosFirst, int sourcePosLast) const {
+    QVector<WordAlignment> alignments;
+
+    if (!spans_)
+        return alignments;
+
+    if (sourcePosFirst > sourcePosLast)
+        std::swap(sourcePosFirst, sourcePosLast);
+
+    for (auto &&span : *spans_) {
+        auto response = std::get_if<std::shared_ptr<marian::bergamot::Response>>(&span.segment);
+        if (!response)
+            continue;
+
+        int pos = direction == source_to_translation ? span.sourcePos : span.targetPos;
+        int length = direction == source_to_translation ? span.sourceLength : span.targetLength;
+        int offset = direction == source_to_translation ? span.targetPos : span.sourcePos;
+
+        // Skip responses that the selection does not touch.
+        if (sourcePosLast < pos || sourcePosFirst > pos + length)
+            continue;
+
+        for (WordAlignment alignment : ::alignments(**response, direction, std::max(sourcePosFirst - pos, 0), std::min(sourcePosLast - pos, length))) {
+            alignment.begin += offset;
+            alignment.end += offset;
+            alignments.append(alignment);
+        }
+    }
+
+    return alignments;
+}
@@ -3,6 +3,9 @@
 #include <QString>
 #include <QVector>
 #include <memory>
+#include <string>
+#include <variant>
+#include <vector>
 
 namespace marian {
     namespace bergamot {
@@ -22,15 +25,33 @@ struct WordAlignment {
 };
 
 /**
- * Wrapper around a translation response from the bergamot service. Hides that
+ * Wrapper around translation responses from the bergamot service. Hides that
  * interface from the rest of the Qt code, and provides utility functions to
  * access alignment information with character offsets instead of byte offsets.
+ * A translation can be stitched together from multiple responses, e.g. when
+ * some of the input was translated before and came out of a cache.
  */
 class Translation {
+public:
+    /**
+     * Building block of a translation: either a response from the bergamot
+     * service, or a bit of text (typically whitespace) that is copied from the
+     * input to the translation verbatim.
+     */
+    using Segment = std::variant<std::shared_ptr<marian::bergamot::Response>, std::string>;
+
 private:
+    struct Span {
+        Segment segment;
+        int sourcePos; // Note: char offsets in source and translation (not byte offsets)
+        int targetPos;
+        int sourceLength;
+        int targetLength;
+    };
+
     // Note: I would have liked unique_ptr, but that does not go well with
     // passing Translation objects through Qt signals/slots.
-    std::shared_ptr<marian::bergamot::Response> response_;
+    std::shared_ptr<std::vector<Span>> spans_;
 
     // Words per second as measured by runtime/word count in MarianInterface
     // @TODO this could probably be part of marian::bergamot::Response in the future
@@ -38,17 +59,22 @@ private:
 public:
     Translation();
     Translation(marian::bergamot::Response &&response, int speed);
+    Translation(std::vector<Segment> &&segments, int speed);
 
     /**
      * Bool operator to check whether this is an initialised translation or just
      * an empty object.
      */
     inline operator bool() const {
-        return !!response_;
+        return !!spans_;
     }
 
+    /**
+     * Translation speed, or 0 if nothing had to be translated (e.g. all of it
+     * came out of the cache.)
+     */
     inline std::size_t wordsPerSecond() const {
-        return speed_;
+        return speed_ > 0 ? speed_ : 0;
     }
 
     /**
@@ -56,6 +82,11 @@ public:
      */
     QString translation() const;
 
+    /**
+     * Translation result as UTF-8, without converting it to a QString first.
+     */
+    std::string translationUtf8() const;
+
     enum Direction { source_to_translation, translation_to_source };
 
     /**
@@ -0,0 +1,110 @@
+#pragma once
+#include <cstddef>
+#include <list>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include "types.h"
+
+/**
+ * Cache for translated segments. Every entry has a cost (e.g. its approximate
+ * size in bytes) and once the total cost exceeds `capacity`, entries are
+ * evicted according to the eviction policy: the least recently used one (LRU)
+ * or the oldest one (FIFO). A capacity of 0 disables the cache. Not
+ * thread-safe: it is meant to be owned by a single worker thread.
+ */
+template <typename Key, typename Value>
+class TranslationCache {
+private:
+    struct Entry {
+        Key key;
+        Value value;
+        std::size_t cost;
+    };
+
+    // Next entry to evict at the back.
+    std::list<Entry> entries_;
+    std::unordered_map<Key, typename std::list<Entry>::iterator> index_;
+    std::size_t capacity_;
+    std::size_t cost_;
+    translateLocally::CacheEviction eviction_;
+    translateLocally::CacheStats stats_;
+
+    void evict() {
+        while (cost_ > capacity_ && !entries_.empty()) {
+            cost_ -= entries_.back().cost;
+            index_.erase(entries_.back().key);
+            entries_.pop_back();
+        }
+    }
+
+public:
+    explicit TranslationCache(std::size_t capacity = 0, translateLocally::CacheEviction eviction = translateLocally::CacheEviction::LRU)
+    : capacity_(capacity)
+    , cost_(0)
+    , eviction_(eviction)
+    , stats_{0, 0} {
+        //
+    }
+
+    std::optional<Value> find(Key const &key) {
+        auto it = index_.find(key);
+        if (it == index_.end()) {
+            ++stats_.misses;
+            return std::nullopt;
+        }
+
+        ++stats_.hits;
+
+        // Mark as most recently used
+        if (eviction_ == translateLocally::CacheEviction::LRU)
+            entries_.splice(entries_.begin(), entries_, it->second);
+
+        return it->second->value;
+    }
+
+    void insert(Key const &key, Value value, std::size_t cost = 1) {
+        if (capacity_ == 0 || cost > capacity_)
+            return;
+
+        auto it = index_.find(key);
+        if (it != index_.end()) {
+            cost_ -= it->second->cost;
+            entries_.erase(it->second);
+            index_.erase(it);
+        }
+
+        entries_.push_front(Entry{key, std::move(value), cost});
+        index_.emplace(key, entries_.begin());
+        cost_ += cost;
+
+        evict();
+    }
+
+    void setCapacity(std::size_t capacity) {
+        capacity_ = capacity;
+        evict();
+    }
+
+    void setEviction(translateLocally::CacheEviction eviction) {
+        eviction_ = eviction;
+    }
+
+    void clear() {
+        index_.clear();
+        entries_.clear();
+        cost_ = 0;
+    }
+
+    inline std::size_t size() const {
+        return entries_.size();
+    }
+
+    inline std::size_t cost() const {
+        return cost_;
+    }
+
+    inline translateLocally::CacheStats stats() const {
+        return stats_;
+    }
+};
@@ -0,0 +1,277 @@
+#include "BatchTranslator.h"
+#include "3rd_party/bergamot-translator/src/translator/service.h"
+#include "3rd_party/bergamot-translator/src/translator/parser.h"
+#include "3rd_party/bergamot-translator/src/translator/response.h"
+#include "translator/translation_model.h"
+#include "MarianInterface.h"
+#include "Affinity.h"
+#include "SplitLines.h"
+#include "Tracing.h"
+#include "tm/TranslationMemory.h"
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+namespace {
+
+/**
+ * Input that has been sent off to be translated. Shared with the translation
+ * callbacks.
+ */
+struct PendingInput {
+    std::string input;
+    std::vector<translateLocally::LineSegment> segments;
+    std::vector<std::string> translations; // For segments that are translated
+    std::mutex mutex;
+    std::size_t remaining; // Segments still being translated
+    QString error;
+    std::function<void(std::string &&, QString const &)> callback;
+
+    // Puts the translated lines and the whitespace in between back together.
+    void finish() {
+        std::string output;
+        if (error.isEmpty()) {
+            for (std::size_t i = 0; i < segments.size(); ++i) {
+                auto const &segment = segments[i];
+                if (segment.translate)
+                    output += translations[i];
+                else
+                    output.append(input, segment.begin, segment.end - segment.begin);
+            }
+        }
+        callback(std::move(output), error);
+    }
+};
+
+/**
+ * A file that has been read and sent off to be translated.
+ */
+struct FileInProgress {
+    std::size_t index; // In jobs
+    std::string output;
+    std::size_t bytes;
+    std::size_t lines;
+    QString error;
+    std::chrono::steady_clock::time_point start;
+};
+
+} // Anonymous namespace
+
+BatchTranslator::BatchTranslator(QString const &modelPath, QString const &pivotPath, translateLocally::marianSettings const &settings, QString const &translationMemory, double fuzzyThreshold)
+: memory_(translateLocally::TranslationMemory::open(translationMemory))
+, fuzzyThreshold_(fuzzyThreshold)
+, fuzzyMatches_(0) {
+    translateLocally::marianSettings adjusted = settings;
+
+    // Same as MarianInterface: no more workers than CPUs they may run on.
+    translateLocally::affinity::CpuSet cpus = translateLocally::affinity::workerCpus(settings.cpu_affinity, settings.avoid_smt);
+    if (!cpus.empty())
+        adjusted.cpu_threads = std::min(adjusted.cpu_threads, cpus.size());
+
+    marian::bergamot::AsyncService::Config serviceConfig;
+    serviceConfig.numWorkers = adjusted.cpu_threads;
+    serviceConfig.cacheSize = translationCacheEntries(adjusted);
+
+    // Workers inherit the CPUs and priority of the thread that starts them,
+    // and the model's memory is first touched close to them.
+    translateLocally::affinity::runPinned(cpus, adjusted.nice, [&]() {
+        service_ = std::make_unique<marian::bergamot::AsyncService>(serviceConfig);
+        model_ = std::make_shared<marian::bergamot::TranslationModel>(makeOptions(modelPath.toStdString(), adjusted, false), adjusted.cpu_threads);
+        if (!pivotPath.isEmpty())
+            pivot_ = std::make_shared<marian::bergamot::TranslationModel>(makeOptions(pivotPath.toStdString(), adjusted, false), adjusted.cpu_threads);
+    });
+}
+
+BatchTranslator::~BatchTranslator() {
+    //
+}
+
+std::size_t BatchTranslator::translate(std::string &&input, std::function<void(std::string &&, QString const &)> callback) {
+    auto pending = std::make_shared<PendingInput>();
+    pending->input = std::move(input);
+    pending->segments = translateLocally::splitLines(pending->input);
+    pending->translations.resize(pending->segments.size());
+    pending->callback = std::move(callback);
+
+    // Lines that are in the translation memory don't need translating.
+    std::size_t lines = 0;
+    std::vector<std::size_t> misses;
+    for (std::size_t i = 0; i < pending->segments.size(); ++i) {
+        auto const &segment = pending->segments[i];
+        if (!segment.translate)
+            continue;
+
+        lines++;
+        std::optional<std::string> match;
+        if (memory_) {
+            std::string line = pending->input.substr(segment.begin, segment.end - segment.begin);
+            match = memory_->find(line);
+            if (!match && fuzzyThreshold_ > 0.0) {
+                auto matches = memory_->findFuzzy(line, fuzzyThreshold_, 1);
+                if (!matches.empty()) {
+                    match = std::move(matches.front().target);
+                    ++fuzzyMatches_;
+                }
+            }
+        }
+        if (match)
+            pending->translations[i] = std::move(*match);
+        else
+            misses.push_back(i);
+    }
+
+    if (misses.empty()) {
+        pending->finish();
+        return lines;
+    }
+
+    pending->remaining = misses.size();
+
+    marian::bergamot::ResponseOptions options; // Just the text, no alignments
+
+    std::size_t submitted = 0;
+    try {
+        for (std::size_t i : misses) {
+            auto const &segment = pending->segments[i];
+            auto callback = [pending, i](marian::bergamot::Response &&response) {
+                bool last;
+                {
+                    std::lock_guard<std::mutex> lock(pending->mutex);
+                    pending->translations[i] = std::move(response.target.text);
+                    last = --pending->remaining == 0;
+                }
+                if (last)
+                    pending->finish();
+            };
+
+            // Lines are pivoted one by one, so the second model can start on
+            // the first lines while the first model works on the rest.
+            if (pivot_)
+                service_->pivot(model_, pivot_, pending->input.substr(segment.begin, segment.end - segment.begin), callback, options);
+            else
+                service_->translate(model_, pending->input.substr(segment.begin, segment.end - segment.begin), callback, options);
+            ++submitted;
+        }
+    } catch (const std::runtime_error &e) {
+        // The lines that were submitted still call back, whoever is last
+        // hands the input back.
+        bool last;
+        {
+            std::lock_guard<std::mutex> lock(pending->mutex);
+            pending->error = QString::fromStdString(e.what());
+            pending->remaining -= misses.size() - submitted;
+            last = pending->remaining == 0;
+        }
+        if (last)
+            pending->finish();
+    }
+
+    return lines;
+}
+
+translateLocally::CacheStats BatchTranslator::cacheStats() const {
+    marian::bergamot::CacheStats stats = service_->cacheStats();
+    return {stats.hits, stats.misses};
+}
+
+std::size_t BatchTranslator::translationMemoryHits() const {
+    return memory_ ? memory_->hits() : 0;
+}
+
+std::size_t BatchTranslator::fuzzyMatches() const {
+    return fuzzyMatches_;
+}
+
+std::vector<BatchTranslator::Result> BatchTranslator::run(std::vector<Job> const &jobs, std::size_t filesInFlight, std::function<void(Result const &)> const &progress) {
+    std::vector<Result> results(jobs.size());
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::shared_ptr<FileInProgress>> finished;
+
+    auto complete = [&](FileInProgress &file) {
+        TRACE_SPAN("cli", "writeOutput");
+        Job const &job = jobs[file.index];
+
+        if (file.error.isEmpty()) {
+            QDir().mkpath(QFileInfo(job.output).absolutePath());
+
+            // Only replaces the output once everything is written.
+            QSaveFile out(job.output);
+            if (out.open(QIODevice::WriteOnly))
+                out.write(file.output.data(), file.output.size());
+
+            if (!out.commit())
+                file.error = QString("Could not write %1: %2").arg(job.output, out.errorString());
+        }
+
+        results[file.index] = Result{
+            job.input,
+            job.output,
+            file.error,
+            file.bytes,
+            file.lines,
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - file.start).count()
+        };
+
+        progress(results[file.index]);
+    };
+
+    std::size_t next = 0;
+    std::size_t inFlight = 0;
+    filesInFlight = std::max<std::size_t>(1, filesInFlight);
+
+    while (next < jobs.size() || inFlight > 0) {
+        // Keep the workers fed: read files until there are enough in flight.
+        while (next < jobs.size() && inFlight < filesInFlight) {
+            TRACE_SPAN("cli", "readInput");
+            auto file = std::make_shared<FileInProgress>();
+            file->index = next++;
+            file->bytes = 0;
+            file->lines = 0;
+            file->start = std::chrono::steady_clock::now();
+
+            QFile in(jobs[file->index].input);
+            if (!in.open(QIODevice::ReadOnly)) {
+                file->error = QString("Could not read %1: %2").arg(jobs[file->index].input, in.errorString());
+                complete(*file);
+                continue;
+            }
+
+            QByteArray bytes = in.readAll();
+            file->bytes = bytes.size();
+            ++inFlight;
+
+            file->lines = translate(std::string(bytes.constData(), bytes.size()), [&mutex, &cv, &finished, file](std::string &&output, QString const &error) {
+                std::lock_guard<std::mutex> lock(mutex);
+                file->output = std::move(output);
+                file->error = error;
+                finished.push_back(file);
+                cv.notify_one();
+            });
+        }
+
+        if (inFlight == 0)
+            continue;
+
+        // Write files as they come back, while the workers carry on with the rest.
+        std::shared_ptr<FileInProgress> file;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&]() { return !finished.empty(); });
+            file = std::move(finished.front());
+            finished.pop_front();
+        }
+
+        --inFlight;
+        complete(*file);
+    }
+
+    return results;
+}
@@ -0,0 +1,105 @@
+#pragma once
+#include <QString>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "types.h"
+
+// If we include the actual header, we break QT compilation.
+namespace marian {
+    namespace bergamot {
+    class AsyncService;
+    class TranslationModel;
+    }
+}
+
+namespace translateLocally {
+    class TranslationMemory;
+}
+
+/**
+ * Translates many files with a model that is loaded only once, for
+ * `translateLocally -m <model> --output-dir <dir> <files>`. Several files are
+ * in flight at the same time, so the workers can batch sentences from all of
+ * them. Outputs are written to a temporary file that replaces the output only
+ * once it is complete, so an interrupted run never leaves half a translation.
+ *
+ * The command line also uses it to translate stdin or a file chunk by chunk,
+ * with several chunks in flight.
+ */
+class BatchTranslator {
+public:
+    struct Job {
+        QString input;
+        QString output;
+    };
+
+    struct Result {
+        QString input;
+        QString output;
+        QString error; // Empty if the file was translated
+        std::size_t bytes; // Size of the input
+        std::size_t lines; // Lines that were translated
+        double seconds; // From reading the input to writing the output
+    };
+
+    /**
+     * @brief Starts the translation service and loads the model. May throw
+     * std::runtime_error if the model can't be loaded.
+     * @param pivotPath if not empty, a second model to translate the output
+     * of the first with, e.g. from English into German after Spanish into
+     * English.
+     * @param translationMemory lines found in it are not translated again.
+     * Optional, see TranslationMemory::pathFor().
+     * @param fuzzyThreshold if above 0, neither are lines that are at least
+     * this similar to a line in the translation memory. They get the
+     * translation of the most similar one.
+     */
+    BatchTranslator(QString const &modelPath, QString const &pivotPath, translateLocally::marianSettings const &settings, QString const &translationMemory = QString(), double fuzzyThreshold = 0.0);
+    ~BatchTranslator();
+
+    /**
+     * @brief Translates the lines of input. Whitespace around and in between
+     * lines is kept as is.
+     * @param callback called with the translation, or an error, once all lines
+     * are translated. Called from a worker thread, or right away if there is
+     * nothing to translate.
+     * @return The number of lines translated, including those that came out
+     * of the translation memory.
+     */
+    std::size_t translate(std::string &&input, std::function<void(std::string &&output, QString const &error)> callback);
+
+    /**
+     * @brief Hit and miss counters of the service's translation cache.
+     */
+    translateLocally::CacheStats cacheStats() const;
+
+    /**
+     * @brief Lines that came out of the translation memory.
+     */
+    std::size_t translationMemoryHits() const;
+
+    /**
+     * @brief Lines that got the translation of a similar line in the
+     * translation memory.
+     */
+    std::size_t fuzzyMatches() const;
+
+    /**
+     * @brief Translates all jobs, with at most filesInFlight files read but
+     * not yet written at the same time.
+     * @param progress called on the calling thread whenever a file is done.
+     * @return The result of each job, in the same order.
+     */
+    std::vector<Result> run(std::vector<Job> const &jobs, std::size_t filesInFlight, std::function<void(Result const &)> const &progress);
+
+private:
+    std::unique_ptr<marian::bergamot::AsyncService> service_;
+    std::shared_ptr<marian::bergamot::TranslationModel> model_;
+    std::shared_ptr<marian::bergamot::TranslationModel> pivot_; // Or nullptr
+    std::shared_ptr<translateLocally::TranslationMemory const> memory_;
+    double fuzzyThreshold_;
+    std::size_t fuzzyMatches_;
+};
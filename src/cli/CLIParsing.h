@@ -10,7 +10,8 @@ namespace translateLocally {
 enum AppType {
     CLI,
     GUI,
-    NativeMsg
+    NativeMsg,
+    Daemon // And/or HTTP server
 };
 
 /**
@@ -29,6 +30,7 @@ static void CLIArgumentInit(QAppType& translateLocallyApp, QCommandLineParser& p
     parser.addOption({{"d", "download-model"}, QObject::tr("Connect to the Internet and download a model."), "output", ""});
     parser.addOption({{"r", "remove-model"}, QObject::tr("Remove a model from the local machine. Only works for models managed with translateLocally."), "output", ""});
     parser.addOption({{"m", "model"}, QObject::tr("Select model for translation."), "model", ""});
+    parser.addOption({"pivot", QObject::tr("Translate the output of the model further with this model, e.g. -m es-en-tiny --pivot en-de-tiny for Spanish to German."), "model"});
     parser.addOption({{"i", "input"}, QObject::tr("Source translation file (or just used stdin)."), "input", ""});
     parser.addOption({{"o", "output"}, QObject::tr("Target translation file (or just used stdout)."), "output", ""});
     parser.addOption({{"p", "plugin"}, QObject::tr("Start native message server to use for a browser plugin.")});
@@ -36,6 +38,25 @@ static void CLIArgumentInit(QAppType& translateLocallyApp, QCommandLineParser& p
     parser.addOption({"remove-client", QObject::tr("Remove a native messaging client id.")});
     parser.addOption({"list-clients", QObject::tr("List allowed native messaging clients")});
     parser.addOption({"update-manifests", QObject::tr("Register native messaging clients with user profile.")});
+    parser.addOption({"daemon", QObject::tr("Run in the background and serve translations to browsers and the command line, so models are only loaded once.")});
+    parser.addOption({"serve", QObject::tr("Serve translations over HTTP on this port of localhost. Can be combined with --daemon."), "port"});
+    parser.addOption({"no-daemon", QObject::tr("Do not use the translateLocally daemon, even if it is running.")});
+    parser.addOption({"output-dir", QObject::tr("Translate all files passed as arguments (or in directories, or matching patterns like *.txt) into this directory, loading the model only once."), "dir"});
+    parser.addOption({"jobs", QObject::tr("Files to translate at the same time with --output-dir."), "n"});
+    parser.addOption({"manifest", QObject::tr("Where to write the list of translated files, their timing and status with --output-dir. Defaults to manifest.json in the output directory."), "file"});
+    parser.addOption({"tm-import", QObject::tr("Add the translations in this TSV (source, tab, target) or TMX file to the translation memory of the model's language pair."), "file"});
+    parser.addOption({"tm-fuzzy", QObject::tr("Also take the translation from the translation memory for lines that are at least this similar (0 to 1, e.g. 0.8) to a line in it, instead of translating them."), "threshold"});
+    parser.addOption({"tsv-column", QObject::tr("Input is tab-separated: only translate this column (counting from 1), pass the others through."), "n"});
+    parser.addOption({"jsonl-field", QObject::tr("Input is a JSON object per line: only translate this field, pass the rest through."), "name"});
+    parser.addOption({"bitext", QObject::tr("Keep the source text and add the translation next to it: as a second column, an extra last column with --tsv-column, or a <name>_translation field with --jsonl-field.")});
+    parser.addOption({"resume", QObject::tr("Regularly save how far the translation of -i into -o got, and continue from there if it was interrupted before.")});
+    parser.addOption({"cache-size", QObject::tr("Memory to use for caching translations, in MB. Overrides the setting from the GUI."), "MB"});
+    parser.addOption({"cache-eviction", QObject::tr("Which translations to forget when the cache is full: lru (least recently used) or fifo (oldest). Overrides the setting from the GUI."), "policy"});
+    parser.addOption({"no-cache", QObject::tr("Do not cache translations.")});
+    parser.addOption({"cpus", QObject::tr("Only run translation workers on these CPUs, e.g. 0-3,8. Overrides the setting from the GUI."), "list"});
+    parser.addOption({"no-smt", QObject::tr("Run at most one translation worker per physical core, avoiding hyperthreads.")});
+    parser.addOption({"nice", QObject::tr("Lower the priority of the translation workers, from 0 (normal) to 19 (lowest)."), "level"});
+    parser.addOption({"trace", QObject::tr("Record where time is spent and write it to this file on exit, in Chrome trace format. Only available in builds with -DTRACING=ON."), "file"});
     parser.addOption({"debug", QObject::tr("Print debug messages")});
 
     parser.process(translateLocallyApp);
@@ -95,6 +116,11 @@ static AppType runType(QCommandLineParser& parser) {
         }
     }
 
+    // Daemon serving the native messaging hosts and CLI, and/or HTTP clients
+    if (parser.isSet("daemon") || parser.isSet("serve")) {
+        return Daemon;
+    }
+
     // Manual native messaging mode through -p or --plugin flag
     if (parser.isSet("plugin")) {
         return NativeMsg;
@@ -0,0 +1,46 @@
+#include "Checkpoint.h"
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSaveFile>
+
+QString Checkpoint::pathFor(QString const &output) {
+    return output + ".checkpoint";
+}
+
+bool Checkpoint::load(QString const &path) {
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+
+    QJsonDocument doc = QJsonDocument::fromJson(file.readAll());
+    if (!doc.isObject())
+        return false;
+
+    QJsonObject obj = doc.object();
+    if (!obj.value("input").isString() || !obj.value("inputOffset").isDouble() || !obj.value("outputOffset").isDouble() || !obj.value("model").isString())
+        return false;
+
+    input = obj.value("input").toString();
+    inputOffset = obj.value("inputOffset").toVariant().toLongLong();
+    outputOffset = obj.value("outputOffset").toVariant().toLongLong();
+    model = obj.value("model").toString();
+    modelVersion = obj.value("modelVersion").toInt(-1);
+    return inputOffset >= 0 && outputOffset >= 0;
+}
+
+bool Checkpoint::save(QString const &path) const {
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly))
+        return false;
+
+    file.write(QJsonDocument(QJsonObject{
+        {"input", input},
+        {"inputOffset", inputOffset},
+        {"outputOffset", outputOffset},
+        {"model", model},
+        {"modelVersion", modelVersion}
+    }).toJson());
+
+    return file.commit();
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <QString>
+
+/**
+ * How far `translateLocally -m <model> -i <input> -o <output> --resume` got:
+ * everything before inputOffset in the input is translated and written to
+ * the output up to outputOffset. Kept next to the output as JSON, so a job
+ * that is killed can pick up from there instead of starting over.
+ */
+struct Checkpoint {
+    QString input; // Absolute path
+    qint64 inputOffset = 0; // Bytes
+    qint64 outputOffset = 0; // Bytes
+    QString model; // Model::id()
+    int modelVersion = -1;
+
+    /**
+     * @brief Where the checkpoint of output is kept.
+     */
+    static QString pathFor(QString const &output);
+
+    /**
+     * @return false if there is no checkpoint at path, or it is invalid.
+     */
+    bool load(QString const &path);
+
+    /**
+     * @brief Replaces the checkpoint at path, which is never left half written.
+     * @return false if it could not be written.
+     */
+    bool save(QString const &path) const;
+};
@@ -0,0 +1,24 @@
+#include "ChunkSizer.h"
+#include <algorithm>
+
+ChunkSizer::ChunkSizer(std::size_t workers, std::size_t batchWords)
+: min_(kMinBatchesPerWorker * std::max<std::size_t>(workers, 1) * batchWords)
+, max_(kMaxBatchesPerWorker * std::max<std::size_t>(workers, 1) * batchWords)
+, words_(min_)
+, wordsPerSecond_(0.0) {
+    //
+}
+
+std::size_t ChunkSizer::words() const {
+    return words_;
+}
+
+void ChunkSizer::update(std::size_t words, double seconds) {
+    // The last chunk of the input is often too short to say much about speed.
+    if (words < min_ / 2 || seconds <= 0.0)
+        return;
+
+    double measured = words / seconds;
+    wordsPerSecond_ = wordsPerSecond_ > 0.0 ? 0.7 * wordsPerSecond_ + 0.3 * measured : measured;
+    words_ = std::clamp(static_cast<std::size_t>(wordsPerSecond_ * kTargetSeconds), min_, max_);
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <cstddef>
+
+/**
+ * Decides how many words the command line sends to the translator at once.
+ * A chunk is always large enough to give every worker a few full batches, so
+ * short lines don't leave workers waiting. Beyond that, chunks are sized from
+ * the measured throughput to take about kTargetSeconds each, so long lines
+ * don't hold back the output for too long.
+ */
+class ChunkSizer {
+public:
+    /**
+     * @param workers number of translation workers.
+     * @param batchWords words each worker translates in one batch.
+     */
+    ChunkSizer(std::size_t workers, std::size_t batchWords);
+
+    /**
+     * @brief Word budget for the next chunk.
+     */
+    std::size_t words() const;
+
+    /**
+     * @brief Records that a chunk of words took seconds to translate.
+     */
+    void update(std::size_t words, double seconds);
+
+private:
+    static const std::size_t constexpr kMinBatchesPerWorker = 4;
+    static const std::size_t constexpr kMaxBatchesPerWorker = 256;
+    static constexpr double kTargetSeconds = 2.0;
+
+    std::size_t min_;
+    std::size_t max_;
+    std::size_t words_;
+    double wordsPerSecond_; // Moving average, 0 until measured
+};
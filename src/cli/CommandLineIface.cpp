@@ -1,18 +1,40 @@
 #include "CommandLineIface.h"
 #include "cli/NativeMsgManager.h"
+#include "cli/NativeMsgIface.h"
+#include "Tracing.h"
+#include "Affinity.h"
+#include "tm/TranslationMemory.h"
+#include <QDirIterator>
 #include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
 #include <QProcessEnvironment>
-#if (QT_VERSION < QT_VERSION_CHECK(6, 0, 0))
-#include <QTextCodec>
-#endif
+#include <QRegularExpression>
+#include <QSaveFile>
 
+#include <algorithm>
 #include <array>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <future>
+
+#if defined(Q_OS_UNIX)
+#include <unistd.h>
+#endif
 
 // Progress bar taken from https://stackoverflow.com/questions/14539867/how-to-display-a-progress-indicator-in-pure-c-c-cout-printf
 #define PBSTR "############################################################"
 #define PBWIDTH 60
 
 namespace {
+    // Largest chunk sent to the daemon, unless it is a single line. Escaped as
+    // JSON, text can take up to six times as many bytes, which still stays
+    // below the daemon's message size limit.
+    const std::size_t constexpr kDaemonChunkBytes = kMaxInputLength / 8;
+
     void checkAppleSandbox(QCommandLineParser const &parser) {
         QProcessEnvironment env(QProcessEnvironment::systemEnvironment());
         if (!env.contains("APP_SANDBOX_CONTAINER_ID"))
@@ -41,23 +63,8 @@ CommandLineIface::CommandLineIface(QObject * parent)
 , eventLoop_(this)
 , network_(this)
 , settings_(this)
-, models_(this, &settings_)
-, translator_(new MarianInterface(this))
-, instream_(stdin)
-, outstream_(stdout) {
-    // Take care of encoding according to https://doc.qt.io/qt-6/qtextstream.html#setAutoDetectUnicode
-#if (QT_VERSION < QT_VERSION_CHECK(6, 0, 0)) // https://github.com/XapaJIaMnu/translateLocally/issues/121#issuecomment-1277762146
-    instream_.setCodec(QTextCodec::codecForName(QByteArray("UTF-8")));
-    outstream_.setCodec(QTextCodec::codecForName(QByteArray("UTF-8")));
-#else
-    instream_.setEncoding(QStringConverter::Encoding::Utf8);
-    outstream_.setEncoding(QStringConverter::Encoding::Utf8);
-#endif
-    instream_.setAutoDetectUnicode(true);
-    outstream_.setAutoDetectUnicode(true);
+, models_(this, &settings_) {
     // Take care of slots and signals
-    connect(translator_, &MarianInterface::error, this, &CommandLineIface::outputError);
-    connect(translator_, &MarianInterface::translationReady, this, &CommandLineIface::outputTranslation);
     connect(&network_, &Network::error, this, &CommandLineIface::outputError);
 }
 
@@ -99,47 +106,186 @@ int CommandLineIface::run(QCommandLineParser const &parser) {
         out.flush();
         return 0;
     } else if (parser.isSet("m")) {
-        // Open file as input stream if necessary
+        // Many files at once
+        if (parser.isSet("output-dir"))
+            return runBatch(parser);
+
+        QString model_shortname = parser.value("model");
+
+        // Try to find our model in the list of models
+        QString modelpath;
+        QString modelID;
+        int modelVersion = -1;
+        QString translationMemory;
+        QString srcLanguage, trgLanguage;
+        std::optional<Model> selected;
+        for (auto&& model : models_.getInstalledModels()) {
+            if (model.shortName == model_shortname) {
+                selected = model;
+                modelpath = model.path;
+                modelID = model.id();
+                modelVersion = model.localversion;
+                translationMemory = translateLocally::TranslationMemory::pathFor(model);
+                srcLanguage = model.srcTags.isEmpty() ? QString() : model.srcTags.firstKey();
+                trgLanguage = model.trgTag;
+            }
+        }
+        if (modelpath.isEmpty()) {
+            qCritical() << "We could not find a model identified as:" << model_shortname << ". Use translateLocally -l to list available models or use the GUI to download some from the internet.";
+            return 1;
+        }
+
+        // Through a second model, the language pair is that of both together.
+        std::optional<Model> pivot;
+        if (int status = parsePivotModel(parser, *selected, pivot))
+            return status;
+
+        QString pivotpath, pivotID;
+        QString checkpointModel = modelID; // Checkpoints are only valid for the same models
+        if (pivot) {
+            pivotpath = pivot->path;
+            pivotID = pivot->id();
+            checkpointModel += "," + pivotID;
+            trgLanguage = pivot->trgTag;
+            translationMemory = srcLanguage.isEmpty() ? QString() : translateLocally::TranslationMemory::pathFor(srcLanguage, trgLanguage);
+        }
+
+        // Add to the translation memory of the model's language pair
+        if (parser.isSet("tm-import")) {
+            if (translationMemory.isEmpty()) {
+                qCritical() << "The model does not say which languages it translates, so it has no translation memory";
+                return 8;
+            }
+
+            std::size_t imported = 0;
+            QString error;
+            if (!translateLocally::TranslationMemory::import(translationMemory, parser.value("tm-import"), srcLanguage, trgLanguage, imported, error)) {
+                qCritical().noquote() << error;
+                return 3;
+            }
+
+            QTextStream out(stdout);
+            out << "Imported " << imported << " segments into " << translationMemory << ", which now has "
+                << translateLocally::TranslationMemory(translationMemory).size() << " segments.\n";
+            return 0;
+        }
+
+        if (int status = parseRecordFormat(parser, format_))
+            return status;
+
+        double fuzzyThreshold = 0.0;
+        if (int status = parseFuzzyThreshold(parser, fuzzyThreshold))
+            return status;
+
+        // Resuming needs files to find our place in
+        if (parser.isSet("resume") && (!parser.isSet("i") || !parser.isSet("o"))) {
+            qCritical() << "--resume needs both an input file (-i) and an output file (-o)";
+            return 8;
+        }
+
+        // Open file as input if necessary. Text is passed on as UTF-8 bytes
+        // without decoding it, files are memory mapped.
         if (parser.isSet("i")) {
             infile_.setFileName(parser.value("i"));
-            if (infile_.open(QIODevice::ReadOnly)) {
-                instream_.setDevice(&infile_);
-            } else {
+            if (!infile_.open(QIODevice::ReadOnly)) {
                 checkAppleSandbox(parser);
                 qCritical() << "Couldn't open input file:" + parser.value("i");
                 return 3;
             }
+        } else {
+            infile_.open(stdin, QIODevice::ReadOnly);
+        }
+
+        // Pick up where an earlier run with --resume left off, if it was
+        // translating the same input with the same model.
+        std::unique_ptr<Checkpoint> checkpoint;
+        bool resuming = false;
+        if (parser.isSet("resume")) {
+            checkpoint = std::make_unique<Checkpoint>();
+            if (checkpoint->load(Checkpoint::pathFor(parser.value("o")))) {
+                resuming = checkpoint->input == QFileInfo(infile_).absoluteFilePath()
+                    && checkpoint->model == checkpointModel
+                    && checkpoint->modelVersion == modelVersion
+                    && checkpoint->inputOffset <= infile_.size()
+                    && checkpoint->outputOffset <= QFileInfo(parser.value("o")).size();
+                if (!resuming)
+                    qWarning().noquote() << "Checkpoint" << Checkpoint::pathFor(parser.value("o")) << "is for a different input, model or output. Starting over.";
+            }
+
+            if (!resuming)
+                *checkpoint = Checkpoint{QFileInfo(infile_).absoluteFilePath(), 0, 0, checkpointModel, modelVersion};
         }
 
-        // Same, but output stream
+        reader_ = std::make_unique<LineChunkReader>(infile_, resuming ? checkpoint->inputOffset : 0);
+
+        if (checkpoint && reader_->offset() < 0) {
+            qWarning() << "Can't resume translating UTF-16 input, no checkpoints will be written.";
+            checkpoint.reset();
+        }
+
+        // Same, but output. When resuming, anything written after the
+        // checkpoint is dropped: its input is translated again.
         if (parser.isSet("o")) {
             outfile_.setFileName(parser.value("o"));
-            if (outfile_.open(QIODevice::WriteOnly)) {
-                outstream_.setDevice(&outfile_);
-            } else {
+            if (!outfile_.open(resuming ? QIODevice::ReadWrite : QIODevice::WriteOnly)
+                || (resuming && !(outfile_.resize(checkpoint->outputOffset) && outfile_.seek(checkpoint->outputOffset)))) {
                 checkAppleSandbox(parser);
                 qCritical() << "Couldn't open output file:" + parser.value("o");
                 return 4;
             }
+        } else {
+            outfile_.open(stdout, QIODevice::WriteOnly);
         }
 
-        QString model_shortname = parser.value("model");
+        if (resuming)
+            qInfo().noquote() << "Resuming at byte" << checkpoint->inputOffset << "of" << parser.value("i");
 
-        // Try to find our model in the list of models
-        QString modelpath;
-        for (auto&& model : models_.getInstalledModels()) {
-            if (model.shortName == model_shortname) {
-                modelpath = model.path;
+        translateLocally::marianSettings marianSettings = settings_.marianSettings();
+        if (int status = parseMarianSettings(parser, marianSettings))
+            return status;
+
+        // Init the translation model, once it is needed
+        std::unique_ptr<BatchTranslator> translator;
+        auto loadTranslator = [&]() -> BatchTranslator * {
+            if (!translator) {
+                try {
+                    translator = std::make_unique<BatchTranslator>(modelpath, pivotpath, marianSettings, translationMemory, fuzzyThreshold);
+                } catch (const std::runtime_error &e) {
+                    qCritical().noquote() << "Failed to load the translation model:" << e.what();
+                }
             }
+            return translator.get();
+        };
+
+        // If the daemon is running, it likely has the model loaded already.
+        // Unless we're asked to use specific cache or CPU settings for this run.
+        QList<QString> localOnlyFlags = {"no-daemon", "cache-size", "cache-eviction", "no-cache", "cpus", "no-smt", "nice", "resume", "tsv-column", "jsonl-field", "bitext", "tm-fuzzy"};
+        if (std::none_of(localOnlyFlags.begin(), localOnlyFlags.end(), [&](QString const &flag) { return parser.isSet(flag); })) {
+            DaemonClient daemon;
+            if (daemon.connectToDaemon())
+                return doDaemonTranslation(daemon, modelID, pivotID, loadTranslator);
         }
-        if (modelpath.isEmpty()) {
-            qCritical() << "We could not find a model identified as:" << model_shortname << ". Use translateLocally -l to list available models or use the GUI to download some from the internet.";
-            return 1;
-        }
 
-        // Init the translation model
-        translator_->setModel(modelpath, settings_.marianSettings());
-        doTranslation();
+        // Like BatchTranslator, no more workers than CPUs they may run on.
+        std::size_t workers = marianSettings.cpu_threads;
+        translateLocally::affinity::CpuSet cpus = translateLocally::affinity::workerCpus(marianSettings.cpu_affinity, marianSettings.avoid_smt);
+        if (!cpus.empty())
+            workers = std::min(workers, cpus.size());
+
+        if (!loadTranslator())
+            return 22;
+
+        doTranslation(*translator, workers, checkpoint.get());
+
+        // Done, nothing left to resume.
+        if (checkpoint)
+            QFile::remove(Checkpoint::pathFor(parser.value("o")));
+
+        if (parser.isSet("debug")) {
+            auto stats = translator->cacheStats();
+            qDebug() << "Translation cache:" << stats.hits << "hits," << stats.misses << "misses";
+            qDebug() << "Translation memory:" << translator->translationMemoryHits() << "hits," << translator->fuzzyMatches() << "near matches";
+        }
         return 0;
     } else if (parser.isSet("allow-client")) {
         return allowNativeMessagingClient(parser.positionalArguments());
@@ -179,37 +325,532 @@ void CommandLineIface::printRemoteModels() {
 }
 
 /**
- * @brief CommandLineIface::fetchData fetches lines to be translated, batches them for efficiency and sends to the translator. Could be either a file or stdin
- * @param buffer the buffer is where the lines to be translated are stored
- * @return
+ * @brief CommandLineIface::collectBatchJobs Expands the inputs (files, directories and wildcard patterns) into
+ *        jobs. Files in a directory keep their path relative to it in the output directory.
+ * @return false if an input does not exist, or two inputs would end up in the same output.
+ */
+bool CommandLineIface::collectBatchJobs(QStringList const &inputs, QDir const &outputDir, std::vector<BatchTranslator::Job> &jobs) {
+    QSet<QString> outputs;
+
+    auto add = [&](QString const &input, QString const &relative) {
+        QString output = QFileInfo(outputDir.filePath(relative)).absoluteFilePath();
+        QString absoluteInput = QFileInfo(input).absoluteFilePath();
+
+        if (output == absoluteInput) {
+            qCritical() << "Translating" << input << "would overwrite it. Use a different output directory.";
+            return false;
+        }
+
+        if (outputs.contains(output)) {
+            qCritical() << "More than one input would be written to" << output;
+            return false;
+        }
+
+        outputs.insert(output);
+        jobs.push_back({input, output});
+        return true;
+    };
+
+    for (auto &&input : inputs) {
+        QFileInfo info(input);
+
+        if (info.isDir()) {
+            QDir dir(input);
+            QStringList files;
+            QDirIterator it(input, QDir::Files, QDirIterator::Subdirectories);
+            while (it.hasNext())
+                files.append(it.next());
+            files.sort();
+
+            for (auto &&file : files)
+                if (!add(file, dir.relativeFilePath(file)))
+                    return false;
+        } else if (info.fileName().contains(QRegularExpression("[*?\\[]"))) {
+            // Shells expand these, but this also works for more files than fit on a command line.
+            QFileInfoList matches = info.dir().entryInfoList({info.fileName()}, QDir::Files, QDir::Name);
+            if (matches.isEmpty())
+                qWarning() << "No files match" << input;
+
+            for (auto &&match : matches)
+                if (!add(match.filePath(), match.fileName()))
+                    return false;
+        } else if (info.isFile()) {
+            if (!add(input, info.fileName()))
+                return false;
+        } else {
+            qCritical() << "Couldn't find input file:" << input;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief CommandLineIface::runBatch Translates all input files into the output directory with a model that is
+ *        loaded once, and writes a manifest with the status and timing of each file.
+ * @return exit code
+ */
+int CommandLineIface::runBatch(QCommandLineParser const &parser) {
+    QString modelpath;
+    QString translationMemory;
+    std::optional<Model> selected;
+    for (auto&& model : models_.getInstalledModels()) {
+        if (model.shortName == parser.value("model")) {
+            selected = model;
+            modelpath = model.path;
+            translationMemory = translateLocally::TranslationMemory::pathFor(model);
+        }
+    }
+
+    if (modelpath.isEmpty()) {
+        qCritical() << "We could not find a model identified as:" << parser.value("model") << ". Use translateLocally -l to list available models or use the GUI to download some from the internet.";
+        return 1;
+    }
+
+    std::optional<Model> pivot;
+    if (int status = parsePivotModel(parser, *selected, pivot))
+        return status;
+
+    QString pivotpath;
+    if (pivot) {
+        pivotpath = pivot->path;
+        translationMemory = selected->srcTags.isEmpty() ? QString() : translateLocally::TranslationMemory::pathFor(selected->srcTags.firstKey(), pivot->trgTag);
+    }
+
+    QStringList inputs = parser.positionalArguments();
+    if (parser.isSet("i"))
+        inputs.prepend(parser.value("i"));
+
+    if (inputs.isEmpty()) {
+        qCritical() << "No input files to translate. Pass them (or directories, or patterns like *.txt) after the options.";
+        return 3;
+    }
+
+    QDir outputDir(parser.value("output-dir"));
+    if (!outputDir.mkpath(".")) {
+        qCritical() << "Couldn't create output directory:" << parser.value("output-dir");
+        return 4;
+    }
+
+    std::vector<BatchTranslator::Job> jobs;
+    if (!collectBatchJobs(inputs, outputDir, jobs))
+        return 3;
+
+    QString manifestPath = parser.isSet("manifest") ? parser.value("manifest") : outputDir.filePath("manifest.json");
+    for (auto &&job : jobs) {
+        if (job.output == QFileInfo(manifestPath).absoluteFilePath()) {
+            qCritical() << "The manifest would overwrite the translation of" << job.input << ". Use --manifest to write it elsewhere.";
+            return 4;
+        }
+    }
+
+    translateLocally::marianSettings marianSettings = settings_.marianSettings();
+    if (int status = parseMarianSettings(parser, marianSettings))
+        return status;
+
+    double fuzzyThreshold = 0.0;
+    if (int status = parseFuzzyThreshold(parser, fuzzyThreshold))
+        return status;
+
+    // More files in flight than workers gives them sentences from several files to batch together.
+    std::size_t filesInFlight = std::max<std::size_t>(4, 2 * marianSettings.cpu_threads);
+    if (parser.isSet("jobs")) {
+        bool ok;
+        filesInFlight = parser.value("jobs").toUInt(&ok);
+        if (!ok || filesInFlight == 0) {
+            qCritical() << "Invalid number of jobs:" << parser.value("jobs");
+            return 8;
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<BatchTranslator::Result> results;
+    try {
+        BatchTranslator translator(modelpath, pivotpath, marianSettings, translationMemory, fuzzyThreshold);
+
+        std::size_t done = 0;
+        results = translator.run(jobs, filesInFlight, [&](BatchTranslator::Result const &result) {
+            ++done;
+            if (!result.error.isEmpty())
+                qWarning().noquote() << "\n" << result.error;
+
+            // Same progress bar as downloadRemoteModel(), but on stderr so it works when stdout is piped.
+            double percentage = (double)done/(double)jobs.size();
+            int lpad = (int) (percentage * PBWIDTH);
+            int rpad = PBWIDTH - lpad;
+            fprintf(stderr, "\r%3d%% [%.*s%*s] %zu/%zu files", (int) (percentage * 100), lpad, PBSTR, rpad, "", done, jobs.size());
+            fflush(stderr);
+        });
+        fprintf(stderr, "\n");
+    } catch (const std::runtime_error &e) {
+        qCritical().noquote() << "Failed to load the translation model:" << e.what();
+        return 22;
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    QJsonArray files;
+    std::size_t failed = 0;
+    for (auto &&result : results) {
+        QJsonObject file{
+            {"input", result.input},
+            {"output", result.output},
+            {"status", result.error.isEmpty() ? "ok" : "error"},
+            {"bytes", static_cast<qint64>(result.bytes)},
+            {"lines", static_cast<qint64>(result.lines)},
+            {"seconds", result.seconds}
+        };
+
+        if (!result.error.isEmpty()) {
+            file["error"] = result.error;
+            ++failed;
+        }
+
+        files.append(file);
+    }
+
+    QSaveFile manifest(manifestPath);
+    if (!manifest.open(QIODevice::WriteOnly)
+        || manifest.write(QJsonDocument(QJsonObject{
+            {"model", parser.value("model")},
+            {"files", files},
+            {"translated", static_cast<qint64>(results.size() - failed)},
+            {"failed", static_cast<qint64>(failed)},
+            {"seconds", elapsed.count()}
+        }).toJson()) < 0
+        || !manifest.commit()) {
+        qCritical() << "Couldn't write manifest:" << manifestPath << manifest.errorString();
+        return 4;
+    }
+
+    qInfo().noquote() << QString("Translated %1 of %2 files in %3 s, manifest written to %4")
+        .arg(results.size() - failed).arg(results.size()).arg(elapsed.count(), 0, 'f', 1).arg(manifestPath);
+
+    return failed > 0 ? 23 : 0;
+}
+
+/**
+ * @brief CommandLineIface::parseMarianSettings Applies the cache and CPU settings that can be overridden per run.
+ * @return 0, or the exit code if an option is invalid
+ */
+int CommandLineIface::parseMarianSettings(QCommandLineParser const &parser, translateLocally::marianSettings &settings) {
+    // Cache settings can be overridden per run
+    if (parser.isSet("cache-size")) {
+        bool ok;
+        settings.translation_cache_size = parser.value("cache-size").toUInt(&ok);
+        if (!ok || settings.translation_cache_size == 0) {
+            qCritical() << "Invalid cache size:" << parser.value("cache-size");
+            return 8;
+        }
+    }
+    if (parser.isSet("cache-eviction")) {
+        QString policy = parser.value("cache-eviction");
+        if (policy != "lru" && policy != "fifo") {
+            qCritical() << "Unknown cache eviction policy:" << policy << ". Use lru or fifo.";
+            return 8;
+        }
+        settings.translation_cache_eviction = translateLocally::cacheEvictionFromString(policy);
+    }
+    if (parser.isSet("no-cache"))
+        settings.translation_cache = false;
+
+    // So can the CPUs and priority of the workers
+    if (parser.isSet("cpus")) {
+        settings.cpu_affinity = translateLocally::affinity::parseCpuList(parser.value("cpus"));
+        if (settings.cpu_affinity.empty()) {
+            qCritical() << "Invalid list of CPUs:" << parser.value("cpus");
+            return 8;
+        }
+    }
+    if (parser.isSet("no-smt"))
+        settings.avoid_smt = true;
+    if (parser.isSet("nice")) {
+        bool ok;
+        settings.nice = parser.value("nice").toInt(&ok);
+        if (!ok || settings.nice < 0 || settings.nice > 19) {
+            qCritical() << "Invalid nice level:" << parser.value("nice") << ". Use 0 to 19.";
+            return 8;
+        }
+
+        // The workers can only be given a priority of their own on Linux.
+        translateLocally::affinity::setProcessNice(settings.nice);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief CommandLineIface::parseRecordFormat Reads which part of each line to translate: a TSV column, a JSONL field or
+ *        (by default) all of it, and whether to keep the source next to the translation.
+ * @return 0, or the exit code if an option is invalid
+ */
+int CommandLineIface::parseRecordFormat(QCommandLineParser const &parser, RecordFormat &format) {
+    bool bitext = parser.isSet("bitext");
+
+    if (parser.isSet("tsv-column") && parser.isSet("jsonl-field")) {
+        qCritical() << "Use either --tsv-column or --jsonl-field, not both";
+        return 8;
+    } else if (parser.isSet("tsv-column")) {
+        bool ok;
+        std::size_t column = parser.value("tsv-column").toUInt(&ok);
+        if (!ok || column == 0) {
+            qCritical() << "Invalid column:" << parser.value("tsv-column") << ". Columns are counted from 1.";
+            return 8;
+        }
+        format = RecordFormat(RecordFormat::Type::Tsv, bitext, column);
+    } else if (parser.isSet("jsonl-field")) {
+        if (parser.value("jsonl-field").isEmpty()) {
+            qCritical() << "Missing field name for --jsonl-field";
+            return 8;
+        }
+        format = RecordFormat(RecordFormat::Type::Jsonl, bitext, 0, parser.value("jsonl-field").toStdString());
+    } else {
+        format = RecordFormat(RecordFormat::Type::Text, bitext);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief CommandLineIface::parsePivotModel Finds the model passed with --pivot, which translates the output of model
+ *        into another language, e.g. English into German after Spanish into English.
+ * @param pivot set to the model, or nullopt without --pivot
+ * @return 0, or the exit code if there is no such model, or it doesn't translate from the language model translates into
+ */
+int CommandLineIface::parsePivotModel(QCommandLineParser const &parser, Model const &model, std::optional<Model> &pivot) {
+    pivot.reset();
+    if (!parser.isSet("pivot"))
+        return 0;
+
+    for (auto&& candidate : models_.getInstalledModels())
+        if (candidate.shortName == parser.value("pivot"))
+            pivot = candidate;
+
+    if (!pivot) {
+        qCritical() << "We could not find a model identified as:" << parser.value("pivot") << ". Use translateLocally -l to list available models or use the GUI to download some from the internet.";
+        return 1;
+    }
+
+    if (!pivot->srcTags.contains(model.trgTag)) {
+        qCritical() << model.shortName << "translates into" << model.trgTag << ", but" << pivot->shortName << "does not translate from it";
+        return 8;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief CommandLineIface::parseFuzzyThreshold Reads how similar lines have to be to a line in the translation memory to
+ *        use its translation. 0 (the default) if only exact matches are used.
+ * @return 0, or the exit code if the threshold is invalid
  */
-QString &CommandLineIface::fetchData(QString &buffer) {
-    int counter = 0;
-    buffer.clear();
-    static QString line;
-    
-    while(counter < prefetchLines && instream_.readLineInto(&line)) {
-        buffer.append(line);
-        buffer.append('\n'); // The new line has no EoL characters
-        counter++;
+int CommandLineIface::parseFuzzyThreshold(QCommandLineParser const &parser, double &threshold) {
+    threshold = 0.0;
+    if (!parser.isSet("tm-fuzzy"))
+        return 0;
+
+    bool ok;
+    threshold = parser.value("tm-fuzzy").toDouble(&ok);
+    if (!ok || threshold <= 0.0 || threshold > 1.0) {
+        qCritical() << "Invalid similarity threshold:" << parser.value("tm-fuzzy") << ". It should be more than 0, and at most 1.";
+        return 8;
     }
+    return 0;
+}
 
-    return buffer;
+/**
+ * @brief CommandLineIface::fetchData fetches lines to be translated, batches them for efficiency and sends to the translator. Could be either a file or stdin
+ * @param buffer the buffer is where the lines to be translated are stored, as UTF-8
+ * @param maxWords word budget for the batch, see ChunkSizer
+ * @param words set to the number of words in buffer
+ * @param maxBytes size limit of the buffer, unless it is a single line
+ * @return false if there is nothing left to translate
+ */
+bool CommandLineIface::fetchData(std::string &buffer, std::size_t maxWords, std::size_t &words, std::size_t maxBytes) {
+    TRACE_SPAN("cli", "fetchData");
+    return reader_->next(buffer, maxWords, words, maxBytes);
 }
 /**
- * @brief CommandLineIface::doTranslation This function is pseudo blocking, via an event loop. It sends text to be translated by marian.
+ * @brief CommandLineIface::doTranslation Sends text to be translated by marian, and writes the translations in order.
+ *        Reading goes on while earlier batches are still being translated, as long as there are no more than
+ *        maxBytesInFlight of them. Batches can finish in any order, a ReorderBuffer holds on to them until all
+ *        batches before them are written.
+ * @param workers number of translation workers, to size the batches for
+ * @param checkpoint if not null, updated as output is written and saved every checkpointIntervalSeconds
  */
-void CommandLineIface::doTranslation() {
-    QString input;
-    while (!fetchData(input).isEmpty()) {
-        translator_->translate(input);
-        // Start event loop to block unit translation is ready. Translator
-        // will call outputTranslation or outputError during this call, which
-        // will either unblock this exec() call, or kill the program.
-        eventLoop_.exec();
+void CommandLineIface::doTranslation(BatchTranslator &translator, std::size_t workers, Checkpoint *checkpoint) {
+    ChunkSizer sizer(workers, translateLocally::kMiniBatchWords);
+    ReorderBuffer pending(maxBytesInFlight);
+
+    struct Batch {
+        std::size_t words;
+        std::chrono::steady_clock::time_point start;
+        qint64 inputEnd; // Byte offset in the input
+    };
+    std::deque<Batch> batches; // Same order as pending
+    auto lastOutput = std::chrono::steady_clock::now();
+    auto lastCheckpoint = lastOutput;
+
+    auto writeNext = [&]() {
+        TRACE_SPAN("cli", "outputTranslation");
+        QString error;
+        std::string output = pending.take(error);
+        if (!error.isEmpty())
+            outputError(error);
+
+        outfile_.write(output.data(), output.size());
+        outfile_.flush();
+
+        // Batches are translated one after the other, so time the batch from
+        // when it was sent or the one before it was done, whichever is later.
+        auto now = std::chrono::steady_clock::now();
+        Batch batch = batches.front();
+        batches.pop_front();
+        sizer.update(batch.words, std::chrono::duration<double>(now - std::max(batch.start, lastOutput)).count());
+        lastOutput = now;
+
+        if (checkpoint) {
+            checkpoint->inputOffset = batch.inputEnd;
+            checkpoint->outputOffset = outfile_.pos();
+
+            if (now - lastCheckpoint >= std::chrono::seconds(checkpointIntervalSeconds)) {
+                // The checkpoint must not get ahead of the output on disk.
+#if defined(Q_OS_UNIX)
+                ::fsync(outfile_.handle());
+#endif
+                if (!checkpoint->save(Checkpoint::pathFor(outfile_.fileName())))
+                    qWarning() << "Could not write checkpoint" << Checkpoint::pathFor(outfile_.fileName());
+                lastCheckpoint = now;
+            }
+        }
+    };
+
+    std::string input;
+    std::size_t words;
+    bool more = true;
+    while (true) {
+        // Write out whatever is done already
+        while (!pending.empty() && pending.ready())
+            writeNext();
+
+        if (more && !pending.full()) {
+            more = fetchData(input, sizer.words(), words);
+            if (more) {
+                TRACE_SPAN("cli", "translate");
+                std::size_t seq = pending.add(input.size());
+                batches.push_back({words, std::chrono::steady_clock::now(), reader_->offset()});
+                if (format_.passThrough()) {
+                    translator.translate(std::move(input), [&pending, seq](std::string &&output, QString const &error) {
+                        pending.complete(seq, std::move(output), error);
+                    });
+                } else {
+                    // Only the text of each record is translated. The
+                    // translations are put back in place on the worker that
+                    // finishes last.
+                    auto records = std::make_shared<RecordFormat::Records>();
+                    records->input = std::move(input);
+                    std::string text = format_.extract(*records);
+                    translator.translate(std::move(text), [this, &pending, seq, records](std::string &&output, QString const &error) {
+                        pending.complete(seq, error.isEmpty() ? format_.merge(*records, output) : std::string(), error);
+                    });
+                }
+            }
+            continue;
+        }
+
+        if (pending.empty())
+            break;
+
+        // Nothing more to read, or too far ahead: wait for the oldest batch.
+        writeNext();
     }
 }
 
+/**
+ * @brief CommandLineIface::doDaemonTranslation Same as doTranslation, but has the daemon do the translating.
+ *        Chunks are sent in groups, with several in flight so all of the daemon's workers have something to do.
+ *        A chunk that is too large to send to the daemon (a single very long line) is translated locally.
+ * @param local loads the model locally, or returns nullptr if it can't.
+ * @return exit code
+ */
+int CommandLineIface::doDaemonTranslation(DaemonClient &daemon, QString const &modelID, QString const &pivotID, std::function<BatchTranslator *()> local) {
+    // The daemon's workers are configured through the same settings. What
+    // doTranslation would send as one chunk is split over a group of them.
+    ChunkSizer sizer(settings_.marianSettings().cpu_threads, translateLocally::kMiniBatchWords);
+
+    auto makeRequest = [&](std::string const &text) {
+        QJsonObject request{
+            {"model", modelID},
+            {"text", QString::fromStdString(text)}
+        };
+        if (!pivotID.isEmpty())
+            request["pivot"] = pivotID;
+        return request;
+    };
+
+    std::string input;
+    std::size_t words;
+    bool more = true;
+    while (more) {
+        auto start = std::chrono::steady_clock::now();
+        std::size_t chunkWords = std::max<std::size_t>(sizer.words() / kDaemonRequestsInFlight, translateLocally::kMiniBatchWords);
+        std::size_t groupWords = 0;
+        std::vector<QJsonObject> requests;
+        std::optional<std::string> tooLarge; // Comes after the group
+
+        while (requests.size() < static_cast<std::size_t>(kDaemonRequestsInFlight)) {
+            more = fetchData(input, chunkWords, words, kDaemonChunkBytes);
+            if (!more)
+                break;
+
+            QJsonObject request = makeRequest(input);
+            if (input.size() > kDaemonChunkBytes && !DaemonClient::fits("Translate", request)) {
+                tooLarge = std::move(input);
+                break;
+            }
+
+            groupWords += words;
+            requests.push_back(std::move(request));
+        }
+
+        if (!requests.empty()) {
+            QString error;
+            auto responses = daemon.requestAll("Translate", requests, error);
+            if (!responses) {
+                qCritical().noquote() << error;
+                return 22;
+            }
+
+            for (auto &&response : *responses)
+                outfile_.write(response.toObject().value("target").toObject().value("text").toString().toUtf8());
+            outfile_.flush();
+            sizer.update(groupWords, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        }
+
+        if (tooLarge) {
+            BatchTranslator *translator = local();
+            if (!translator)
+                return 22;
+
+            std::promise<std::pair<std::string, QString>> translated;
+            std::future<std::pair<std::string, QString>> result = translated.get_future();
+            translator->translate(std::move(*tooLarge), [&translated](std::string &&output, QString const &error) {
+                translated.set_value({std::move(output), error});
+            });
+
+            auto output = result.get();
+            if (!output.second.isEmpty()) {
+                qCritical().noquote() << output.second;
+                return 22;
+            }
+            outfile_.write(output.first.data(), output.first.size());
+            outfile_.flush();
+        }
+    }
+    return 0;
+}
+
 void CommandLineIface::downloadRemoteModel(QString modelID) {
     // fetch model from the internet and wait until it is there
     connect(&models_, &ModelManager::fetchedRemoteModels, this, [&](){eventLoop_.exit();});
@@ -262,12 +903,6 @@ void CommandLineIface::outputError(QString error) {
     exit(22);
 }
 
-void CommandLineIface::outputTranslation(Translation output) {
-    outstream_ << output.translation();
-    outstream_.flush();
-    eventLoop_.exit(); // Unblock the main thread
-}
-
 int CommandLineIface::allowNativeMessagingClient(QStringList ids) {
     if (ids.isEmpty()) {
         qCritical().noquote() << "No client ids specified";
@@ -5,12 +5,23 @@
 #include <QPointer>
 #include <QTextStream>
 #include <QCommandLineParser>
+#include <QDir>
 #include <QEventLoop>
+#include <vector>
 #include "inventory/ModelManager.h"
 #include "settings/Settings.h"
-#include "MarianInterface.h"
-#include "Translation.h"
 #include "Network.h"
+#include "DaemonClient.h"
+#include "BatchTranslator.h"
+#include "LineChunkReader.h"
+#include "ChunkSizer.h"
+#include "ReorderBuffer.h"
+#include "Checkpoint.h"
+#include "RecordFormat.h"
+#include <functional>
+#include <limits>
+#include <memory>
+#include <string>
 
 class CommandLineIface : public QObject {
     Q_OBJECT
@@ -18,25 +29,37 @@ private:
     // Event loop that would wait until translation completes
     QEventLoop eventLoop_;
 
-    // Settings, network and translator:
+    // Settings and network:
     Network network_;
     Settings settings_;
     ModelManager models_;
-    QPointer<MarianInterface> translator_;
 
-    // do_once file in and file out
+    // do_once file in and file out (or stdin and stdout), as UTF-8 bytes
     QFile infile_;
     QFile outfile_;
-    QTextStream instream_;
-    QTextStream outstream_;
+    std::unique_ptr<LineChunkReader> reader_;
 
-    static const int constexpr prefetchLines = 320;
+    // What to translate in each line: all of it, or a TSV column or JSONL field
+    RecordFormat format_;
+
+    // Input that may be read ahead of the output that has been written
+    static const std::size_t constexpr maxBytesInFlight = 64 * 1024 * 1024;
+
+    // How often to write a checkpoint with --resume
+    static const int constexpr checkpointIntervalSeconds = 10;
 
     // Functions
     void printLocalModels();
-    void doTranslation();
+    void doTranslation(BatchTranslator &translator, std::size_t workers, Checkpoint *checkpoint);
+    int doDaemonTranslation(DaemonClient &daemon, QString const &modelID, QString const &pivotID, std::function<BatchTranslator *()> local);
+    int runBatch(QCommandLineParser const &parser);
+    bool collectBatchJobs(QStringList const &inputs, QDir const &outputDir, std::vector<BatchTranslator::Job> &jobs);
+    int parseMarianSettings(QCommandLineParser const &parser, translateLocally::marianSettings &settings);
+    int parseRecordFormat(QCommandLineParser const &parser, RecordFormat &format);
+    int parseFuzzyThreshold(QCommandLineParser const &parser, double &threshold);
+    int parsePivotModel(QCommandLineParser const &parser, Model const &model, std::optional<Model> &pivot);
     void downloadRemoteModel(QString modelID);
-    inline QString &fetchData(QString &);
+    inline bool fetchData(std::string &, std::size_t maxWords, std::size_t &words, std::size_t maxBytes = std::numeric_limits<std::size_t>::max());
 
     int allowNativeMessagingClient(QStringList ids);
     int removeNativeMessagingClient(QStringList ids);
@@ -49,7 +72,6 @@ public:
 
 private slots:
     void outputError(QString error);
-    void outputTranslation(Translation output);
     void printRemoteModels();
 };
 
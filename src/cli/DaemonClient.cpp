@@ -0,0 +1,250 @@
+#include "DaemonClient.h"
+#include "NativeMsgDaemon.h"
+#include "NativeMsgIface.h"
+#include <QJsonDocument>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <numeric>
+#include <iostream>
+
+#if defined(Q_OS_WIN)
+// for _setmode, _fileno and _O_BINARY on Windows
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+namespace {
+
+void writeMessage(QIODevice &device, QByteArray const &message) {
+    std::uint32_t size = message.size();
+    device.write(reinterpret_cast<char const *>(&size), 4);
+    device.write(message);
+}
+
+}
+
+DaemonClient::DaemonClient(QObject *parent)
+: QObject(parent)
+, socket_(this)
+, lastId_(0) {
+    //
+}
+
+bool DaemonClient::connectToDaemon(int timeoutMs) {
+    socket_.connectToServer(translateLocally::daemonSocketName());
+    return socket_.waitForConnected(timeoutMs);
+}
+
+std::optional<QByteArray> DaemonClient::readMessage(int timeoutMs, bool &timedOut) {
+    timedOut = false;
+    for (;;) {
+        // Only take the message out once all of it is there, so a timeout
+        // halfway doesn't lose our place.
+        std::uint32_t size;
+        if (socket_.bytesAvailable() >= 4
+            && socket_.peek(reinterpret_cast<char *>(&size), 4) == 4
+            && socket_.bytesAvailable() >= 4 + static_cast<qint64>(size)) {
+            socket_.read(4);
+            return socket_.read(size);
+        }
+
+        if (!socket_.waitForReadyRead(timeoutMs)) {
+            timedOut = socket_.state() == QLocalSocket::ConnectedState;
+            return std::nullopt;
+        }
+    }
+}
+
+bool DaemonClient::fits(QString const &command, QJsonObject const &data) {
+    return QJsonDocument(QJsonObject{
+        {"id", std::numeric_limits<int>::max()},
+        {"command", command},
+        {"data", data}
+    }).toJson(QJsonDocument::Compact).size() < kMaxInputLength;
+}
+
+std::optional<QJsonValue> DaemonClient::request(QString const &command, QJsonObject const &data, QString &error) {
+    std::optional<std::vector<QJsonValue>> results = requestAll(command, {data}, error);
+    if (!results)
+        return std::nullopt;
+    return results->front();
+}
+
+std::optional<std::vector<QJsonValue>> DaemonClient::requestAll(QString const &command, std::vector<QJsonObject> const &data, QString &error, std::function<bool()> cancelled) {
+    using clock = std::chrono::steady_clock;
+
+    std::vector<QJsonValue> results(data.size());
+    int first = lastId_ + 1;
+    lastId_ += static_cast<int>(data.size());
+
+    std::deque<std::size_t> unsent(data.size());
+    std::iota(unsent.begin(), unsent.end(), 0);
+
+    // Requests the daemon was too busy for, and when to send them again
+    std::vector<std::pair<clock::time_point, std::size_t>> busy;
+
+    std::size_t inFlight = 0;
+    std::size_t received = 0;
+    while (received < data.size()) {
+        if (cancelled && cancelled())
+            return std::nullopt;
+
+        auto now = clock::now();
+        for (auto it = busy.begin(); it != busy.end();) {
+            if (it->first <= now) {
+                unsent.push_front(it->second);
+                it = busy.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        for (; !unsent.empty() && inFlight < static_cast<std::size_t>(kDaemonRequestsInFlight); unsent.pop_front()) {
+            // Sending the same id again is fine, the daemon is done with it.
+            QByteArray message = QJsonDocument(QJsonObject{
+                {"id", first + static_cast<int>(unsent.front())},
+                {"command", command},
+                {"data", data[unsent.front()]}
+            }).toJson(QJsonDocument::Compact);
+
+            if (message.size() >= kMaxInputLength) {
+                error = QString("Request too large for the translateLocally daemon, limit is %1 bytes.").arg(kMaxInputLength);
+                return std::nullopt;
+            }
+
+            writeMessage(socket_, message);
+            ++inFlight;
+        }
+
+        if (socket_.bytesToWrite() > 0 && !socket_.waitForBytesWritten(-1)) {
+            error = QString("Lost connection to the translateLocally daemon: %1").arg(socket_.errorString());
+            return std::nullopt;
+        }
+
+        bool timedOut;
+        std::optional<QByteArray> message = readMessage(kDaemonPollMs, timedOut);
+        if (!message) {
+            if (timedOut)
+                continue;
+            error = QString("Lost connection to the translateLocally daemon: %1").arg(socket_.errorString());
+            return std::nullopt;
+        }
+
+        // Skips anything left over from earlier requests that failed.
+        QJsonObject response = QJsonDocument::fromJson(*message).object();
+        int id = response.value("id").toInt();
+        if (id < first || id >= first + static_cast<int>(data.size()) || response.value("update").toBool())
+            continue;
+
+        --inFlight;
+
+        if (!response.value("success").toBool()) {
+            if (response.value("busy").toBool()) {
+                busy.emplace_back(clock::now() + std::chrono::milliseconds(kDaemonBusyRetryMs), id - first);
+                continue;
+            }
+            error = response.value("error").toString();
+            return std::nullopt;
+        }
+
+        results[id - first] = response.value("data");
+        ++received;
+    }
+
+    return results;
+}
+
+NativeMsgProxy::NativeMsgProxy(QObject *parent)
+: QObject(parent)
+, socket_(this)
+, operations_(0)
+, inputClosed_(false) {
+    connect(&socket_, &QLocalSocket::readyRead, this, &NativeMsgProxy::forwardResponses);
+    connect(&socket_, &QLocalSocket::disconnected, this, [this]() {
+        std::cerr << "Lost connection to the translateLocally daemon. Shutting down." << std::endl;
+        emit finished();
+    });
+}
+
+bool NativeMsgProxy::connectToDaemon(int timeoutMs) {
+    socket_.connectToServer(translateLocally::daemonSocketName());
+    return socket_.waitForConnected(timeoutMs);
+}
+
+void NativeMsgProxy::run() {
+#if defined(Q_OS_WIN)
+    // Same as NativeMsgIface::run()
+    _setmode(_fileno(stdin), _O_BINARY);
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+    iothread_ = std::thread([this]() {
+        for (;;) {
+            char len[4];
+            if (!std::cin.read(len, 4))
+                break;
+
+            std::uint32_t ilen = *reinterpret_cast<std::uint32_t *>(len);
+            if (ilen >= kMaxInputLength || ilen < 2) { // >= 2 because JSON is at least "{}"
+                std::cerr << "Invalid message size. Shutting down." << std::endl;
+                break;
+            }
+
+            QByteArray input(ilen, 0);
+            if (!std::cin.read(input.data(), ilen)) {
+                std::cerr << "Error while reading input message of length " << ilen << ". Shutting down." << std::endl;
+                break;
+            }
+
+            operations_++;
+
+            // The socket lives on the main thread
+            QMetaObject::invokeMethod(this, [this, input]() {
+                writeMessage(socket_, input);
+            }, Qt::QueuedConnection);
+        }
+
+        // Finish once the last response is passed on. If there are none
+        // pending, that's now.
+        QMetaObject::invokeMethod(this, [this]() {
+            inputClosed_ = true;
+            if (operations_ == 0)
+                emit finished();
+        }, Qt::QueuedConnection);
+    });
+}
+
+void NativeMsgProxy::forwardResponses() {
+    while (socket_.bytesAvailable() >= 4) {
+        std::uint32_t size;
+        socket_.peek(reinterpret_cast<char *>(&size), 4);
+        if (socket_.bytesAvailable() < 4 + static_cast<qint64>(size))
+            return;
+
+        socket_.read(4);
+        QByteArray message = socket_.read(size);
+
+        std::cout.write(reinterpret_cast<char const *>(&size), 4);
+        std::cout.write(message.data(), size);
+        std::cout.flush();
+
+        // Updates are followed by a final response, everything else answers a request.
+        if (!QJsonDocument::fromJson(message).object().value("update").toBool()) {
+            if (--operations_ == 0 && inputClosed_)
+                emit finished();
+        }
+    }
+}
+
+NativeMsgProxy::~NativeMsgProxy() {
+    // If the daemon went away, the io thread might still be waiting for the
+    // browser to send something. Don't wait for that, we're exiting anyway.
+    if (iothread_.joinable()) {
+        if (inputClosed_)
+            iothread_.join();
+        else
+            iothread_.detach();
+    }
+}
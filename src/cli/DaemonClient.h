@@ -0,0 +1,113 @@
+#pragma once
+#include <QJsonObject>
+#include <QLocalSocket>
+#include <QObject>
+#include <QString>
+#include <atomic>
+#include <functional>
+#include <optional>
+#include <thread>
+#include <vector>
+
+// Requests requestAll() has in flight at most. Well below native_max_requests,
+// at which the daemon starts turning requests away.
+const int constexpr kDaemonRequestsInFlight = 16;
+
+// How often requestAll() checks whether it was cancelled while it waits.
+const int constexpr kDaemonPollMs = 100;
+
+// How long requestAll() waits before sending a request again that the daemon
+// was too busy for.
+const int constexpr kDaemonBusyRetryMs = 250;
+
+/**
+ * Blocking client for the daemon (see NativeMsgDaemon.h), for the command line
+ * interface and the GUI. Sends requests and waits for their responses.
+ */
+class DaemonClient : public QObject {
+    Q_OBJECT
+
+public:
+    explicit DaemonClient(QObject *parent = nullptr);
+
+    /**
+     * @brief Connects to the daemon if it is running.
+     * @return false if there is no daemon to connect to.
+     */
+    bool connectToDaemon(int timeoutMs = 1000);
+
+    /**
+     * @brief Sends a request and waits for the response, skipping any updates.
+     * If the daemon is too busy for it, it is sent again a little later.
+     * @return The data of the response, or nothing if the request failed. In
+     * that case, error is set.
+     */
+    std::optional<QJsonValue> request(QString const &command, QJsonObject const &data, QString &error);
+
+    /**
+     * @brief Same, for a request with each of data, a few at a time so the
+     * daemon can work on them at the same time.
+     * @param cancelled checked while waiting, if given. Once it returns true,
+     * requestAll() stops waiting for the rest of the responses.
+     * @return The data of the responses in the same order, or nothing if any
+     * of them failed or it was cancelled. If one failed, error is set.
+     */
+    std::optional<std::vector<QJsonValue>> requestAll(QString const &command, std::vector<QJsonObject> const &data, QString &error, std::function<bool()> cancelled = nullptr);
+
+    /**
+     * @brief Whether a request is small enough for the daemon to accept it.
+     * It drops the connection of clients that send larger messages.
+     */
+    static bool fits(QString const &command, QJsonObject const &data);
+
+private:
+    QLocalSocket socket_;
+    int lastId_;
+
+    /**
+     * @brief Reads the next message, waiting at most timeoutMs for it.
+     * @return Nothing if it timed out (timedOut is set) or the connection
+     * was lost.
+     */
+    std::optional<QByteArray> readMessage(int timeoutMs, bool &timedOut);
+};
+
+/**
+ * Native messaging host that passes messages between the browser (stdin and
+ * stdout) and the daemon, so the browser is served by the daemon's models
+ * and cache instead of loading its own.
+ */
+class NativeMsgProxy : public QObject {
+    Q_OBJECT
+
+public:
+    explicit NativeMsgProxy(QObject *parent = nullptr);
+    ~NativeMsgProxy();
+
+    /**
+     * @brief Connects to the daemon if it is running.
+     * @return false if there is no daemon to connect to.
+     */
+    bool connectToDaemon(int timeoutMs = 1000);
+
+public slots:
+    /**
+     * @brief Starts passing messages along. Emits finished() once stdin is
+     * closed and all requests are answered, or the daemon went away.
+     */
+    void run();
+
+signals:
+    void finished();
+
+private:
+    QLocalSocket socket_;
+    std::thread iothread_;
+    std::atomic<int> operations_; // Requests that are not answered yet
+    std::atomic<bool> inputClosed_;
+
+    /**
+     * @brief Copies all complete messages from the daemon to stdout.
+     */
+    void forwardResponses();
+};
@@ -0,0 +1,204 @@
+#include "LineChunkReader.h"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+#if defined(Q_OS_UNIX)
+#include <sys/mman.h>
+#endif
+
+#if (QT_VERSION < QT_VERSION_CHECK(6, 0, 0))
+#include <QTextCodec>
+#endif
+
+namespace {
+
+// Position just past the next line break after pos, or end if there is none.
+std::size_t endOfLine(char const *data, std::size_t pos, std::size_t end) {
+    void const *found = std::memchr(data + pos, '\n', end - pos);
+    return found ? static_cast<char const *>(found) - data + 1 : end;
+}
+
+// Same as countWords() in MarianInterface: whitespace separated words.
+std::size_t countWords(char const *str, char const *end) {
+    bool inSpaces = true;
+    std::size_t numWords = 0;
+
+    for (; str != end; ++str) {
+        if (std::isspace(static_cast<unsigned char>(*str))) {
+            inSpaces = true;
+        } else if (inSpaces) {
+            numWords++;
+            inSpaces = false;
+        }
+    }
+    return numWords;
+}
+
+// UTF-32LE starts with the UTF-16LE mark, FF FE, followed by 00 00.
+bool hasUtf16Or32ByteOrderMark(QByteArray const &start) {
+    return start.startsWith("\xFF\xFE") || start.startsWith("\xFE\xFF")
+        || start.startsWith(QByteArray("\x00\x00\xFE\xFF", 4));
+}
+
+} // Anonymous namespace
+
+LineChunkReader::LineChunkReader(QFile &file, qint64 offset)
+: file_(file)
+, data_(nullptr)
+, size_(0)
+, pos_(0)
+, offset_(0)
+, eof_(false) {
+    // Rare, but QTextStream used to take care of it: decode it like before.
+    if (hasUtf16Or32ByteOrderMark(file_.peek(4))) {
+        stream_ = std::make_unique<QTextStream>(&file_);
+#if (QT_VERSION < QT_VERSION_CHECK(6, 0, 0))
+        stream_->setCodec(QTextCodec::codecForName(QByteArray("UTF-8")));
+#else
+        stream_->setEncoding(QStringConverter::Encoding::Utf8);
+#endif
+        stream_->setAutoDetectUnicode(true);
+        return;
+    }
+
+    if (!file_.isSequential() && file_.size() > 0) {
+        if (uchar *data = file_.map(0, file_.size())) {
+            data_ = reinterpret_cast<char const *>(data);
+            size_ = static_cast<std::size_t>(file_.size());
+#if defined(Q_OS_UNIX)
+            // We read it front to back, once.
+            posix_madvise(data, size_, POSIX_MADV_SEQUENTIAL);
+#endif
+        }
+    }
+
+    if (offset > 0) {
+        // Picking up where a previous reader left off.
+        if (data_) {
+            pos_ = std::min(static_cast<std::size_t>(offset), size_);
+        } else if (file_.isSequential()) {
+            while (offset_ < offset && fill()) {
+                std::size_t skip = std::min(static_cast<std::size_t>(offset - offset_), buffer_.size() - pos_);
+                pos_ += skip;
+                offset_ += skip;
+            }
+            return;
+        } else {
+            file_.seek(offset);
+        }
+        offset_ = offset;
+        return;
+    }
+
+    // Skip the UTF-8 byte order mark, it is not part of the text.
+    if (data_) {
+        if (size_ >= 3 && std::memcmp(data_, "\xEF\xBB\xBF", 3) == 0)
+            pos_ = 3;
+    } else {
+        while (buffer_.size() < 3 && fill());
+        if (buffer_.compare(0, 3, "\xEF\xBB\xBF") == 0)
+            pos_ = 3;
+    }
+    offset_ = pos_;
+}
+
+qint64 LineChunkReader::offset() const {
+    return stream_ ? -1 : offset_;
+}
+
+bool LineChunkReader::fill() {
+    if (eof_)
+        return false;
+
+    // Drop what has been handed out already before it piles up.
+    if (pos_ > 0 && pos_ >= buffer_.size() / 2) {
+        buffer_.erase(0, pos_);
+        pos_ = 0;
+    }
+
+    std::size_t offset = buffer_.size();
+    buffer_.resize(offset + kBlockSize);
+    qint64 read = file_.read(&buffer_[offset], kBlockSize);
+    buffer_.resize(offset + std::max<qint64>(read, 0));
+
+    if (read <= 0)
+        eof_ = true;
+
+    return read > 0;
+}
+
+bool LineChunkReader::next(std::string &chunk, std::size_t maxWords, std::size_t &words, std::size_t maxBytes) {
+    chunk.clear();
+    words = 0;
+
+    if (stream_) {
+        QString line;
+        while (words < maxWords) {
+            if (held_.empty()) {
+                if (!stream_->readLineInto(&line))
+                    break;
+                held_ = line.toStdString();
+                held_ += '\n'; // The new line has no EoL characters
+            }
+
+            if (!chunk.empty() && chunk.size() + held_.size() > maxBytes)
+                break;
+
+            words += countWords(held_.data(), held_.data() + held_.size());
+            chunk += held_;
+            held_.clear();
+        }
+    } else if (data_) {
+        std::size_t begin = pos_;
+        while (words < maxWords && pos_ < size_) {
+            std::size_t end = endOfLine(data_, pos_, size_);
+            if (pos_ > begin && end - begin > maxBytes)
+                break;
+            words += countWords(data_ + pos_, data_ + end);
+            pos_ = end;
+        }
+        chunk.assign(data_ + begin, pos_ - begin);
+        offset_ += pos_ - begin;
+    } else {
+        // Read blocks until they contain enough words, or there is no more.
+        std::size_t scanned = 0; // Relative to pos_, as fill() can move things
+        bool full = false;
+        for (;;) {
+            while (words < maxWords && pos_ + scanned < buffer_.size()) {
+                char const *data = buffer_.data();
+                std::size_t end = endOfLine(data, pos_ + scanned, buffer_.size());
+
+                // Only the last line of the input may lack a line break.
+                if (data[end - 1] != '\n' && !eof_)
+                    break;
+
+                if (scanned > 0 && end - pos_ > maxBytes) {
+                    full = true;
+                    break;
+                }
+
+                words += countWords(data + pos_ + scanned, data + end);
+                scanned = end - pos_;
+            }
+
+            if (words >= maxWords || full || eof_)
+                break;
+
+            fill();
+        }
+
+        chunk.assign(buffer_, pos_, scanned);
+        pos_ += scanned;
+        offset_ += scanned;
+    }
+
+    if (chunk.empty())
+        return false;
+
+    // Like QTextStream::readLine() did for the last line
+    if (chunk.back() != '\n')
+        chunk += '\n';
+
+    return true;
+}
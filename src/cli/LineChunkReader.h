@@ -0,0 +1,66 @@
+#pragma once
+#include <QFile>
+#include <QTextStream>
+#include <cstddef>
+#include <limits>
+#include <memory>
+#include <string>
+
+/**
+ * Reads input as chunks of whole lines of UTF-8, without decoding it. Files
+ * are memory mapped, anything else (like stdin) is read in large blocks. Only
+ * input with a UTF-16 or UTF-32 byte order mark is decoded, as before.
+ */
+class LineChunkReader {
+public:
+    /**
+     * @param file opened for reading. Has to outlive the reader.
+     * @param offset byte offset to start reading at, as returned by offset().
+     * Must be at the start of a line. Ignored for input that is decoded.
+     */
+    explicit LineChunkReader(QFile &file, qint64 offset = 0);
+
+    /**
+     * @brief Replaces chunk with the next lines, up to the line that brings
+     * it to maxWords words (or fewer, at the end of the input). There is at
+     * least one line, and the last line always ends with a line break.
+     * @param words set to the number of words in chunk.
+     * @param maxBytes stops before the line that would take chunk over this
+     * size. Unless it is the first line, which can be longer.
+     * @return false at the end of the input.
+     */
+    bool next(std::string &chunk, std::size_t maxWords, std::size_t &words, std::size_t maxBytes = std::numeric_limits<std::size_t>::max());
+
+    /**
+     * @brief Byte offset in the file up to which input has been returned by
+     * next(). -1 if the input is decoded, as there is no byte offset then.
+     */
+    qint64 offset() const;
+
+private:
+    static const std::size_t constexpr kBlockSize = 1 << 20;
+
+    QFile &file_;
+
+    // Memory mapped file, or nullptr
+    char const *data_;
+    std::size_t size_;
+    std::size_t pos_;
+
+    // Byte offset of pos_ in the file
+    qint64 offset_;
+
+    // Blocks read from a device that can't be mapped. Starting at pos_.
+    std::string buffer_;
+    bool eof_;
+
+    // Only for input that has to be decoded
+    std::unique_ptr<QTextStream> stream_;
+    std::string held_; // Line that did not fit in the last chunk, or empty
+
+    /**
+     * @brief Reads another block into buffer_.
+     * @return false if there was nothing left to read.
+     */
+    bool fill();
+};
@@ -0,0 +1,117 @@
+#include "NativeMsgDaemon.h"
+#include <QDebug>
+#include <QDir>
+#include <QLocalSocket>
+#include <QPointer>
+#include <QStandardPaths>
+#include <cstdint>
+
+namespace translateLocally {
+
+QString daemonSocketName() {
+#if defined(Q_OS_WIN)
+    // Named pipe, these don't live in the file system
+    return QString("translateLocally-%1").arg(qEnvironmentVariable("USERNAME"));
+#else
+    // Runtime location is private to the user (e.g. /run/user/1000)
+    QString dir = QStandardPaths::writableLocation(QStandardPaths::RuntimeLocation);
+    return QDir(dir).filePath("translateLocally.sock");
+#endif
+}
+
+} // namespace translateLocally
+
+namespace {
+
+/**
+ * Writes messages to a connection. Messages are written from the thread pool
+ * of NativeMsgIface, but the socket can only be used from the main thread, so
+ * writing is handed off to the main thread's event loop.
+ */
+class SocketClient : public NativeMsgClient {
+public:
+    SocketClient(QObject *context, QLocalSocket *socket)
+    : context_(context)
+    , socket_(socket) {
+        //
+    }
+
+    void write(QByteArray const &message) override {
+        QPointer<QLocalSocket> socket = socket_;
+        QMetaObject::invokeMethod(context_, [socket, message]() {
+            // Client might have disconnected in the meantime.
+            if (!socket)
+                return;
+
+            std::uint32_t size = message.size();
+            socket->write(reinterpret_cast<char const *>(&size), 4);
+            socket->write(message);
+        }, Qt::QueuedConnection);
+    }
+
+private:
+    QObject *context_;
+    QPointer<QLocalSocket> socket_;
+};
+
+}
+
+NativeMsgDaemon::NativeMsgDaemon(NativeMsgIface &iface, QObject *parent)
+: QObject(parent)
+, iface_(iface)
+, server_(this) {
+    connect(&server_, &QLocalServer::newConnection, this, [this]() {
+        while (QLocalSocket *socket = server_.nextPendingConnection()) {
+            auto client = std::make_shared<SocketClient>(this, socket);
+            connect(socket, &QLocalSocket::readyRead, this, [this, socket, client]() {
+                read(socket, client);
+            });
+            connect(socket, &QLocalSocket::disconnected, socket, &QObject::deleteLater);
+        }
+    });
+}
+
+bool NativeMsgDaemon::listen() {
+    QString name = translateLocally::daemonSocketName();
+    server_.setSocketOptions(QLocalServer::UserAccessOption);
+
+    if (server_.listen(name))
+        return true;
+
+    // Is there a daemon already, or is this a socket left behind by one that
+    // didn't shut down cleanly?
+    QLocalSocket probe;
+    probe.connectToServer(name);
+    if (probe.waitForConnected(1000)) {
+        qCritical() << "translateLocally is already running as daemon on" << name;
+        return false;
+    }
+
+    QLocalServer::removeServer(name);
+    if (!server_.listen(name)) {
+        qCritical() << "Could not listen on" << name << ":" << server_.errorString();
+        return false;
+    }
+
+    return true;
+}
+
+void NativeMsgDaemon::read(QLocalSocket *socket, std::shared_ptr<NativeMsgClient> const &client) {
+    while (socket->bytesAvailable() >= 4) {
+        std::uint32_t size;
+        socket->peek(reinterpret_cast<char *>(&size), 4);
+
+        if (size >= kMaxInputLength || size < 2) { // >= 2 because JSON is at least "{}"
+            qWarning() << "Invalid message size from client. Disconnecting it.";
+            socket->abort();
+            return;
+        }
+
+        // Wait for the rest of the message
+        if (socket->bytesAvailable() < 4 + static_cast<qint64>(size))
+            return;
+
+        socket->read(4);
+        iface_.receive(client, socket->read(size));
+    }
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <QLocalServer>
+#include <QObject>
+#include <QString>
+#include <memory>
+#include "NativeMsgIface.h"
+
+class QLocalSocket;
+
+namespace translateLocally {
+
+/**
+ * @brief Name of the local socket the daemon listens on. Only accessible by
+ * the current user.
+ */
+QString daemonSocketName();
+
+} // namespace translateLocally
+
+/**
+ * A single translateLocally process that serves all browser profiles and
+ * command line invocations of a user, so models are loaded and translations
+ * are cached only once. Start it with `translateLocally --daemon`.
+ *
+ * It speaks the native messaging protocol (see NativeMsgIface.h) over a
+ * local socket: every message is prefixed with its length as a 32-bit
+ * unsigned integer in native byte order. Message ids only have to be unique
+ * per connection.
+ */
+class NativeMsgDaemon : public QObject {
+    Q_OBJECT
+
+public:
+    /**
+     * @param iface handles the requests. Can be shared with other servers.
+     */
+    explicit NativeMsgDaemon(NativeMsgIface &iface, QObject *parent = nullptr);
+
+    /**
+     * @brief Starts listening on daemonSocketName().
+     * @return false if another daemon is already running, or the socket could
+     * not be created.
+     */
+    bool listen();
+
+private:
+    NativeMsgIface &iface_;
+    QLocalServer server_;
+
+    /**
+     * @brief Passes all complete messages the socket has received on to iface_.
+     */
+    void read(QLocalSocket *socket, std::shared_ptr<NativeMsgClient> const &client);
+};
@@ -0,0 +1,355 @@
+#include "NativeMsgHttpServer.h"
+#include <QDebug>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QPointer>
+#include <QRegularExpression>
+#include <QTcpSocket>
+#include <QTimer>
+#include <memory>
+
+namespace {
+
+// Request line and headers. Anything longer is not what we're expecting.
+static const int constexpr kMaxHeaderSize = 16 * 1024;
+
+// Connections that have nothing to do for this long get closed.
+static const int constexpr kIdleTimeoutMs = 60 * 1000;
+
+QByteArray reasonPhrase(int status) {
+    switch (status) {
+        case 100: return "Continue";
+        case 200: return "OK";
+        case 400: return "Bad Request";
+        case 403: return "Forbidden";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 411: return "Length Required";
+        case 413: return "Payload Too Large";
+        case 431: return "Request Header Fields Too Large";
+        case 503: return "Service Unavailable";
+        default: return "Error";
+    }
+}
+
+/**
+ * A single connection. Reads one request at a time, and only reads the next
+ * one once the current one is answered. This keeps responses in order and
+ * lets TCP hold back clients that send faster than we translate.
+ */
+class HttpConnection : public QObject {
+public:
+    HttpConnection(NativeMsgIface &iface, QObject *context, QTcpSocket *socket);
+
+    /**
+     * @brief Sends a message from iface_ to the client. The first one decides
+     * the status: single response, or chunked if it is an update. Messages
+     * for any other request than the current one are dropped.
+     * @param id of the request the message is for, 0 if it has none.
+     */
+    void send(QByteArray const &message, int id, bool update, int status);
+
+private:
+    NativeMsgIface &iface_;
+    QTcpSocket *socket_;
+    std::shared_ptr<NativeMsgClient> client_;
+    QTimer idle_;
+    QByteArray buffer_;
+    int lastId_; // Of the request that is being responded to, if responding_
+    bool responding_; // Request passed on to iface_, waiting for its response
+    bool chunked_; // Response is sent as chunks, one per message
+    bool keepAlive_;
+    bool continued_; // Sent 100 Continue for the current request
+
+    /**
+     * @brief Handles all complete requests in buffer_, until one of them has
+     * to wait for a response.
+     */
+    void read();
+
+    /**
+     * @brief Passes a request on to iface_.
+     */
+    void handle(QByteArray const &method, QByteArray const &path, QMap<QByteArray,QByteArray> const &headers, QByteArray const &body);
+
+    /**
+     * @brief Answers a request that never made it to iface_, and closes the
+     * connection.
+     */
+    void fail(int status, QString const &error);
+
+    void writeHead(int status, QList<QPair<QByteArray,QByteArray>> const &headers);
+
+    void finishResponse();
+};
+
+/**
+ * Hands messages from the thread pool of NativeMsgIface to the connection on
+ * the main thread.
+ */
+class HttpClient : public NativeMsgClient {
+public:
+    HttpClient(QObject *context, HttpConnection *connection)
+    : context_(context)
+    , connection_(connection) {
+        //
+    }
+
+    void write(QByteArray const &message) override {
+        // Parse it here, on the thread pool, rather than on the main thread.
+        QJsonObject json = QJsonDocument::fromJson(message).object();
+        int id = json.value("id").toInt(0);
+        bool update = json.value("update").toBool();
+        int status = 200;
+        if (!update && !json.value("success").toBool())
+            status = json.value("busy").toBool() ? 503 : 400;
+
+        QPointer<HttpConnection> connection = connection_;
+        QMetaObject::invokeMethod(context_, [connection, message, id, update, status]() {
+            // Client might have disconnected in the meantime.
+            if (!connection)
+                return;
+
+            connection->send(message, id, update, status);
+        }, Qt::QueuedConnection);
+    }
+
+private:
+    QObject *context_;
+    QPointer<HttpConnection> connection_;
+};
+
+HttpConnection::HttpConnection(NativeMsgIface &iface, QObject *context, QTcpSocket *socket)
+: QObject(context)
+, iface_(iface)
+, socket_(socket)
+, client_(std::make_shared<HttpClient>(context, this))
+, lastId_(0)
+, responding_(false)
+, chunked_(false)
+, keepAlive_(true)
+, continued_(false) {
+    socket_->setParent(this);
+    connect(socket_, &QTcpSocket::readyRead, this, &HttpConnection::read);
+    connect(socket_, &QTcpSocket::disconnected, this, &QObject::deleteLater);
+
+    idle_.setSingleShot(true);
+    idle_.setInterval(kIdleTimeoutMs);
+    connect(&idle_, &QTimer::timeout, socket_, &QTcpSocket::disconnectFromHost);
+    idle_.start();
+}
+
+void HttpConnection::read() {
+    while (!responding_ && socket_->state() == QAbstractSocket::ConnectedState) {
+        // Don't take in more than a single request could need.
+        qint64 room = kMaxHeaderSize + kMaxInputLength - buffer_.size();
+        if (room > 0 && socket_->bytesAvailable() > 0)
+            buffer_ += socket_->read(room);
+
+        idle_.start();
+
+        int headerEnd = buffer_.indexOf("\r\n\r\n");
+        if (headerEnd < 0) {
+            if (buffer_.size() > kMaxHeaderSize)
+                fail(431, "Request headers too large.");
+            return;
+        }
+
+        QList<QByteArray> lines = buffer_.left(headerEnd).split('\n');
+        QList<QByteArray> requestLine = lines.takeFirst().trimmed().split(' ');
+        if (requestLine.size() != 3 || !requestLine[2].startsWith("HTTP/1."))
+            return fail(400, "Malformed request line.");
+
+        QMap<QByteArray,QByteArray> headers;
+        for (auto &&line : lines) {
+            int colon = line.indexOf(':');
+            if (colon < 0)
+                return fail(400, "Malformed header.");
+            headers.insert(line.left(colon).trimmed().toLower(), line.mid(colon + 1).trimmed());
+        }
+
+        if (headers.contains("transfer-encoding"))
+            return fail(411, "Chunked request bodies are not supported, send a Content-Length.");
+
+        bool ok = true;
+        qint64 length = headers.value("content-length", "0").toLongLong(&ok);
+        if (!ok || length < 0)
+            return fail(400, "Malformed Content-Length.");
+
+        if (length >= kMaxInputLength)
+            return fail(413, QString("Request body too large, limit is %1 bytes.").arg(kMaxInputLength));
+
+        // Wait for the rest of the body. curl and others wait for permission
+        // before they send larger bodies.
+        if (buffer_.size() < headerEnd + 4 + length) {
+            if (!continued_ && headers.value("expect").toLower() == "100-continue") {
+                writeHead(100, {});
+                continued_ = true;
+            }
+            return;
+        }
+
+        QByteArray body = buffer_.mid(headerEnd + 4, length);
+        buffer_.remove(0, headerEnd + 4 + length);
+        continued_ = false;
+
+        // HTTP/1.1 keeps connections alive unless asked not to, HTTP/1.0 the
+        // other way around.
+        QByteArray connection = headers.value("connection").toLower();
+        keepAlive_ = requestLine[2] == "HTTP/1.0" ? connection == "keep-alive" : connection != "close";
+
+        handle(requestLine[0], requestLine[1], headers, body);
+    }
+}
+
+void HttpConnection::handle(QByteArray const &method, QByteArray const &path, QMap<QByteArray,QByteArray> const &headers, QByteArray const &body) {
+    // Web pages can make the browser send requests to localhost. Browsers add
+    // an Origin header to those, and we don't serve web pages, so refuse them.
+    // Checking Host protects against DNS rebinding. Browsers always send it.
+    if (headers.contains("origin"))
+        return fail(403, "Requests from web pages are not allowed.");
+
+    QByteArray host = headers.value("host");
+    host = host.left(host.lastIndexOf(':') > host.lastIndexOf(']') ? host.lastIndexOf(':') : host.size());
+    if (!host.isEmpty() && host != "localhost" && host != "127.0.0.1")
+        return fail(403, "Only requests to localhost are allowed.");
+
+    if (method != "POST")
+        return fail(405, "Use POST to send a command.");
+
+    static const QRegularExpression commandPattern("^/([A-Za-z]+)/?(\\?.*)?$");
+    auto match = commandPattern.match(QString::fromLatin1(path));
+    if (!match.hasMatch())
+        return fail(404, "Unknown command. Send commands to /<command>, e.g. /Translate.");
+
+    // The body is only the data: the command comes from the path, and the id
+    // from the connection.
+    QJsonObject data;
+    if (!body.trimmed().isEmpty()) {
+        QJsonParseError error;
+        QJsonDocument document = QJsonDocument::fromJson(body, &error);
+        if (error.error != QJsonParseError::NoError)
+            return fail(400, QString("Request body is not valid JSON: %1").arg(error.errorString()));
+        if (!document.isObject())
+            return fail(400, "Request body has to be a JSON object.");
+        data = document.object();
+    }
+
+    // Periodic stats would keep coming after the response, while the
+    // connection has moved on to the next request. Clients can poll instead.
+    if (match.captured(1) == "GetStats" && data.value("interval").toInt(0) > 0)
+        return fail(400, "GetStats with an interval is not supported over HTTP, poll GetStats instead.");
+
+    QByteArray message = QJsonDocument(QJsonObject{
+        {"id", ++lastId_},
+        {"command", match.captured(1)},
+        {"data", data}
+    }).toJson(QJsonDocument::Compact);
+
+    idle_.stop();
+    responding_ = true;
+    chunked_ = false;
+    iface_.receive(client_, message);
+}
+
+void HttpConnection::send(QByteArray const &message, int id, bool update, int status) {
+    // E.g. an update that was already on its way when its request finished.
+    if (!responding_ || (id != 0 && id != lastId_))
+        return;
+
+    if (!chunked_) {
+        if (!update) {
+            writeHead(status, {
+                {"Content-Type", "application/json"},
+                {"Content-Length", QByteArray::number(message.size())}
+            });
+            socket_->write(message);
+            return finishResponse();
+        }
+
+        writeHead(200, {
+            {"Content-Type", "application/x-ndjson"},
+            {"Transfer-Encoding", "chunked"}
+        });
+        chunked_ = true;
+    }
+
+    // One chunk per message, one message per line.
+    socket_->write(QByteArray::number(message.size() + 1, 16) + "\r\n" + message + "\n\r\n");
+
+    if (!update) {
+        socket_->write("0\r\n\r\n");
+        finishResponse();
+    }
+}
+
+void HttpConnection::fail(int status, QString const &error) {
+    QByteArray body = QJsonDocument(QJsonObject{
+        {"success", false},
+        {"error", error}
+    }).toJson(QJsonDocument::Compact);
+
+    keepAlive_ = false;
+    writeHead(status, {
+        {"Content-Type", "application/json"},
+        {"Content-Length", QByteArray::number(body.size())}
+    });
+    socket_->write(body);
+    finishResponse();
+}
+
+void HttpConnection::writeHead(int status, QList<QPair<QByteArray,QByteArray>> const &headers) {
+    QByteArray head = "HTTP/1.1 " + QByteArray::number(status) + " " + reasonPhrase(status) + "\r\n";
+
+    // 100 Continue is not the response yet, so no other headers.
+    if (status != 100) {
+        for (auto &&header : headers)
+            head += header.first + ": " + header.second + "\r\n";
+
+        if (status == 405)
+            head += "Allow: POST\r\n";
+        if (status == 503)
+            head += "Retry-After: 1\r\n";
+        if (!keepAlive_)
+            head += "Connection: close\r\n";
+    }
+
+    socket_->write(head + "\r\n");
+}
+
+void HttpConnection::finishResponse() {
+    responding_ = false;
+    chunked_ = false;
+
+    if (!keepAlive_) {
+        // Closes once everything is written.
+        socket_->disconnectFromHost();
+        return;
+    }
+
+    // Next request might be in the buffer already.
+    read();
+}
+
+}
+
+NativeMsgHttpServer::NativeMsgHttpServer(NativeMsgIface &iface, QObject *parent)
+: QObject(parent)
+, iface_(iface)
+, server_(this) {
+    connect(&server_, &QTcpServer::newConnection, this, [this]() {
+        while (QTcpSocket *socket = server_.nextPendingConnection())
+            new HttpConnection(iface_, this, socket);
+    });
+}
+
+bool NativeMsgHttpServer::listen(quint16 port) {
+    // Only local clients: there is no authentication.
+    if (!server_.listen(QHostAddress::LocalHost, port)) {
+        qCritical() << "Could not listen on port" << port << ":" << server_.errorString();
+        return false;
+    }
+
+    qInfo() << "Serving translations on" << QString("http://127.0.0.1:%1/").arg(server_.serverPort());
+    return true;
+}
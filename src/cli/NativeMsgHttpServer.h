@@ -0,0 +1,43 @@
+#pragma once
+#include <QObject>
+#include <QTcpServer>
+#include "NativeMsgIface.h"
+
+/**
+ * Serves the native messaging commands (see NativeMsgIface.h) over HTTP on
+ * localhost, for scripts and tools that would rather not deal with the
+ * length-prefixed framing. Start it with `translateLocally --serve <port>`.
+ *
+ * Every command is a POST to /<command>, e.g. /Translate or /ListModels, with
+ * the command's data as JSON body. The response body is the response message
+ * as described in NativeMsgIface.h. Failed requests get a 400 status, or 503
+ * when translateLocally is too busy to take the request.
+ *
+ * Requests that produce updates, such as Translate with "stream": true or
+ * DownloadModel, get a chunked response with one message per line, the
+ * final response last. GetStats with an interval is refused: poll GetStats
+ * instead.
+ *
+ * Connections are kept alive by default. Requests on the same connection are
+ * answered in order; use multiple connections to have requests translated
+ * concurrently.
+ */
+class NativeMsgHttpServer : public QObject {
+    Q_OBJECT
+
+public:
+    /**
+     * @param iface handles the requests. Can be shared with other servers.
+     */
+    explicit NativeMsgHttpServer(NativeMsgIface &iface, QObject *parent = nullptr);
+
+    /**
+     * @brief Starts listening on 127.0.0.1.
+     * @return false if the port could not be bound.
+     */
+    bool listen(quint16 port);
+
+private:
+    NativeMsgIface &iface_;
+    QTcpServer server_;
+};
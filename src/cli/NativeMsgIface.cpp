@@ -5,9 +5,17 @@
 #include <QSet>
 #include <QThread>
 #include <QAbstractEventDispatcher>
+#include <QRunnable>
+#include <algorithm>
+#include <cmath>
+#include <exception>
+#include <functional>
+#include <numeric>
 #include <memory>
 #include <mutex>
 #include <optional>
+#include <thread>
+#include <utility>
 #include <QNetworkReply>
 
 // bergamot-translator
@@ -15,6 +23,8 @@
 #include "3rd_party/bergamot-translator/src/translator/parser.h"
 #include "3rd_party/bergamot-translator/src/translator/response.h"
 #include "inventory/ModelManager.h"
+#include "Tracing.h"
+#include "SplitLines.h"
 #include "translator/translation_model.h"
 
 #if defined(Q_OS_WIN)
@@ -32,16 +42,6 @@ template<class... Ts> struct overloaded : Ts... { using Ts::operator()...; };
 // Explicit deduction guide (not needed as of C++20)
 template<class... Ts> overloaded(Ts...) -> overloaded<Ts...>;
 
-std::shared_ptr<marian::Options> makeOptions(const std::string &path_to_model_dir, const translateLocally::marianSettings &settings) {
-    std::shared_ptr<marian::Options> options(marian::bergamot::parseOptionsFromFilePath(path_to_model_dir + "/config.intgemm8bitalpha.yml"));
-    options->set("cpu-threads", settings.cpu_threads,
-                 "workspace", settings.workspace,
-                 "mini-batch-words", 1000,
-                 "alignment", "soft",
-                 "quiet", true);
-    return options;
-}
-
 // Little helper function that sets up a SingleShot connection in both Qt 5 and 6
 template <typename Sender, typename Emitter, typename Slot, typename... Args>
 QMetaObject::Connection connectSingleShot(Sender *sender, void (Emitter::*signal)(Args ...args), const QObject *context, Slot slot) {
@@ -56,6 +56,165 @@ QMetaObject::Connection connectSingleShot(Sender *sender, void (Emitter::*signal
 #endif
 }
 
+// QThreadPool::start(std::function<void()>) is only available from Qt 5.15
+class FunctionRunnable : public QRunnable {
+public:
+    explicit FunctionRunnable(std::function<void()> &&fun) : fun_(std::move(fun)) {
+        setAutoDelete(true);
+    }
+
+    void run() override {
+        fun_();
+    }
+
+private:
+    std::function<void()> fun_;
+};
+
+/**
+ * UTF-16 position (like in JavaScript strings) for each byte offset in a UTF-8
+ * string, plus one for the end of the string.
+ */
+std::vector<int> utf16Offsets(std::string const &text) {
+    std::vector<int> offsets(text.size() + 1);
+    int pos = 0;
+    for (std::size_t i = 0; i < text.size(); ++i) {
+        offsets[i] = pos;
+        unsigned char c = text[i];
+        if ((c & 0xc0) != 0x80) // Not a continuation byte, so start of a character
+            pos += c >= 0xf0 ? 2 : 1; // Four byte characters are surrogate pairs in UTF-16
+    }
+    offsets[text.size()] = pos;
+    return offsets;
+}
+
+/**
+ * Begin and end of every word in every sentence, packed into one array.
+ */
+QJsonArray packWords(marian::bergamot::AnnotatedText const &text) {
+    std::vector<int> offsets = utf16Offsets(text.text);
+    QJsonArray words;
+    for (std::size_t sentenceIdx = 0; sentenceIdx < text.numSentences(); ++sentenceIdx) {
+        for (std::size_t wordIdx = 0; wordIdx < text.numWords(sentenceIdx); ++wordIdx) {
+            marian::bergamot::ByteRange range = text.wordAsByteRange(sentenceIdx, wordIdx);
+            words.append(offsets[range.begin]);
+            words.append(offsets[range.end]);
+        }
+    }
+    return words;
+}
+
+// Scores are log probabilities, more precision than this is noise.
+double roundScore(float score) {
+    return std::round(score * 1000.0) / 1000.0;
+}
+
+/**
+ * Turns a response into the data of a Translate response. Word offsets,
+ * alignments and scores are only added if the request asked for them.
+ */
+QJsonObject toJson(marian::bergamot::Response &&response, TranslationRequest const &request) {
+    QJsonObject target{
+        {"text", QString::fromStdString(response.target.text)}
+    };
+
+    if (!request.quality && !request.alignments)
+        return QJsonObject{{"target", target}};
+
+    target["words"] = packWords(response.target);
+    QJsonObject data{{"target", target}};
+
+    if (request.alignments) {
+        data["source"] = QJsonObject{{"words", packWords(response.source)}};
+
+        std::size_t k = request.alignmentsTopK;
+        QJsonArray indices;
+        QJsonArray weights;
+        std::size_t sourceWordOffset = 0; // index of first word of the sentence in source.words
+        std::vector<std::size_t> order;
+
+        for (std::size_t sentenceIdx = 0; sentenceIdx < response.alignments.size(); ++sentenceIdx) {
+            for (auto &&row : response.alignments[sentenceIdx]) {
+                // Best k source words for this target word
+                order.resize(row.size());
+                std::iota(order.begin(), order.end(), 0);
+                std::size_t n = std::min(k, row.size());
+                std::partial_sort(order.begin(), order.begin() + n, order.end(), [&](std::size_t a, std::size_t b) {
+                    return row[a] > row[b];
+                });
+
+                for (std::size_t i = 0; i < k; ++i) {
+                    if (i < n) {
+                        indices.append(static_cast<qint64>(sourceWordOffset + order[i]));
+                        weights.append(qBound(0, qRound(row[order[i]] * 255.0f), 255));
+                    } else {
+                        indices.append(-1);
+                        weights.append(0);
+                    }
+                }
+            }
+
+            sourceWordOffset += response.source.numWords(sentenceIdx);
+        }
+
+        data["alignments"] = QJsonObject{
+            {"k", static_cast<qint64>(k)},
+            {"source", indices},
+            {"weights", weights}
+        };
+    }
+
+    if (request.quality) {
+        std::vector<int> offsets = utf16Offsets(response.target.text);
+        auto offset = [&](std::size_t pos) {
+            return offsets[std::min(pos, offsets.size() - 1)];
+        };
+
+        QJsonArray sentences;
+        QJsonArray wordCounts;
+        QJsonArray words;
+        QJsonArray wordRanges;
+        for (auto &&quality : response.qualityScores) {
+            sentences.append(roundScore(quality.sequence));
+            wordCounts.append(static_cast<qint64>(quality.word.size()));
+            for (float score : quality.word)
+                words.append(roundScore(score));
+            for (auto &&range : quality.wordByteRanges) {
+                wordRanges.append(offset(range.begin));
+                wordRanges.append(offset(range.end));
+            }
+        }
+
+        data["quality"] = QJsonObject{
+            {"sentences", sentences},
+            {"wordCounts", wordCounts},
+            {"words", words},
+            {"wordRanges", wordRanges}
+        };
+    }
+
+    return data;
+}
+
+/**
+ * Writes messages to stdout. The mutex keeps messages written from different
+ * threads from getting mixed up.
+ */
+class StdioClient : public NativeMsgClient {
+public:
+    void write(QByteArray const &message) override {
+        TRACE_SPAN("io", "writeMessage");
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::uint32_t outputSize = message.size();
+        std::cout.write(reinterpret_cast<char const *>(&outputSize), 4);
+        std::cout.write(message.data(), outputSize);
+        std::cout.flush();
+    }
+
+private:
+    std::mutex mutex_;
+};
+
 // Little helper to print QSet<QString> and QList<QString> without the need to
 // convert them into a QStringList.
 template <typename T>
@@ -69,6 +228,64 @@ QString join(QString glue, T const &list) {
     return out;
 };
 
+/**
+ * Lines of a text that is translated one line at a time. Shared with the
+ * translation callbacks.
+ */
+struct PendingLines {
+    std::string input;
+    std::vector<translateLocally::LineSegment> segments;
+    std::vector<std::string> translations; // For segments that are translated
+    std::mutex mutex;
+    std::size_t remaining; // Lines still being translated
+    bool abandoned; // Submitting or a line failed, nobody is waiting for it anymore
+    std::function<void(marian::bergamot::Response&&)> callback;
+    std::function<void(std::string const &)> error;
+
+    // Hands over the translation of segment i, and the whole text once that
+    // was the last one.
+    void done(std::size_t i, std::string &&translation) {
+        bool last;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            translations[i] = std::move(translation);
+            last = --remaining == 0 && !abandoned;
+        }
+        if (last)
+            finish();
+    }
+
+    // Gives up on the text because one of its lines could not be translated.
+    // Only the first line that fails reports it.
+    void fail(std::string const &message) {
+        bool first;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            first = !abandoned;
+            abandoned = true;
+            --remaining;
+        }
+        if (first)
+            error(message);
+    }
+
+    // Puts the translated lines and the whitespace in between back together.
+    void finish() {
+        std::string output;
+        for (std::size_t i = 0; i < segments.size(); ++i) {
+            if (segments[i].translate)
+                output += translations[i];
+            else
+                output.append(input, segments[i].begin, segments[i].end - segments[i].begin);
+        }
+
+        marian::bergamot::Response response;
+        response.target = marian::bergamot::AnnotatedText(std::move(output));
+        response.source = marian::bergamot::AnnotatedText(std::move(input));
+        callback(std::move(response));
+    }
+};
+
 }
 
 NativeMsgIface::NativeMsgIface(QObject * parent) :
@@ -77,6 +294,19 @@ NativeMsgIface::NativeMsgIface(QObject * parent) :
       , settings_(this)
       , models_(this, &settings_)
       , operations_(0)
+      , maxRequests_(0)
+      , maxPendingBytes_(0)
+      , pendingBytes_(0)
+      , received_(0)
+      , dispatched_(0)
+      , nextId_(0)
+      , nextShard_(0)
+      , threadsPerShard_(0)
+      , started_(std::chrono::steady_clock::now())
+      , pendingTranslations_(0)
+      , modelsLoaded_(0)
+      , modelLoadTime_(0)
+      , lastModelLoadTime_(0)
     {    
     // Disable synchronisation with C style streams. That should make IO faster
     std::ios_base::sync_with_stdio(false);
@@ -85,11 +315,53 @@ NativeMsgIface::NativeMsgIface(QObject * parent) :
     // independently.
     std::cin.tie(NULL);
 
-    // Init the marian translation service:
-    marian::bergamot::AsyncService::Config serviceConfig;
-    serviceConfig.numWorkers = settings_.marianSettings().cpu_threads;
-    serviceConfig.cacheSize = settings_.marianSettings().translation_cache ? kTranslationCacheSize : 0;
-    service_ = std::make_shared<marian::bergamot::AsyncService>(serviceConfig);
+    // Init the marian translation service(s). A single shard is only pinned
+    // if the settings ask for it, otherwise the OS knows best where to run its
+    // workers.
+    translateLocally::marianSettings marianSettings = settings_.marianSettings();
+    translateLocally::affinity::CpuSet cpus = translateLocally::affinity::workerCpus(marianSettings.cpu_affinity, marianSettings.avoid_smt);
+    std::vector<translateLocally::affinity::CpuSet> groups;
+    if (settings_.nativeShards() != 1)
+        groups = translateLocally::affinity::coreGroups(settings_.nativeShards(), cpus);
+
+    // Every shard needs at least one of the threads.
+    std::size_t maxShards = std::max<std::size_t>(1, marianSettings.cpu_threads);
+    if (groups.size() > maxShards)
+        groups = translateLocally::affinity::coreGroups(maxShards, cpus);
+
+    if (groups.size() <= 1)
+        groups = {cpus};
+
+    threadsPerShard_ = std::max<std::size_t>(1, marianSettings.cpu_threads / groups.size());
+
+    // More workers than CPUs to run them on would only get in each other's way.
+    for (auto &&group : groups)
+        if (!group.empty())
+            threadsPerShard_ = std::min(threadsPerShard_, group.size());
+
+    for (auto &&cpus : groups) {
+        auto shard = std::make_unique<Shard>();
+        shard->cpus = cpus;
+
+        marian::bergamot::AsyncService::Config serviceConfig;
+        serviceConfig.numWorkers = threadsPerShard_;
+        serviceConfig.cacheSize = translationCacheEntries(marianSettings, true) / groups.size();
+
+        // Workers inherit the CPUs and priority of the thread that starts them.
+        translateLocally::affinity::runPinned(shard->cpus, marianSettings.nice, [&]() {
+            shard->service = std::make_shared<marian::bergamot::AsyncService>(serviceConfig);
+        });
+
+        shards_.push_back(std::move(shard));
+    }
+
+    lineCache_.setCapacity(lineCacheBytes(marianSettings));
+    lineCache_.setEviction(marianSettings.translation_cache_eviction);
+
+    maxRequests_ = std::max(1u, settings_.nativeMaxRequests());
+    maxPendingBytes_ = static_cast<std::size_t>(settings_.nativeMaxPendingSize()) * 1024 * 1024;
+
+    pool_.setMaxThreadCount(std::min(kMaxPoolThreads, std::max(1, QThread::idealThreadCount() - static_cast<int>(threadsPerShard_ * shards_.size()))));
 
     // Pick up on network errors: Right now these are only caused by DownloadRequest
     // because of how Network.h is implemented. But in the future it might be that
@@ -117,7 +389,7 @@ NativeMsgIface::NativeMsgIface(QObject * parent) :
         qDebug() << "Error from model manager:" << err;
     });
 
-    connect(this, &NativeMsgIface::emitJson, this, &NativeMsgIface::processJson);
+    connect(this, &NativeMsgIface::emitParsed, this, &NativeMsgIface::dispatchRequests);
 }
 
 void NativeMsgIface::run() {
@@ -129,8 +401,17 @@ void NativeMsgIface::run() {
     _setmode(_fileno(stdout), _O_BINARY);
 #endif
 
+    stdio_ = std::make_shared<StdioClient>();
+
     iothread_ = std::thread([this](){
         for (;;) {
+            // Don't read any more requests while we're at the limit. This
+            // pushes back on the client through the stdin pipe filling up.
+            {
+                std::unique_lock<std::mutex> lck(pendingOpsMutex_);
+                pendingOpsCV_.wait(lck, [this](){ return operations_ < maxRequests_; });
+            }
+
             // First part of the message: Find how long the input is. If that
             // read fails, we're probably at EOF.
             char len[4];
@@ -145,16 +426,15 @@ void NativeMsgIface::run() {
 
             //  Read in the message into Json
             QByteArray input(ilen, 0);
-            if (!std::cin.read(input.data(), ilen)) {
-                std::cerr << "Error while reading input message of length " << ilen << ". Shutting down." << std::endl;
-                break;
+            {
+                TRACE_SPAN("io", "readMessage");
+                if (!std::cin.read(input.data(), ilen)) {
+                    std::cerr << "Error while reading input message of length " << ilen << ". Shutting down." << std::endl;
+                    break;
+                }
             }
 
-            // Keep track of the number of pending operations so we can wait for them to
-            // all finish before we shut down the main thread.
-            operations_++;
-
-            emit emitJson(input);
+            receive(stdio_, std::move(input));
         }
 
         // Here we lock the reading thread until all work is completed because
@@ -166,7 +446,39 @@ void NativeMsgIface::run() {
     });
 }
 
+void NativeMsgIface::receive(std::shared_ptr<NativeMsgClient> const &client, QByteArray input) {
+    // Called from stdin, the daemon and the HTTP server at the same time:
+    // without the lock, several of them could pass the check together and
+    // all be let in.
+    {
+        std::lock_guard<std::mutex> lock(admissionMutex_);
+
+        // Too many requests or too much text waiting to be translated already?
+        // Only let this request through if nothing else is in flight, otherwise
+        // large messages could never be handled.
+        if (operations_ > 0 && (operations_ >= maxRequests_ || pendingBytes_ + static_cast<std::size_t>(input.size()) > maxPendingBytes_)) {
+            pool_.start(new FunctionRunnable([this, client, input]() {
+                rejectJson(client, input);
+            }));
+            return;
+        }
+
+        // Keep track of the number of pending operations so we can wait for them to
+        // all finish before we shut down the main thread.
+        operations_++;
+
+        pendingBytes_ += static_cast<std::size_t>(input.size());
+    }
+
+    std::uint64_t sequence = received_++;
+    pool_.start(new FunctionRunnable([this, sequence, client, input]() {
+        processJson(sequence, client, input);
+    }));
+}
+
 void NativeMsgIface::handleRequest(TranslationRequest request) {
+    TRACE_SPAN("native", "Translate");
+
     // Initialise models based on the request.
     if (!findModels(request))
         return writeError(request, "Could not find the necessary translation models.");
@@ -174,31 +486,484 @@ void NativeMsgIface::handleRequest(TranslationRequest request) {
     if (!loadModels(request))
         return writeError(request, "Failed to load the necessary translation models.");
 
-    // Initialise translator settings options
+    // Segments in the translation memory that are like the text as a whole.
+    QJsonArray matches;
+    if (request.fuzzy > 0.0) {
+        if (auto memory = std::atomic_load(&memory_)) {
+            std::string text = request.text.trimmed().toStdString();
+            for (auto &&match : memory->findFuzzy(text, request.fuzzy, kMaxFuzzyMatches)) {
+                matches.append(QJsonObject{
+                    {"source", QString::fromStdString(match.source)},
+                    {"target", QString::fromStdString(match.target)},
+                    {"similarity", std::round(match.similarity * 1000.0) / 1000.0}
+                });
+            }
+        }
+
+        // Close enough, no need to translate it. Keep the whitespace around
+        // it, like translateByLine() does for exact matches.
+        if (request.fuzzyReplace && !request.html && !matches.isEmpty()) {
+            QString text = request.text;
+            int begin = 0;
+            while (begin < text.size() && text[begin].isSpace())
+                ++begin;
+            int end = text.size();
+            while (end > begin && text[end - 1].isSpace())
+                --end;
+
+            QString target = text.left(begin) + matches.first().toObject().value("target").toString() + text.mid(end);
+            return writeResponse(request, QJsonObject{
+                {"target", QJsonObject{{"text", target}}},
+                {"matches", matches}
+            });
+        }
+    }
+
+    // Splitting HTML into lines could break up elements, so HTML is never
+    // streamed. Neither are word scores, alignments and matches, as those
+    // refer to the text as a whole.
+    if (request.stream && !request.html && !request.quality && !request.alignments && request.fuzzy <= 0.0)
+        return streamTranslation(request);
+
+    // Initialise translator settings options. Alignments and scores cost time,
+    // so only when asked for.
     marian::bergamot::ResponseOptions options;
     options.HTML = request.html;
-    std::function<void(marian::bergamot::Response&&)> callback = [this,request](marian::bergamot::Response&& val) {
-        QJsonObject data = {
-            {"target", QJsonObject{
-                {"text", QString::fromStdString(std::move(val.target.text))}
-            }}
-        };
-        writeResponse(request, std::move(data));
+    options.alignment = request.alignments;
+    options.qualityScores = request.quality;
+    auto start = std::chrono::steady_clock::now();
+    std::function<void(marian::bergamot::Response&&)> callback = [this,request,start,matches](marian::bergamot::Response&& val) {
+        TRACE_ASYNC_END("native", "translation", request.id);
+        TRACE_SPAN("native", "respond");
+        pendingTranslations_--;
+        latency_.record(std::chrono::steady_clock::now() - start);
+        QJsonObject data = toJson(std::move(val), request);
+        if (!matches.isEmpty())
+            data["matches"] = matches;
+        writeResponse(request, data);
+    };
+    std::function<void(std::string const &)> error = [this,request,start](std::string const &err) {
+        TRACE_ASYNC_END("native", "translation", request.id);
+        pendingTranslations_--;
+        latency_.record(std::chrono::steady_clock::now() - start);
+        writeError(request, QString::fromStdString(err));
     };
 
     // Attempt translation. Beware of runtime errors
+    try {
+        pendingTranslations_++;
+        TRACE_ASYNC_BEGIN("native", "translation", request.id);
+        translate(request.text.toStdString(), callback, error, options);
+    } catch (const std::runtime_error &e) {
+        TRACE_ASYNC_END("native", "translation", request.id);
+        pendingTranslations_--;
+        writeError(request, QString::fromStdString(std::move(e.what())));
+    }
+}
+
+void NativeMsgIface::streamTranslation(TranslationRequest const &request) {
+    std::string input = request.text.toStdString();
+
+    // Lines come back in any order, but updates are written in order: as soon
+    // as all lines before it are translated. Whitespace between lines is
+    // copied into the translation as is.
+    struct PendingStream {
+        std::mutex mutex;
+        std::vector<std::optional<std::string>> parts;
+        std::size_t written; // parts already sent as update
+        int remaining;
+        std::optional<QString> error;
+    };
+
+    auto pending = std::make_shared<PendingStream>();
+    std::vector<std::pair<std::size_t, std::string>> lines; // index in parts, text
+
+    for (auto &&segment : translateLocally::splitLines(input)) {
+        std::string text = input.substr(segment.begin, segment.end - segment.begin);
+        if (segment.translate) {
+            lines.emplace_back(pending->parts.size(), std::move(text));
+            pending->parts.emplace_back(std::nullopt);
+        } else {
+            pending->parts.emplace_back(std::move(text));
+        }
+    }
+
+    pending->written = 0;
+    pending->remaining = lines.size();
+
+    Request response{request.id};
+    auto start = std::chrono::steady_clock::now();
+
+    // Sends whatever is translated at the start of the text as an update, and
+    // if everything is done, the final response. Called with the lock held, so
+    // updates are queued in order.
+    auto flush = [this, response, pending, start]() {
+        if (pending->error) {
+            if (pending->remaining == 0) {
+                latency_.record(std::chrono::steady_clock::now() - start);
+                writeError(response, std::move(*pending->error));
+            }
+            return;
+        }
+
+        std::string text;
+        for (; pending->written < pending->parts.size() && pending->parts[pending->written]; ++pending->written)
+            text += *pending->parts[pending->written];
+
+        if (!text.empty())
+            writeUpdate(response, QJsonObject{{"target", QJsonObject{{"text", QString::fromStdString(text)}}}});
+
+        if (pending->remaining == 0) {
+            TRACE_ASYNC_END("native", "translation", response.id);
+            latency_.record(std::chrono::steady_clock::now() - start);
+
+            std::string translation;
+            for (auto &&part : pending->parts)
+                translation += *part;
+
+            writeResponse(response, QJsonObject{{"target", QJsonObject{{"text", QString::fromStdString(translation)}}}});
+        }
+    };
+
+    // Nothing to translate (only whitespace)? Then we're already done.
+    if (lines.empty()) {
+        std::lock_guard<std::mutex> lock(pending->mutex);
+        return flush();
+    }
+
+    marian::bergamot::ResponseOptions options;
+    std::size_t submitted = 0;
+
+    try {
+        TRACE_ASYNC_BEGIN("native", "translation", request.id);
+        for (auto &&line : lines) {
+            std::size_t index = line.first;
+            std::function<void(marian::bergamot::Response&&)> callback = [this, pending, index, flush](marian::bergamot::Response&& val) {
+                pendingTranslations_--;
+                std::lock_guard<std::mutex> lock(pending->mutex);
+                pending->parts[index] = std::move(val.target.text);
+                --pending->remaining;
+                flush();
+            };
+            std::function<void(std::string const &)> error = [this, pending, flush](std::string const &err) {
+                pendingTranslations_--;
+                std::lock_guard<std::mutex> lock(pending->mutex);
+                if (!pending->error)
+                    pending->error = QString::fromStdString(err);
+                --pending->remaining;
+                flush();
+            };
+
+            pendingTranslations_++;
+            translate(std::move(line.second), callback, error, options);
+            ++submitted;
+        }
+    } catch (const std::runtime_error &e) {
+        // Lines that were submitted will still call back. Whoever is last
+        // writes the error.
+        pendingTranslations_--;
+        std::lock_guard<std::mutex> lock(pending->mutex);
+        pending->error = QString::fromStdString(e.what());
+        pending->remaining -= static_cast<int>(lines.size() - submitted);
+        flush();
+    }
+}
+
+void NativeMsgIface::handleRequest(BatchTranslationRequest request) {
+    TRACE_SPAN("native", "TranslateBatch");
+
+    // Initialise models based on the request.
+    if (!findModels(request))
+        return writeError(request, "Could not find the necessary translation models.");
+
+    if (!loadModels(request))
+        return writeError(request, "Failed to load the necessary translation models.");
+
+    // Translations come back in any order. Collect them here until the last
+    // one is in, which then writes the response.
+    struct PendingBatch {
+        std::mutex mutex;
+        QVector<QJsonObject> targets;
+        int remaining;
+        std::optional<QString> error;
+    };
+
+    auto batch = std::make_shared<PendingBatch>();
+    batch->targets.resize(request.segments.size());
+    batch->remaining = request.segments.size();
+
+    // Only the id is needed for responding, don't copy all the texts into each callback.
+    Request response{request.id};
+    auto start = std::chrono::steady_clock::now();
+
+    auto finish = [this, response, batch, start]() {
+        latency_.record(std::chrono::steady_clock::now() - start);
+
+        if (batch->error)
+            return writeError(response, std::move(*batch->error));
+
+        QJsonArray targets;
+        for (auto &&target : batch->targets)
+            targets.append(target);
+
+        writeResponse(response, QJsonObject{{"target", targets}});
+    };
+
+    if (request.segments.isEmpty())
+        return finish();
+
+    int submitted = 0;
+
+    try {
+        TRACE_ASYNC_BEGIN("native", "translation", request.id);
+        for (auto &&segment : request.segments) {
+            marian::bergamot::ResponseOptions options;
+            options.HTML = segment.html;
+
+            int index = submitted;
+            std::function<void(marian::bergamot::Response&&)> callback = [this, response, batch, index, finish](marian::bergamot::Response&& val) {
+                pendingTranslations_--;
+                QJsonObject target{
+                    {"text", QString::fromStdString(std::move(val.target.text))}
+                };
+
+                // Update is written before the final response, both go through
+                // the same per-id queue.
+                writeUpdate(response, QJsonObject{
+                    {"index", index},
+                    {"target", target}
+                });
+
+                bool last;
+                {
+                    std::lock_guard<std::mutex> lock(batch->mutex);
+                    batch->targets[index] = std::move(target);
+                    last = --batch->remaining == 0;
+                }
+
+                if (last) {
+                    TRACE_ASYNC_END("native", "translation", response.id);
+                    finish();
+                }
+            };
+            std::function<void(std::string const &)> error = [this, response, batch, finish](std::string const &err) {
+                pendingTranslations_--;
+                bool last;
+                {
+                    std::lock_guard<std::mutex> lock(batch->mutex);
+                    if (!batch->error)
+                        batch->error = QString::fromStdString(err);
+                    last = --batch->remaining == 0;
+                }
+
+                if (last) {
+                    TRACE_ASYNC_END("native", "translation", response.id);
+                    finish();
+                }
+            };
+
+            pendingTranslations_++;
+            translate(segment.text.toStdString(), callback, error, options);
+            ++submitted;
+        }
+    } catch (const std::runtime_error &e) {
+        // The texts that were submitted will still call back. Whoever is last
+        // writes the error.
+        pendingTranslations_--;
+        bool last;
+        {
+            std::lock_guard<std::mutex> lock(batch->mutex);
+            batch->error = QString::fromStdString(e.what());
+            batch->remaining -= request.segments.size() - submitted;
+            last = batch->remaining == 0;
+        }
+
+        if (last) {
+            TRACE_ASYNC_END("native", "translation", request.id);
+            finish();
+        }
+    }
+}
+
+void NativeMsgIface::translate(std::string &&text, std::function<void(marian::bergamot::Response&&)> callback, std::function<void(std::string const &)> error, marian::bergamot::ResponseOptions const &options) {
+    Shard &shard = acquireShard(text);
+
+    auto release = [&shard, callback](marian::bergamot::Response &&response) {
+        shard.pending--;
+        callback(std::move(response));
+    };
+
+    auto fail = [&shard, error](std::string const &message) {
+        shard.pending--;
+        error(message);
+    };
+
+    // HTML can't be split into lines, and alignments and scores are for the
+    // text as a whole. That also rules out the translation memory: there are
+    // no words, alignments or scores to go with its translations.
+    bool byLine = !options.HTML && !options.alignment && !options.qualityScores;
+
     try {
         std::visit(overloaded {
             [&](DirectModelInstance &model) {
-                service_->translate(model.model, std::move(request.text.toStdString()), callback, options);
+                if (byLine)
+                    translateByLine(shard, model.cacheKey, model.model, nullptr, std::move(text), release, fail, options);
+                else
+                    shard.service->translate(model.model, std::move(text), release, options);
             },
             [&](PivotModelInstance &model) {
-                service_->pivot(model.model, model.pivot, std::move(request.text.toStdString()), callback, options);
+                if (byLine)
+                    translateByLine(shard, model.cacheKey, model.model, model.pivot, std::move(text), release, fail, options);
+                else
+                    shard.service->pivot(model.model, model.pivot, std::move(text), release, options);
             }
-        }, *model_);
-    } catch (const std::runtime_error &e) {
-        writeError(request, QString::fromStdString(std::move(e.what())));
+        }, *shard.model);
+    } catch (...) {
+        shard.pending--;
+        throw;
+    }
+}
+
+void NativeMsgIface::translateByLine(Shard &shard, QString const &cacheKey, std::shared_ptr<marian::bergamot::TranslationModel> const &model, std::shared_ptr<marian::bergamot::TranslationModel> const &pivot, std::string &&text, std::function<void(marian::bergamot::Response&&)> callback, std::function<void(std::string const &)> error, marian::bergamot::ResponseOptions const &options) {
+    auto pending = std::make_shared<PendingLines>();
+    pending->input = std::move(text);
+    pending->segments = translateLocally::splitLines(pending->input);
+    pending->translations.resize(pending->segments.size());
+    pending->abandoned = false;
+    pending->callback = std::move(callback);
+    pending->error = std::move(error);
+
+    std::vector<std::size_t> lines;
+    for (std::size_t i = 0; i < pending->segments.size(); ++i)
+        if (pending->segments[i].translate)
+            lines.push_back(i);
+
+    if (lines.empty())
+        return pending->finish();
+
+    pending->remaining = lines.size();
+
+    // Takes the output of the first model for line i the rest of the way.
+    auto second = [&shard, pending, pivot, options](std::size_t i, std::string &&intermediate) {
+        if (!pivot)
+            return pending->done(i, std::move(intermediate));
+
+        shard.service->translate(pivot, std::move(intermediate), [pending, i](marian::bergamot::Response &&response) {
+            pending->done(i, std::move(response.target.text));
+        }, options);
+    };
+
+    auto lineAt = [&pending](std::size_t i) {
+        auto const &segment = pending->segments[i];
+        return pending->input.substr(segment.begin, segment.end - segment.begin);
+    };
+
+    // Lines in the translation memory are done, pivot or not.
+    std::vector<std::optional<std::string>> found(lines.size());
+    bool anyFound = false;
+    if (auto memory = std::atomic_load(&memory_)) {
+        for (std::size_t j = 0; j < lines.size(); ++j) {
+            found[j] = memory->find(lineAt(lines[j]));
+            anyFound = anyFound || found[j];
+        }
+    }
+
+    // A single model gets the text in one request unless part of it is
+    // already done: the service splits it into sentences and batches those
+    // the same, without the overhead of a request per line. Pivoting always
+    // goes line by line, so the pivot model can start on the first lines
+    // early.
+    if (!pivot && !anyFound) {
+        shard.service->translate(model, std::move(pending->input), std::move(pending->callback), options);
+        return;
     }
+
+    std::string const prefix = cacheKey.toStdString() + '\0';
+
+    std::size_t submitted = 0;
+    try {
+        for (std::size_t j = 0; j < lines.size(); ++j) {
+            std::size_t i = lines[j];
+
+            if (found[j]) {
+                ++submitted;
+                pending->done(i, std::move(*found[j]));
+                continue;
+            }
+
+            std::string line = lineAt(i);
+
+            // The service caches what a single model translates itself, only
+            // the first half of a pivot goes through lineCache_.
+            if (!pivot) {
+                shard.service->translate(model, std::move(line), [pending, i](marian::bergamot::Response &&response) {
+                    pending->done(i, std::move(response.target.text));
+                }, options);
+                ++submitted;
+                continue;
+            }
+
+            std::string key = prefix + line;
+
+            std::optional<std::string> cached;
+            {
+                std::lock_guard<std::mutex> lock(lineCacheMutex_);
+                cached = lineCache_.find(key);
+            }
+
+            if (cached) {
+                second(i, std::move(*cached));
+            } else {
+                shard.service->translate(model, std::move(line), [this, second, pending, i, key = std::move(key)](marian::bergamot::Response &&response) {
+                    {
+                        std::lock_guard<std::mutex> lock(lineCacheMutex_);
+                        lineCache_.insert(key, response.target.text, key.size() + response.target.text.size());
+                    }
+                    // This runs on a worker of the service: nothing up the
+                    // stack to catch what the pivot throws.
+                    try {
+                        second(i, std::move(response.target.text));
+                    } catch (const std::exception &e) {
+                        pending->fail(e.what());
+                    }
+                }, options);
+            }
+            ++submitted;
+        }
+    } catch (...) {
+        // The caller reports the error. Lines that were submitted still call
+        // back, but there is no one to hand the translation to. Unless one
+        // of them failed already, and reported it through error.
+        bool reported;
+        {
+            std::lock_guard<std::mutex> lock(pending->mutex);
+            reported = pending->abandoned;
+            pending->abandoned = true;
+            pending->remaining -= lines.size() - submitted;
+        }
+        if (reported)
+            return;
+        throw;
+    }
+}
+
+NativeMsgIface::Shard &NativeMsgIface::acquireShard(std::string const &text) {
+    std::size_t start = nextShard_++;
+    Shard *best = nullptr;
+    for (std::size_t i = 0; i < shards_.size(); ++i) {
+        Shard &shard = *shards_[(start + i) % shards_.size()];
+        if (!best || shard.pending < best->pending)
+            best = &shard;
+    }
+
+    // Each shard has its own cache, so the same text should go to the same
+    // shard. Unless that one is a lot busier than the others.
+    Shard &home = *shards_[std::hash<std::string>{}(text) % shards_.size()];
+    if (home.pending <= best->pending + kMaxShardImbalance)
+        best = &home;
+
+    best->pending++;
+    return *best;
 }
 
 void NativeMsgIface::handleRequest(ListRequest request)  {
@@ -287,17 +1052,78 @@ void NativeMsgIface::handleRequest(DownloadRequest request)  {
     // Network::downloadComplete() or Network::error() will trigger the writeResponse or writeError for this request.
 }
 
+void NativeMsgIface::handleRequest(StatsRequest request)  {
+    Route route{};
+    {
+        std::lock_guard<std::mutex> lock(routesMutex_);
+        auto it = routes_.find(request.id);
+        if (it != routes_.end())
+            route = it->second;
+    }
+
+    // A new stats request replaces earlier periodic updates to the same
+    // client. Other clients keep theirs.
+    if (route.client) {
+        NativeMsgClient const *client = route.client.get();
+        stopStats(client);
+
+        if (request.interval > 0) {
+            QTimer *timer = new QTimer(this);
+            connect(timer, &QTimer::timeout, this, [this, client]() {
+                sendStats(client);
+            });
+            statsSubscriptions_.emplace(client, StatsSubscription{route.client, route.id, timer});
+            timer->start(request.interval);
+        }
+    }
+
+    writeResponse(request, stats());
+}
+
+void NativeMsgIface::sendStats(NativeMsgClient const *client) {
+    auto it = statsSubscriptions_.find(client);
+    if (it == statsSubscriptions_.end())
+        return;
+
+    std::shared_ptr<NativeMsgClient> recipient = it->second.client.lock();
+    if (!recipient)
+        return stopStats(client);
+
+    QJsonObject update{
+        {"update", true},
+        {"id", it->second.id},
+        {"data", stats()}
+    };
+
+    // Writing can block, so not on the main thread.
+    pool_.start(new FunctionRunnable([recipient, update]() {
+        recipient->write(QJsonDocument(update).toJson(QJsonDocument::Compact));
+    }));
+}
+
+void NativeMsgIface::stopStats(NativeMsgClient const *client) {
+    auto it = statsSubscriptions_.find(client);
+    if (it == statsSubscriptions_.end())
+        return;
+
+    // Might be called from the timer's own timeout.
+    it->second.timer->stop();
+    it->second.timer->deleteLater();
+    statsSubscriptions_.erase(it);
+}
+
 void NativeMsgIface::handleRequest(MalformedRequest request)  {
     writeError(request, std::move(request.error));
 }
 
 request_variant NativeMsgIface::parseJsonInput(QByteArray input) {
+    TRACE_SPAN("native", "parseJsonInput");
     QJsonDocument inputJson = QJsonDocument::fromJson(input);
     QJsonObject jsonObj = inputJson.object();
 
     // Define what are mandatory and what are optional request keys
     static const QStringList mandatoryKeys({"command", "id", "data"}); // Expected in every message
-    static const QSet<QString> commandTypes({"ListModels", "DownloadModel", "Translate"});
+    static const QSet<QString> commandTypes({"ListModels", "DownloadModel", "Translate", "TranslateBatch", "GetStats"});
     // Json doesn't have schema validation, so validate here, in place:
     QString command;
     int id;
@@ -332,7 +1158,7 @@ request_variant NativeMsgIface::parseJsonInput(QByteArray input) {
     if (command == "Translate") {
         // Keys expected in a translation request
         static const QStringList mandatoryKeysTranslate({"text"});
-        static const QStringList optionalKeysTranslate({"html", "quality", "alignments", "src", "trg", "model", "pivot"});
+        static const QStringList optionalKeysTranslate({"html", "quality", "alignments", "stream", "fuzzy", "fuzzyReplace", "src", "trg", "model", "pivot"});
         TranslationRequest ret;
         ret.set("id", id);
         for (auto&& key : mandatoryKeysTranslate) {
@@ -353,6 +1179,34 @@ request_variant NativeMsgIface::parseJsonInput(QByteArray input) {
             return MalformedRequest{id, QString("either the data fields src and trg, or the field model has to be specified")};
         }
         return ret;
+    } else if (command == "TranslateBatch") {
+        static const QStringList optionalKeysBatch({"html", "src", "trg", "model", "pivot"});
+        BatchTranslationRequest ret;
+        ret.set("id", id);
+        for (auto&& key : optionalKeysBatch) {
+            QJsonValueRef val = data[key];
+            if (!val.isNull()) {
+                ret.set(key, val);
+            }
+        }
+        QJsonValueRef texts = data["texts"];
+        if (!texts.isArray()) {
+            return MalformedRequest{id, QString("data field key texts must be an array!")};
+        }
+        for (auto&& item : texts.toArray()) {
+            if (item.isString()) {
+                ret.segments.append(BatchTranslationRequest::Segment{item.toString(), ret.html});
+            } else if (item.isObject() && item.toObject()["text"].isString()) {
+                QJsonObject segment = item.toObject();
+                ret.segments.append(BatchTranslationRequest::Segment{segment["text"].toString(), segment["html"].toBool(ret.html)});
+            } else {
+                return MalformedRequest{id, QString("every item in texts must be a string or an object with a text field")};
+            }
+        }
+        if ((!ret.src.isEmpty() && !ret.trg.isEmpty()) == (!ret.model.isEmpty())) {
+            return MalformedRequest{id, QString("either the data fields src and trg, or the field model has to be specified")};
+        }
+        return ret;
     } else if (command == "ListModels") {
         // Keys expected in a list requested
         static const QStringList optionalKeysList({"includeRemote"});
@@ -379,6 +1233,13 @@ request_variant NativeMsgIface::parseJsonInput(QByteArray input) {
             }
         }
         return ret;
+    } else if (command == "GetStats") {
+        StatsRequest ret;
+        ret.id = id;
+        ret.interval = data["interval"].toInt(0);
+        if (ret.interval < 0)
+            return MalformedRequest{id, QString("data field key interval cannot be negative!")};
+        return ret;
     } else {
         return MalformedRequest{id, QString("Developer error. We shouldn't ever be here! Command: %1").arg(command)};
     }
@@ -387,17 +1248,9 @@ request_variant NativeMsgIface::parseJsonInput(QByteArray input) {
 
 }
 
-void NativeMsgIface::lockAndWriteJsonHelper(QJsonDocument&& document) {
-    QByteArray arr = document.toJson();
-    std::lock_guard<std::mutex> lock(coutmutex_);
-    size_t outputSize = arr.size();
-    std::cout.write(reinterpret_cast<char*>(&outputSize), 4);
-    std::cout.write(arr.data(), outputSize);
-    std::cout.flush();
-}
-
 // Fills in the TranslationRequest.{model,pivot} parameters if src + trg are specified.
 bool NativeMsgIface::findModels(TranslationRequest &request) const {
+    TRACE_SPAN("native", "findModels");
     if (!request.model.isEmpty())
         return true;
 
@@ -416,50 +1269,326 @@ bool NativeMsgIface::findModels(TranslationRequest &request) const {
 }
 
 bool NativeMsgIface::loadModels(TranslationRequest const &request) {
-    // First, check if we have everything required already loaded:
-    if (model_ && std::visit(overloaded {
-        [&](DirectModelInstance const &instance) { return instance.modelID == request.model && request.pivot.isEmpty(); },
-        [&](PivotModelInstance const &instance) { return instance.modelID == request.model && instance.pivotID == request.pivot; }
-    }, *model_))
-        return true;
-
+    TRACE_SPAN("native", "loadModels");
+    std::optional<Model> model, pivot;
     if (!request.model.isEmpty() && !request.pivot.isEmpty()) {
-        auto model = models_.getModel(request.model);
-        auto pivot = models_.getModel(request.pivot);
+        model = models_.getModel(request.model);
+        pivot = models_.getModel(request.pivot);
 
         if (!model || !pivot || !model->isLocal() || !pivot->isLocal())
             return false;
-
-        model_ = PivotModelInstance{model->id(), pivot->id(), makeModel(*model), makeModel(*pivot)};
-        return true;
     } else if (!request.model.isEmpty()) {
-        auto model = models_.getModel(request.model);
+        model = models_.getModel(request.model);
         if (!model || !model->isLocal())
             return false;
-        
-        model_ = DirectModelInstance{model->id(), makeModel(*model)};
+    } else {
+        return false; // Should not happen, because we called findModels first, right?
+    }
+
+    // Check if we have everything required already loaded, and the model not
+    // updated since. All shards have the same model, so checking one is enough.
+    std::optional<ModelInstance> const &current = shards_.front()->model;
+    if (current && std::visit(overloaded {
+        [&](DirectModelInstance const &instance) { return instance.cacheKey == lineCacheKey(*model) && !pivot; },
+        [&](PivotModelInstance const &instance) { return instance.cacheKey == lineCacheKey(*model) && pivot && instance.pivotID == pivot->id(); }
+    }, *current))
         return true;
+
+    translateLocally::marianSettings settings = settings_.marianSettings();
+    settings.cpu_threads = threadsPerShard_;
+
+    // Load a replica for every shard at the same time, each on a thread pinned
+    // to the shard's CPUs: memory ends up on the NUMA node of the thread that
+    // first writes to it.
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::exception_ptr> errors(shards_.size());
+    std::vector<std::thread> loaders;
+    for (std::size_t i = 0; i < shards_.size(); ++i) {
+        loaders.emplace_back([&, i]() {
+            Shard &shard = *shards_[i];
+            translateLocally::affinity::pinCurrentThread(shard.cpus);
+            try {
+                if (pivot)
+                    shard.model = PivotModelInstance{model->id(), pivot->id(), lineCacheKey(*model), makeModel(*model, settings), makeModel(*pivot, settings)};
+                else
+                    shard.model = DirectModelInstance{model->id(), lineCacheKey(*model), makeModel(*model, settings)};
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        });
     }
 
-    return false; // Should not happen, because we called findModels first, right?
+    for (auto &&loader : loaders)
+        loader.join();
+
+    // Don't leave the shards with different models.
+    for (auto &&error : errors) {
+        if (error) {
+            for (auto &&shard : shards_)
+                shard->model.reset();
+            std::rethrow_exception(error);
+        }
+    }
+
+    lastModelLoadTime_ = std::chrono::steady_clock::now() - start;
+    modelLoadTime_ += lastModelLoadTime_;
+    modelsLoaded_ += pivot ? 2 : 1;
+
+    // With a pivot, the translation memory is still for the language pair as
+    // a whole, not the two steps.
+    QString memoryPath;
+    if (!model->srcTags.isEmpty())
+        memoryPath = translateLocally::TranslationMemory::pathFor(model->srcTags.firstKey(), (pivot ? *pivot : *model).trgTag);
+    std::atomic_store(&memory_, translateLocally::TranslationMemory::open(memoryPath));
+    return true;
 }
 
-std::shared_ptr<marian::bergamot::TranslationModel> NativeMsgIface::makeModel(Model const &model) {
+std::shared_ptr<marian::bergamot::TranslationModel> NativeMsgIface::makeModel(Model const &model, translateLocally::marianSettings const &settings) {
     // TODO: Maybe cache these shared ptrs? With a weakptr? They might still be around in the
     // translation queue even when we switched. No need to load them again.
+    TRACE_SPAN("native", "makeModel");
     return std::make_shared<marian::bergamot::TranslationModel>(
-        makeOptions(model.path.toStdString(), settings_.marianSettings()),
-        settings_.marianSettings().cpu_threads
+        makeOptions(model.path.toStdString(), settings, true),
+        settings.cpu_threads
     );
 }
 
-void NativeMsgIface::processJson(QByteArray input) {
+QString NativeMsgIface::lineCacheKey(Model const &model) {
+    return model.id() + QChar('\0') + model.path + QChar('\0') + QString::number(model.localversion);
+}
+
+QJsonObject NativeMsgIface::stats() const {
+    using milliseconds = std::chrono::duration<double, std::milli>;
+    marian::bergamot::CacheStats cache{0, 0};
+    QJsonArray shards;
+    for (auto &&shard : shards_) {
+        marian::bergamot::CacheStats shardCache = shard->service->cacheStats();
+        cache.hits += shardCache.hits;
+        cache.misses += shardCache.misses;
+
+        QJsonArray cpus;
+        for (int cpu : shard->cpus)
+            cpus.append(cpu);
+
+        shards.append(QJsonObject{
+            {"cpus", cpus},
+            {"translations", shard->pending.load()}
+        });
+    }
+
+    auto memory = std::atomic_load(&memory_);
+
+    QJsonObject lineCache;
+    {
+        std::lock_guard<std::mutex> lock(lineCacheMutex_);
+        lineCache = QJsonObject{
+            {"entries", static_cast<qint64>(lineCache_.size())},
+            {"bytes", static_cast<qint64>(lineCache_.cost())},
+            {"hits", static_cast<qint64>(lineCache_.stats().hits)},
+            {"misses", static_cast<qint64>(lineCache_.stats().misses)}
+        };
+    }
+
+    return QJsonObject{
+        {"uptime", std::chrono::duration<double>(std::chrono::steady_clock::now() - started_).count()},
+        {"threads", static_cast<qint64>(threadsPerShard_ * shards_.size())},
+        {"shards", shards},
+        {"queue", QJsonObject{
+            {"requests", operations_.load()},
+            {"bytes", static_cast<qint64>(pendingBytes_.load())},
+            {"translations", pendingTranslations_.load()}
+        }},
+        {"latency", latency_.toJson()},
+        {"cache", QJsonObject{
+            {"enabled", settings_.marianSettings().translation_cache},
+            {"size", static_cast<qint64>(translationCacheEntries(settings_.marianSettings(), true))},
+            {"hits", static_cast<qint64>(cache.hits)},
+            {"misses", static_cast<qint64>(cache.misses)}
+        }},
+        {"lineCache", lineCache},
+        {"translationMemory", QJsonObject{
+            {"size", static_cast<qint64>(memory ? memory->size() : 0)},
+            {"hits", static_cast<qint64>(memory ? memory->hits() : 0)}
+        }},
+        {"models", QJsonObject{
+            {"loaded", static_cast<qint64>(modelsLoaded_)},
+            {"loadTime", milliseconds(modelLoadTime_).count()},
+            {"lastLoadTime", milliseconds(lastModelLoadTime_).count()}
+        }}
+    };
+}
+
+void LatencyHistogram::record(std::chrono::steady_clock::duration latency) {
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+
+    std::size_t bucket = 0;
+    for (auto bound = 1000; bucket < kBuckets - 1 && us >= bound; bound *= 2)
+        ++bucket;
+
+    counts_[bucket]++;
+    count_++;
+    total_ += us;
+}
+
+QJsonObject LatencyHistogram::toJson() const {
+    QJsonArray buckets;
+    QJsonArray counts;
+    for (std::size_t i = 0; i < kBuckets; ++i) {
+        if (i < kBuckets - 1)
+            buckets.append(static_cast<qint64>(1) << i);
+        else
+            buckets.append(QJsonValue()); // null: unbounded
+        counts.append(static_cast<qint64>(counts_[i].load()));
+    }
+
+    std::size_t count = count_.load();
+    return QJsonObject{
+        {"count", static_cast<qint64>(count)},
+        {"mean", count > 0 ? total_.load() / 1000.0 / count : 0.0},
+        {"buckets", buckets},
+        {"counts", counts}
+    };
+}
+
+void NativeMsgIface::processJson(std::uint64_t sequence, std::shared_ptr<NativeMsgClient> client, QByteArray input) {
+    TRACE_SPAN("native", "processJson");
     auto myJsonInputVariant = parseJsonInput(input);
-    std::visit([&](auto&& req){handleRequest(req);}, myJsonInputVariant);
+
+    // Give the request an id that is unique across all clients, and remember
+    // where its responses should go.
+    int id = nextId_++;
+    int clientId = std::visit([id](auto &request) { return std::exchange(request.id, id); }, myJsonInputVariant);
+    {
+        std::lock_guard<std::mutex> lock(routesMutex_);
+        routes_.emplace(id, Route{std::move(client), clientId});
+    }
+
+    // Remember the size of this request so it can be released once it is answered
+    {
+        std::lock_guard<std::mutex> lock(requestBytesMutex_);
+        requestBytes_.emplace(id, input.size());
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(parsedMutex_);
+        parsed_.emplace(sequence, std::move(myJsonInputVariant));
+    }
+    emit emitParsed();
+}
+
+void NativeMsgIface::rejectJson(std::shared_ptr<NativeMsgClient> client, QByteArray input) {
+    // Only interested in the id, so we can tell the client which request was rejected.
+    QJsonValue id = QJsonDocument::fromJson(input).object()["id"];
+
+    QJsonObject response{
+        {"success", false},
+        {"busy", true},
+        {"error", "Too many pending requests. Try again later."}
+    };
+
+    if (!id.isNull() && !id.isUndefined())
+        response["id"] = id.toInt();
+
+    // Written directly: this request was never counted as pending, nor routed.
+    client->write(QJsonDocument(std::move(response)).toJson(QJsonDocument::Compact));
+}
+
+void NativeMsgIface::releaseBytes(int id) {
+    std::lock_guard<std::mutex> lock(requestBytesMutex_);
+    auto it = requestBytes_.find(id);
+    if (it == requestBytes_.end())
+        return;
+
+    pendingBytes_ -= it->second;
+    requestBytes_.erase(it);
+}
+
+void NativeMsgIface::dispatchRequests() {
+    for (;;) {
+        decltype(parsed_)::node_type request;
+        {
+            std::lock_guard<std::mutex> lock(parsedMutex_);
+            request = parsed_.extract(dispatched_);
+        }
+
+        if (!request)
+            break; // Still waiting for this one to be parsed
+
+        ++dispatched_;
+        std::visit([&](auto&& req){handleRequest(req);}, request.mapped());
+    }
+}
+
+void NativeMsgIface::writeMessage(int id, QJsonObject &&message, bool done) {
+    {
+        std::lock_guard<std::mutex> lock(writesMutex_);
+        auto inserted = writes_.try_emplace(id);
+        inserted.first->second.push_back(PendingWrite{std::move(message), done});
+
+        // A pool thread is already writing messages for this id. It will
+        // pick this one up as well.
+        if (!inserted.second)
+            return;
+    }
+
+    pool_.start(new FunctionRunnable([this, id]() {
+        flushMessages(id);
+    }));
+}
+
+void NativeMsgIface::flushMessages(int id) {
+    for (;;) {
+        PendingWrite write;
+        {
+            std::lock_guard<std::mutex> lock(writesMutex_);
+            auto it = writes_.find(id);
+            if (it->second.empty()) {
+                writes_.erase(it);
+                return;
+            }
+            write = std::move(it->second.front());
+            it->second.pop_front();
+        }
+
+        // Send it to the client that made the request, with the id it used.
+        Route route{};
+        {
+            std::lock_guard<std::mutex> lock(routesMutex_);
+            auto it = routes_.find(id);
+            if (it != routes_.end()) {
+                route = it->second;
+                if (write.done)
+                    routes_.erase(it);
+            }
+        }
+
+        if (route.client) {
+            if (route.id >= 0)
+                write.message["id"] = route.id;
+            else
+                write.message.remove("id"); // The id could not be parsed
+
+            route.client->write(QJsonDocument(std::move(write.message)).toJson(QJsonDocument::Compact));
+        }
+
+        // Decrement pending operation count only once the response is out, so
+        // we don't shut down with responses still waiting to be written.
+        if (write.done) {
+            releaseBytes(id);
+
+            {
+                std::lock_guard<std::mutex> lock(pendingOpsMutex_);
+                operations_--;
+            }
+            pendingOpsCV_.notify_one();
+        }
+    }
 }
 
 NativeMsgIface::~NativeMsgIface() {
     if (iothread_.joinable()) {
         iothread_.join();
     }
+
+    pool_.waitForDone();
 }
@@ -2,7 +2,18 @@
 #include <iostream>
 
 #include <QPair>
+#include <QThreadPool>
+#include <QTimer>
+#include <QVector>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
 #include <mutex>
+#include <unordered_map>
 #include <optional>
 #include <type_traits>
 #include <QEventLoop>
@@ -12,8 +23,12 @@
 #include "MarianInterface.h"
 #include "Translation.h"
 #include "Network.h"
+#include "Affinity.h"
+#include "tm/TranslationMemory.h"
+#include "TranslationCache.h"
 #include <memory>
 #include <variant>
+#include <vector>
 
 // If we include the actual header, we break QT compilation.
 namespace marian {
@@ -21,11 +36,16 @@ namespace marian {
     class AsyncService;
     class TranslationModel;
     class Response;
+    struct ResponseOptions;
     }
 }
 
 
 const int constexpr kMaxInputLength = 10*1024*1024; // 10 MB limit on the input length via native messaging
+const int constexpr kMaxPoolThreads = 4; // Threads for parsing requests and serializing responses
+const int constexpr kMaxAlignmentsTopK = 8; // Most aligned source words per target word in a response
+const int constexpr kMaxFuzzyMatches = 3; // Most translation memory matches in a response
+const int constexpr kMaxShardImbalance = 16; // Texts a shard may be behind the least busy one and still get its texts
 
 /**
  * Incoming requests all extend Request which contains the client supplied message
@@ -57,6 +77,11 @@ const int constexpr kMaxInputLength = 10*1024*1024; // 10 MB limit on the input
  *   "success": false
  *   "error": str error message
  * }
+ *
+ * When too much work is already in flight (see the native_max_requests and
+ * native_max_pending_size settings) reading new requests is paused until some
+ * requests have been answered. A request that would exceed the size limit is
+ * rejected with an error response with `"busy": true`, and can be retried later.
  * 
  * Generic update format:
  * {
@@ -90,7 +115,26 @@ Q_DECLARE_METATYPE(Request);
  *     OPTIONAL
  *      "html": bool the input is HTML
  *      "quality": bool return quality scores
- *      "alignments" return token alignments
+ *      "alignments": bool or int return for each target word the best (or
+ *                    this many best, up to 8) aligned source words
+ *      "stream": bool send updates with partial translations (ignored for HTML,
+ *                quality, alignments and fuzzy)
+ *      "fuzzy": float also look for segments in the translation memory that
+ *               are at least this similar (0 to 1) to the text
+ *      "fuzzyReplace": bool if there is one, use its translation instead of
+ *                      translating the text (plain text only)
+ *   }
+ * }
+ *
+ * Update (only when "stream" is true): the translation of the next line(s) of
+ * the input. Together, the updates add up to the full translation.
+ * {
+ *   "id": int,
+ *   "update": true,
+ *   "data": {
+ *     "target": {
+ *       "text": str
+ *     }
  *   }
  * }
  * 
@@ -101,7 +145,32 @@ Q_DECLARE_METATYPE(Request);
  *   "data": {
  *     "target": {
  *       "text": str
- *     } 
+ *       "words": [int] (quality or alignments only) begin and end of each
+ *                word in text, as UTF-16 offsets: [begin0, end0, begin1, ...]
+ *     }
+ *     "source": { (alignments only)
+ *       "words": [int] same, for the input text
+ *     }
+ *     "alignments": { (alignments only)
+ *       "k": int source words per target word
+ *       "source": [int] for each target word k indices into source.words,
+ *                 best first, -1 if there are fewer than k source words
+ *       "weights": [int] alignment weight for each of those, 0 to 255
+ *     }
+ *     "quality": { (quality only)
+ *       "sentences": [float] score for each sentence
+ *       "wordCounts": [int] number of word scores for each sentence
+ *       "words": [float] score for each word (split on whitespace) of each sentence
+ *       "wordRanges": [int] begin and end of each of those words in target.text,
+ *                     as UTF-16 offsets: [begin0, end0, begin1, ...]
+ *     }
+ *     "matches": [ (fuzzy only, if any) most similar first, at most 3
+ *       {
+ *         "source": str segment in the translation memory
+ *         "target": str its translation
+ *         "similarity": float 0 to 1
+ *       }
+ *     ]
  *   }
  * }
  */
@@ -115,7 +184,10 @@ struct TranslationRequest : public Request {
     bool html{false};
     bool quality{false};
     bool alignments{false};
-
+    int alignmentsTopK{1};
+    bool stream{false};
+    double fuzzy{0.0};
+    bool fuzzyReplace{false};
 
     inline void set(QString key, QJsonValueRef& val) {
         if (key == "src") { // String keys
@@ -137,7 +209,18 @@ struct TranslationRequest : public Request {
         } else if (key == "quality") {
             quality = val.toBool();
         } else if (key == "alignments") {
-            alignments = val.toBool();
+            if (val.isDouble()) {
+                alignments = val.toInt() > 0;
+                alignmentsTopK = qBound(1, val.toInt(), kMaxAlignmentsTopK);
+            } else {
+                alignments = val.toBool();
+            }
+        } else if (key == "stream") {
+            stream = val.toBool();
+        } else if (key == "fuzzy") { // Double keys
+            fuzzy = qBound(0.0, val.toDouble(), 1.0);
+        } else if (key == "fuzzyReplace") {
+            fuzzyReplace = val.toBool();
         } else {
             std::cerr << "Unknown key type. " << key.toStdString() << " Something is very wrong!" << std::endl;
         }
@@ -155,6 +238,74 @@ struct TranslationRequest : public Request {
 
 Q_DECLARE_METATYPE(TranslationRequest);
 
+/**
+ * Translates many pieces of text with the same model in one go, e.g. all the
+ * text nodes of a web page. Each piece is reported as an update as soon as it
+ * is translated, and the response contains all of them in order.
+ *
+ * Request:
+ * {
+ *   "id": int
+ *   "command": "TranslateBatch",
+ *   "data": {
+ *     EIHER
+ *      "src": str BCP-47 language code,
+ *      "trg": str BCP-47 language code,
+ *     OR
+ *      "model": str model id,
+ *      "pivot": str model id
+ *     REQUIRED
+ *      "texts": [
+ *        str text to translate
+ *        OR
+ *        {
+ *          "text": str text to translate
+ *          "html": bool (optional) this text is HTML
+ *        }
+ *        ...
+ *      ]
+ *     OPTIONAL
+ *      "html": bool the texts are HTML, unless specified otherwise per text
+ *   }
+ * }
+ *
+ * Update (one per text, in order of completion):
+ * {
+ *   "id": int,
+ *   "update": true,
+ *   "data": {
+ *     "index": int position of the text in "texts"
+ *     "target": {
+ *       "text": str
+ *     }
+ *   }
+ * }
+ *
+ * Success response:
+ * {
+ *   "id": int,
+ *   "success": true,
+ *   "data": {
+ *     "target": [
+ *       {
+ *         "text": str
+ *       }
+ *       ...
+ *     ]
+ *   }
+ * }
+ */
+struct BatchTranslationRequest : public TranslationRequest {
+    struct Segment {
+        QString text;
+        bool html;
+    };
+
+    QVector<Segment> segments;
+};
+
+Q_DECLARE_METATYPE(BatchTranslationRequest);
+
 /**
  * List of available models.
  * 
@@ -236,6 +387,69 @@ struct DownloadRequest : Request {
 
 Q_DECLARE_METATYPE(DownloadRequest);
 
+/**
+ * Runtime statistics, to find out how translateLocally performs on a machine.
+ * Optionally keeps sending the statistics as updates every `interval` ms until
+ * the next GetStats request from the same client.
+ *
+ * Request:
+ * {
+ *   "id": int,
+ *   "command": "GetStats",
+ *   "data": {
+ *     OPTIONAL
+ *      "interval": int send updates every this many milliseconds (0 to stop)
+ *   }
+ * }
+ *
+ * Successful response (and update):
+ * {
+ *   "id": int,
+ *   "success": true,
+ *   "data": {
+ *     "uptime": float seconds since start
+ *     "threads": int number of translation workers
+ *     "shards": [{ one per translation service shard (see native_shards)
+ *       "cpus": [int] CPUs its workers are pinned to, empty if not pinned
+ *       "translations": int texts submitted to it but not yet finished
+ *     }]
+ *     "queue": {
+ *       "requests": int requests that have not been responded to yet
+ *       "bytes": int size of the requests that have not been responded to yet
+ *       "translations": int translations submitted but not yet finished
+ *     }
+ *     "latency": {
+ *       "count": int number of finished translation requests
+ *       "mean": float ms
+ *       "buckets": [int] upper bound of each histogram bucket in ms (last is unbounded)
+ *       "counts": [int] number of requests per bucket
+ *     }
+ *     "cache": {
+ *       "enabled": bool
+ *       "size": int max number of cached sentences
+ *       "hits": int
+ *       "misses": int
+ *     }
+ *     "lineCache": {   lines of plain text translated by the first model, e.g. into the pivot language
+ *       "entries": int
+ *       "bytes": int
+ *       "hits": int
+ *       "misses": int
+ *     }
+ *     "models": {
+ *       "loaded": int number of models loaded since start
+ *       "loadTime": float total ms spent loading models
+ *       "lastLoadTime": float ms spent loading the last model (into all shards)
+ *     }
+ *   }
+ * }
+ */
+struct StatsRequest : Request {
+    int interval;
+};
+
+Q_DECLARE_METATYPE(StatsRequest);
+
 /**
  * Internal structure to handle a request that is missing a required field.
  */
@@ -243,13 +457,14 @@ struct MalformedRequest : Request {
     QString error;
 };
 
-using request_variant = std::variant<TranslationRequest, ListRequest, DownloadRequest, MalformedRequest>;
+using request_variant = std::variant<TranslationRequest, BatchTranslationRequest, ListRequest, DownloadRequest, StatsRequest, MalformedRequest>;
 
 /**
  * Internal structure to cache a loaded direct model (i.e. no pivoting)
  */
 struct DirectModelInstance {
     QString modelID;
+    QString cacheKey; // See lineCacheKey()
     std::shared_ptr<marian::bergamot::TranslationModel> model;
 };
 
@@ -259,6 +474,7 @@ struct DirectModelInstance {
 struct PivotModelInstance {
     QString modelID;
     QString pivotID;
+    QString cacheKey; // See lineCacheKey(), of model
     std::shared_ptr<marian::bergamot::TranslationModel> model;
     std::shared_ptr<marian::bergamot::TranslationModel> pivot;
 };
@@ -268,6 +484,39 @@ struct PivotModelInstance {
  */
 using ModelInstance = std::variant<DirectModelInstance,PivotModelInstance>;
 
+/**
+ * Histogram of request latencies in power-of-two millisecond buckets: < 1 ms,
+ * < 2 ms, < 4 ms, etc. Thread-safe, it is updated from translation callbacks.
+ */
+class LatencyHistogram {
+public:
+    static const std::size_t constexpr kBuckets = 16; // Last one is >= 2^14 ms
+
+    void record(std::chrono::steady_clock::duration latency);
+    QJsonObject toJson() const;
+
+private:
+    std::array<std::atomic<std::size_t>, kBuckets> counts_{};
+    std::atomic<std::size_t> count_{0};
+    std::atomic<std::size_t> total_{0}; // microseconds
+};
+
+/**
+ * Where the messages for a request go: stdout when started by a browser, or a
+ * connection to the daemon (see NativeMsgDaemon.h and NativeMsgHttpServer.h).
+ * Called from multiple threads, so write() has to be thread-safe.
+ */
+class NativeMsgClient {
+public:
+    virtual ~NativeMsgClient() = default;
+
+    /**
+     * @brief Sends a single message. Messages are compact JSON, so they don't
+     * contain newlines.
+     */
+    virtual void write(QByteArray const &message) = 0;
+};
+
 class NativeMsgIface : public QObject {
     Q_OBJECT
 
@@ -275,31 +524,128 @@ public:
     explicit NativeMsgIface(QObject * parent=nullptr);
     ~NativeMsgIface();
 
+    /**
+     * @brief Handles a single message from a client. Messages are handled in
+     * the order in which they are received, and all messages in response go
+     * to that client. Thread-safe.
+     * @param client where to send the response(s)
+     * @param input char array of json
+     */
+    void receive(std::shared_ptr<NativeMsgClient> const &client, QByteArray input);
+
 public slots:
+    /**
+     * @brief Starts reading messages from stdin, and writing responses to stdout.
+     * Emits finished() once stdin is closed and all requests are answered.
+     */
     void run();
 
 private slots:
     /**
-     * @brief hooked to emitJson, called for every message that the native client
-     * receives, parses its json into a Request using `parseJsonInput`, and then
-     * calls the corresponding `handleRequest` overload.
-     * @param input char array of json
+     * @brief hooked to emitParsed, calls the corresponding `handleRequest`
+     * overload for each request that has been parsed, in the order in which
+     * the requests were received.
      */
-    void processJson(QByteArray input);
+    void dispatchRequests();
 
 private:
     // Threading
     std::thread iothread_;
     //QEventLoop eventLoop_;
-    std::mutex coutmutex_;
+    std::shared_ptr<NativeMsgClient> stdio_;
     
     // Sadly we don't have C++20 on ubuntu 18.04, otherwise could use std::atomic<T>::wait
     std::atomic<int> operations_; // Keeps track of all operations. So that we know when to quit
     std::mutex pendingOpsMutex_;
     std::condition_variable pendingOpsCV_;
 
-    // Marian shared ptr. We should be using a unique ptr but including the actual header breaks QT compilation. Sue me.
-    std::shared_ptr<marian::bergamot::AsyncService> service_;
+    // Admission control: iothread_ stops reading when there are maxRequests_
+    // requests in flight, and receive() rejects requests that would bring the
+    // size of the requests in flight over maxPendingBytes_. Clients of the
+    // daemon get rejected at maxRequests_ as well.
+    int maxRequests_;
+    std::size_t maxPendingBytes_;
+    std::atomic<std::size_t> pendingBytes_;
+    std::mutex admissionMutex_; // receive() checks and adds to both counters under it
+    std::mutex requestBytesMutex_;
+    std::unordered_multimap<int, std::size_t> requestBytes_; // Size of each request in flight, by id
+
+    // Requests are parsed on pool_, possibly out of order, and then handled on
+    // the main thread in the order they were received. Handling stays on the
+    // main thread because it changes model state.
+    std::atomic<std::uint64_t> received_;
+    std::uint64_t dispatched_; // Only touched by the main thread
+    std::mutex parsedMutex_;
+    std::map<std::uint64_t, request_variant> parsed_;
+
+    // Responses are serialized and written on pool_ as well. Messages for the
+    // same request id are written in order: an id has an entry in writes_ as
+    // long as a pool thread is working through its queue.
+    struct PendingWrite {
+        QJsonObject message;
+        bool done; // Last message for this request
+    };
+    std::mutex writesMutex_;
+    std::unordered_map<int, std::deque<PendingWrite>> writes_;
+
+    // Requests from all clients get a new id, unique in this process. Routes
+    // map it back to the client and the id that client used. A route is
+    // removed once the request is answered.
+    struct Route {
+        std::shared_ptr<NativeMsgClient> client;
+        int id;
+    };
+    std::atomic<int> nextId_;
+    std::mutex routesMutex_;
+    std::unordered_map<int, Route> routes_;
+
+    // Statistics for GetStats
+    std::chrono::steady_clock::time_point started_;
+    std::atomic<int> pendingTranslations_;
+    LatencyHistogram latency_;
+    std::size_t modelsLoaded_;
+    std::chrono::steady_clock::duration modelLoadTime_;
+    std::chrono::steady_clock::duration lastModelLoadTime_;
+
+    // Periodic GetStats updates, one per client that asked for them. The
+    // request is already answered, so they don't go through routes_. Only a
+    // weak reference, so they stop once the client is gone.
+    struct StatsSubscription {
+        std::weak_ptr<NativeMsgClient> client;
+        int id; // The id the client used for the request
+        QTimer *timer;
+    };
+    std::unordered_map<NativeMsgClient const *, StatsSubscription> statsSubscriptions_;
+
+    // What the first model of a translation made of each line of plain text,
+    // keyed on model id and line. With a pivot that is the text in the pivot
+    // language, which direct translations with the same model and pivots into
+    // other languages share. It outlives model changes, so e.g. de-en-fr and
+    // then de-en-es only translate into English once. Declared before the
+    // shards, as their workers write to it until they are stopped.
+    mutable std::mutex lineCacheMutex_;
+    TranslationCache<std::string, std::string> lineCache_;
+
+    // Translation service shards. Usually just one, but with the native_shards
+    // setting one per NUMA node or group of cores. Each has its workers pinned
+    // to its CPUs and its own copy of the model, in memory close to them.
+    // Texts go to the shard their hash picks, or the one with the fewest
+    // texts waiting if that one is too far behind.
+    struct Shard {
+        translateLocally::affinity::CpuSet cpus; // Empty if not pinned
+        // Marian shared ptr. We should be using a unique ptr but including the actual header breaks QT compilation. Sue me.
+        std::shared_ptr<marian::bergamot::AsyncService> service;
+        std::optional<ModelInstance> model; // Same model on all shards
+        std::atomic<int> pending{0}; // Texts submitted, not yet translated
+    };
+    std::vector<std::unique_ptr<Shard>> shards_;
+    std::atomic<std::size_t> nextShard_; // Where to start looking, so equally busy shards take turns
+    std::size_t threadsPerShard_;
+
+    // Translation memory for the language pair of the loaded model, if there
+    // is one. Replaced when the model changes, so always read and written with
+    // std::atomic_load() and std::atomic_store().
+    std::shared_ptr<translateLocally::TranslationMemory const> memory_;
 
     // TranslateLocally bits
     Settings settings_;
@@ -307,10 +653,45 @@ private:
     ModelManager models_;
     QMap<QString, QMap<QString, QList<Model>>> modelMap_;
 
-    std::optional<ModelInstance> model_;
+    // Last so it is destroyed (and waits for its jobs) first.
+    QThreadPool pool_;
 
     // Methods
     request_variant parseJsonInput(QByteArray bytes);
+
+    /**
+     * @brief Runs on pool_: parses a message with `parseJsonInput` and queues
+     * it to be handled on the main thread.
+     * @param sequence order in which the message was received
+     * @param input char array of json
+     */
+    void processJson(std::uint64_t sequence, std::shared_ptr<NativeMsgClient> client, QByteArray input);
+
+    /**
+     * @brief Runs on pool_: answers a message that was not admitted because
+     * too much work is in flight with a "busy" error.
+     * @param input char array of json
+     */
+    void rejectJson(std::shared_ptr<NativeMsgClient> client, QByteArray input);
+
+    /**
+     * @brief Stops counting the size of an answered request against the
+     * native_max_pending_size limit.
+     */
+    void releaseBytes(int id);
+
+    /**
+     * @brief Queues a message to be serialized and written on pool_, after any
+     * earlier messages for the same request id.
+     * @param done whether this is the response that completes the request.
+     */
+    void writeMessage(int id, QJsonObject &&message, bool done);
+
+    /**
+     * @brief Runs on pool_: writes queued messages for a request id until
+     * there are none left.
+     */
+    void flushMessages(int id);
     QByteArray converTranslationTo(marian::bergamot::Response&& response, int myID);
     
     /**
@@ -337,28 +718,46 @@ private:
      * @brief instantiates a model that will work with the service.
      * @returns model instance.
      */
-    std::shared_ptr<marian::bergamot::TranslationModel> makeModel(Model const &model);
+    std::shared_ptr<marian::bergamot::TranslationModel> makeModel(Model const &model, translateLocally::marianSettings const &settings);
+
+    /**
+     * @brief Prefix for the lines of model in lineCache_. lineCache_ survives
+     * model changes, so besides the id it has the path and version: once a
+     * model is updated, what the old one translated is no longer used.
+     */
+    static QString lineCacheKey(Model const &model);
+
+    /**
+     * @brief Picks the shard to translate text, and counts the text as
+     * pending on it. The same text goes to the same shard, where it is in
+     * the cache, unless that shard is much busier than the least busy one.
+     */
+    Shard &acquireShard(std::string const &text);
+
+    /**
+     * @brief Sends client the next periodic stats update, see
+     * handleRequest(StatsRequest).
+     */
+    void sendStats(NativeMsgClient const *client);
 
     /**
-     * @brief lockAndWriteJsonHelper This function locks input stream and then writes the size and a
-     *                               json message after. It would be called in many places so it
-     *                               makes sense to put the common bits here to avoid code duplication.
-     * @param json QJsonDocument that will be stringified and written to stdout in a blocking fashion.
+     * @brief Stops the periodic stats updates to client, if there are any.
      */
-    void lockAndWriteJsonHelper(QJsonDocument&& json);
+    void stopStats(NativeMsgClient const *client);
+
+    /**
+     * @brief Collects the statistics reported by GetStats.
+     */
+    QJsonObject stats() const;
 
     template <typename T> // T can be QJsonValue, QJsonArray or QJsonObject
     void writeResponse(Request const &request, T &&data) {
-        // Decrement pending operation count
-        operations_--;
-        pendingOpsCV_.notify_one();
-        
         QJsonObject response = {
             {"success", true},
             {"id", request.id},
             {"data", std::move(data)}
         };
-        lockAndWriteJsonHelper(QJsonDocument(std::move(response)));
+        writeMessage(request.id, std::move(response), true);
     }
 
     template <typename T>
@@ -368,17 +767,14 @@ private:
             {"id", request.id},
             {"data", std::move(data)}
         };
-        lockAndWriteJsonHelper(QJsonDocument(std::move(response)));
+        writeMessage(request.id, std::move(response), false);
     }
 
     void writeError(Request const &request, QString &&err) {
-        // Only writeResponse or writeError will decrement the counter, and thus
-        // only one should be called once per request. We can verify this by
-        // looking at the message ids in request, but that's too much runtime
-        // checking. I did do it in debug code.
-        operations_--;
-        pendingOpsCV_.notify_one();
-        
+        // Only writeResponse or writeError will decrement the counter (once the
+        // message is written), and thus only one should be called once per
+        // request. We can verify this by looking at the message ids in request,
+        // but that's too much runtime checking. I did do it in debug code.
         QJsonObject response{
             {"success", false},
             {"error", err}
@@ -389,15 +785,47 @@ private:
         if (request.id >= 0)
             response["id"] = request.id;
 
-        lockAndWriteJsonHelper(QJsonDocument(std::move(response)));
+        writeMessage(request.id, std::move(response), true);
     }
 
+    /**
+     * @brief Sends text off to the service to be translated with the currently
+     * loaded model (and pivot model). May throw std::runtime_error. If it
+     * fails after it returned, error is called instead of callback.
+     */
+    void translate(std::string &&text, std::function<void(marian::bergamot::Response&&)> callback, std::function<void(std::string const &)> error, marian::bergamot::ResponseOptions const &options);
+
+    /**
+     * @brief Translates plain text one line at a time with model, and then
+     * with pivot if that isn't nullptr. Lines in the translation memory are
+     * taken from there, lines come out of lineCache_ if model translated them
+     * before, and as soon as model is done with a line pivot can start on it.
+     * Without pivot, the text is sent as a whole if none of it is in the
+     * translation memory, and lineCache_ is not used. Only for plain text:
+     * the response has just the text. May throw std::runtime_error, or call
+     * error once it returned.
+     */
+    void translateByLine(Shard &shard, QString const &cacheKey, std::shared_ptr<marian::bergamot::TranslationModel> const &model, std::shared_ptr<marian::bergamot::TranslationModel> const &pivot, std::string &&text, std::function<void(marian::bergamot::Response&&)> callback, std::function<void(std::string const &)> error, marian::bergamot::ResponseOptions const &options);
+
     /**
      * @brief handleRequest handles a request type translationRequest and writes to stdout
      * @param myJsonInput translationRequest
      */
     void handleRequest(TranslationRequest myJsonInput);
 
+    /**
+     * @brief Translates the request line by line, and writes the translation
+     * as updates as soon as the lines at the start of the text are done.
+     * Called by handleRequest(TranslationRequest) once models are loaded.
+     */
+    void streamTranslation(TranslationRequest const &request);
+
+    /**
+     * @brief handleRequest handles a request type BatchTranslationRequest and writes to stdout
+     * @param myJsonInput BatchTranslationRequest
+     */
+    void handleRequest(BatchTranslationRequest myJsonInput);
+
     /**
      * @brief handleRequest handles a request type ListRequest and writes to stdout
      * @param myJsonInput ListRequest
@@ -410,6 +838,12 @@ private:
      */
     void handleRequest(DownloadRequest myJsonInput);
 
+    /**
+     * @brief handleRequest handles a request type StatsRequest and writes to stdout
+     * @param myJsonInput StatsRequest
+     */
+    void handleRequest(StatsRequest myJsonInput);
+
     /**
      * @brief handleRequest handles a request type MalformedRequest and writes to stdout
      * @param myJsonInput MalformedRequest
@@ -423,8 +857,7 @@ signals:
     void finished();
 
     /**
-     * @brief Internal signal that is emitted from the stdin reading thread whenever a full request message is read.
-     * @param input QByteArray of the json message
+     * @brief Internal signal that is emitted from the parsing threads whenever a request has been parsed.
      */
-    void emitJson(QByteArray input);
+    void emitParsed();
 };
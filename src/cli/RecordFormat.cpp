@@ -0,0 +1,269 @@
+#include "RecordFormat.h"
+#include <QByteArray>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <algorithm>
+#include <cstdio>
+
+namespace {
+
+bool isJsonWhitespace(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+std::size_t skipWhitespace(std::string const &s, std::size_t pos, std::size_t end) {
+    while (pos < end && isJsonWhitespace(s[pos]))
+        ++pos;
+    return pos;
+}
+
+// Position after the JSON string starting at pos, or npos if it doesn't end.
+std::size_t skipString(std::string const &s, std::size_t pos, std::size_t end) {
+    for (++pos; pos < end; ++pos) {
+        if (s[pos] == '\\')
+            ++pos;
+        else if (s[pos] == '"')
+            return pos + 1;
+    }
+    return std::string::npos;
+}
+
+// Position after the JSON value starting at pos, or npos if it isn't one.
+// Only checks as much as needed to find where the value ends.
+std::size_t skipValue(std::string const &s, std::size_t pos, std::size_t end) {
+    if (pos >= end)
+        return std::string::npos;
+
+    if (s[pos] == '"')
+        return skipString(s, pos, end);
+
+    if (s[pos] == '{' || s[pos] == '[') {
+        int depth = 0;
+        while (pos < end) {
+            char c = s[pos];
+            if (c == '"') {
+                pos = skipString(s, pos, end);
+                if (pos == std::string::npos)
+                    return pos;
+                continue;
+            }
+            if (c == '{' || c == '[') {
+                ++depth;
+            } else if (c == '}' || c == ']') {
+                if (--depth == 0)
+                    return pos + 1;
+            }
+            ++pos;
+        }
+        return std::string::npos;
+    }
+
+    // Numbers, true, false and null
+    std::size_t begin = pos;
+    while (pos < end && !isJsonWhitespace(s[pos]) && s[pos] != ',' && s[pos] != '}' && s[pos] != ']')
+        ++pos;
+    return pos > begin ? pos : std::string::npos;
+}
+
+// The UTF-8 text of the JSON string in s[begin, end), quotes included.
+std::string decodeString(std::string const &s, std::size_t begin, std::size_t end) {
+    // Common case: nothing to unescape.
+    if (std::find(s.begin() + begin, s.begin() + end, '\\') == s.begin() + end)
+        return s.substr(begin + 1, end - begin - 2);
+
+    QByteArray array = "[" + QByteArray(s.data() + begin, end - begin) + "]";
+    return QJsonDocument::fromJson(array).array().at(0).toString().toStdString();
+}
+
+void appendEscaped(std::string &out, char const *begin, char const *end) {
+    out += '"';
+    for (; begin != end; ++begin) {
+        unsigned char c = static_cast<unsigned char>(*begin);
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (c < 0x20) {
+                    char escaped[7];
+                    std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    out += escaped;
+                } else {
+                    out += static_cast<char>(c);
+                }
+        }
+    }
+    out += '"';
+}
+
+} // Anonymous namespace
+
+RecordFormat::RecordFormat(Type type, bool bitext, std::size_t column, std::string field)
+: type_(type)
+, bitext_(bitext)
+, column_(column)
+, field_(std::move(field)) {
+    //
+}
+
+bool RecordFormat::passThrough() const {
+    return type_ == Type::Text && !bitext_;
+}
+
+void RecordFormat::findTsvColumn(std::string const &input, Record &record) const {
+    std::size_t pos = record.begin;
+    for (std::size_t column = 1; column < column_; ++column) {
+        pos = input.find('\t', pos);
+        if (pos == std::string::npos || pos >= record.end)
+            return; // Fewer columns
+        ++pos;
+    }
+
+    record.found = true;
+    record.textBegin = pos;
+    record.textEnd = std::min(input.find('\t', pos), record.end);
+}
+
+void RecordFormat::findJsonField(std::string const &input, Record &record) const {
+    std::size_t end = record.end;
+    std::size_t pos = skipWhitespace(input, record.begin, end);
+    if (pos >= end || input[pos] != '{')
+        return;
+
+    pos = skipWhitespace(input, pos + 1, end);
+    if (pos < end && input[pos] == '}')
+        return; // Empty object, no field to translate
+
+    while (pos < end && input[pos] == '"') {
+        std::size_t keyEnd = skipString(input, pos, end);
+        if (keyEnd == std::string::npos)
+            break;
+        bool match = decodeString(input, pos, keyEnd) == field_;
+
+        pos = skipWhitespace(input, keyEnd, end);
+        if (pos >= end || input[pos] != ':')
+            break;
+
+        std::size_t valueBegin = skipWhitespace(input, pos + 1, end);
+        std::size_t valueEnd = skipValue(input, valueBegin, end);
+        if (valueEnd == std::string::npos)
+            break;
+
+        if (match && input[valueBegin] == '"') {
+            record.found = true;
+            record.textBegin = valueBegin;
+            record.textEnd = valueEnd;
+        }
+
+        pos = skipWhitespace(input, valueEnd, end);
+        if (pos < end && input[pos] == ',') {
+            pos = skipWhitespace(input, pos + 1, end);
+        } else if (pos < end && input[pos] == '}') {
+            record.insertAt = pos;
+            return;
+        } else {
+            break;
+        }
+    }
+
+    // Not an object we understand: leave the line alone.
+    record.found = false;
+}
+
+std::string RecordFormat::extract(Records &records) const {
+    std::string const &input = records.input;
+    std::string text;
+    text.reserve(input.size());
+
+    std::size_t pos = 0;
+    while (pos < input.size()) {
+        Record record;
+        record.begin = pos;
+        record.lineEnd = input.find('\n', pos);
+        record.lineEnd = record.lineEnd == std::string::npos ? input.size() : record.lineEnd + 1;
+        record.end = record.lineEnd;
+        while (record.end > record.begin && (input[record.end - 1] == '\n' || input[record.end - 1] == '\r'))
+            --record.end;
+        record.found = false;
+        record.textBegin = record.textEnd = record.begin;
+        record.insertAt = record.end;
+        record.lines = 1;
+
+        switch (type_) {
+            case Type::Text:
+                record.found = true;
+                record.textEnd = record.end;
+                text.append(input, record.textBegin, record.textEnd - record.textBegin);
+                break;
+            case Type::Tsv:
+                findTsvColumn(input, record);
+                text.append(input, record.textBegin, record.textEnd - record.textBegin);
+                break;
+            case Type::Jsonl:
+                findJsonField(input, record);
+                if (record.found) {
+                    std::string value = decodeString(input, record.textBegin, record.textEnd);
+                    record.lines += std::count(value.begin(), value.end(), '\n');
+                    text += value;
+                }
+                break;
+        }
+
+        text += '\n';
+        records.records.push_back(record);
+        pos = record.lineEnd;
+    }
+
+    return text;
+}
+
+std::string RecordFormat::merge(Records const &records, std::string const &translation) const {
+    std::string const &input = records.input;
+    std::string out;
+    out.reserve(input.size() + translation.size());
+
+    std::size_t pos = 0; // in translation
+    for (auto &&record : records.records) {
+        // This record's translation: the next record.lines lines.
+        std::size_t begin = pos;
+        for (std::size_t line = 0; line < record.lines && pos < translation.size(); ++line) {
+            pos = translation.find('\n', pos);
+            pos = pos == std::string::npos ? translation.size() : pos + 1;
+        }
+        std::size_t end = pos > begin && translation[pos - 1] == '\n' ? pos - 1 : pos;
+
+        if (!record.found) {
+            out.append(input, record.begin, record.lineEnd - record.begin);
+            continue;
+        }
+
+        char const *translated = translation.data() + begin;
+        std::size_t translatedSize = end - begin;
+
+        if (bitext_) {
+            out.append(input, record.begin, record.insertAt - record.begin);
+            if (type_ == Type::Jsonl) {
+                std::string name = field_ + "_translation";
+                out += ',';
+                appendEscaped(out, name.data(), name.data() + name.size());
+                out += ':';
+                appendEscaped(out, translated, translated + translatedSize);
+            } else {
+                out += '\t';
+                out.append(translated, translatedSize);
+            }
+            out.append(input, record.insertAt, record.lineEnd - record.insertAt);
+        } else {
+            out.append(input, record.begin, record.textBegin - record.begin);
+            if (type_ == Type::Jsonl)
+                appendEscaped(out, translated, translated + translatedSize);
+            else
+                out.append(translated, translatedSize);
+            out.append(input, record.textEnd, record.lineEnd - record.textEnd);
+        }
+    }
+
+    return out;
+}
@@ -0,0 +1,83 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/**
+ * How the command line finds the text to translate in each line of its input:
+ * the whole line, one column of tab-separated values (TSV), or one field of a
+ * JSON object per line (JSONL). Everything else in the line is passed through
+ * byte for byte. With bitext, the source text is kept and the translation is
+ * added next to it: as a second column for plain text, as an extra last
+ * column for TSV, and as a field named `<field>_translation` for JSONL.
+ *
+ * A chunk of lines goes through extract(), which gives the text to translate
+ * as one line per record, and merge(), which puts the translation of that
+ * text back into the lines.
+ */
+class RecordFormat {
+public:
+    enum class Type {
+        Text,
+        Tsv,
+        Jsonl
+    };
+
+    /**
+     * A line of input, with the byte offsets of the parts that matter.
+     */
+    struct Record {
+        std::size_t begin; // start of the line
+        std::size_t end; // end of its content, before the line break
+        std::size_t lineEnd; // after the line break
+        bool found; // whether the line has the column or field to translate
+        std::size_t textBegin; // part of the line that is translated
+        std::size_t textEnd;
+        std::size_t insertAt; // where bitext inserts the translation
+        std::size_t lines; // number of lines the text takes up in extract()'s output
+    };
+
+    /**
+     * A chunk of input lines, split into records by extract().
+     */
+    struct Records {
+        std::string input;
+        std::vector<Record> records;
+    };
+
+    /**
+     * @param column for Tsv, counting from 1.
+     * @param field for Jsonl, UTF-8.
+     */
+    RecordFormat(Type type = Type::Text, bool bitext = false, std::size_t column = 0, std::string field = std::string());
+
+    /**
+     * @brief Whether lines can be translated as they are, without extract()
+     * and merge().
+     */
+    bool passThrough() const;
+
+    /**
+     * @brief Finds the records in records.input.
+     * @return The text to translate, one line per record. Records without
+     * anything to translate (like a line that isn't valid JSON) are an empty
+     * line. A line of text may itself span lines, if it was a JSON string
+     * containing line breaks.
+     */
+    std::string extract(Records &records) const;
+
+    /**
+     * @brief Puts the translation of extract()'s output back into the input.
+     * @return The input with the translations in place (or added, for bitext).
+     */
+    std::string merge(Records const &records, std::string const &translation) const;
+
+private:
+    Type type_;
+    bool bitext_;
+    std::size_t column_;
+    std::string field_;
+
+    void findTsvColumn(std::string const &input, Record &record) const;
+    void findJsonField(std::string const &input, Record &record) const;
+};
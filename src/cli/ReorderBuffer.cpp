@@ -0,0 +1,52 @@
+#include "ReorderBuffer.h"
+
+ReorderBuffer::ReorderBuffer(std::size_t capacity)
+: capacity_(capacity)
+, bytes_(0)
+, next_(0) {
+    //
+}
+
+std::size_t ReorderBuffer::add(std::size_t bytes) {
+    bytes_ += bytes;
+    sizes_.push_back(bytes);
+    return next_ + sizes_.size() - 1;
+}
+
+void ReorderBuffer::complete(std::size_t seq, std::string &&output, QString const &error) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    completed_.emplace(seq, Completed{std::move(output), error});
+    if (seq == next_)
+        cv_.notify_one();
+}
+
+bool ReorderBuffer::full() const {
+    return !sizes_.empty() && bytes_ >= capacity_;
+}
+
+bool ReorderBuffer::empty() const {
+    return sizes_.empty();
+}
+
+bool ReorderBuffer::ready() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return completed_.count(next_) > 0;
+}
+
+std::string ReorderBuffer::take(QString &error) {
+    Completed chunk;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [&]() { return completed_.count(next_) > 0; });
+        auto it = completed_.find(next_);
+        chunk = std::move(it->second);
+        completed_.erase(it);
+    }
+
+    bytes_ -= sizes_.front();
+    sizes_.pop_front();
+    ++next_;
+
+    error = chunk.error;
+    return std::move(chunk.output);
+}
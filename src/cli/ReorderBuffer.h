@@ -0,0 +1,75 @@
+#pragma once
+#include <QString>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+
+/**
+ * Puts translations that complete out of order back in input order. Chunks
+ * are numbered as they are added, and taken out in that same order once they
+ * are complete. Chunks that were added but not yet taken out may hold at most
+ * capacity bytes: once that is reached, full() tells the reader to wait for
+ * the oldest chunk instead of reading more.
+ *
+ * add(), full(), ready() and take() are for the thread that reads and writes,
+ * complete() may be called from any thread.
+ */
+class ReorderBuffer {
+public:
+    /**
+     * @param capacity in bytes. A single chunk may be larger.
+     */
+    explicit ReorderBuffer(std::size_t capacity);
+
+    /**
+     * @brief Adds a chunk of bytes that is about to be translated.
+     * @return Its sequence number, for complete().
+     */
+    std::size_t add(std::size_t bytes);
+
+    /**
+     * @brief Hands over the translation of chunk seq, or an error.
+     */
+    void complete(std::size_t seq, std::string &&output, QString const &error);
+
+    /**
+     * @brief Whether no more chunks should be added until the oldest one is
+     * taken out.
+     */
+    bool full() const;
+
+    /**
+     * @brief Whether all chunks that were added have been taken out.
+     */
+    bool empty() const;
+
+    /**
+     * @brief Whether the oldest chunk is complete, i.e. take() won't wait.
+     */
+    bool ready();
+
+    /**
+     * @brief Waits for the oldest chunk to complete and takes it out. Must not
+     * be called if empty().
+     * @param error set to the error, if any.
+     */
+    std::string take(QString &error);
+
+private:
+    struct Completed {
+        std::string output;
+        QString error;
+    };
+
+    std::size_t capacity_;
+    std::size_t bytes_; // Of all chunks added but not taken out
+    std::deque<std::size_t> sizes_; // Bytes of each of those, oldest first
+    std::size_t next_; // Sequence number of the oldest chunk
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::map<std::size_t, Completed> completed_;
+};
@@ -7,6 +7,7 @@
 #include <QDirIterator>
 #include <QFile>
 #include <QSaveFile>
+#include <QSet>
 #include <QFileInfo>
 #include <QJsonDocument>
 #include <QJsonObject>
@@ -170,6 +171,35 @@ std::optional<ModelPair> ModelManager::getModelPairForLanguagePair(QString src,
     return ModelPair{*sourceModel, *pivotModel};
 }
 
+QList<ModelPair> ModelManager::getInstalledModelPairs() const {
+    QList<ModelPair> pairs;
+    QSet<QString> found; // "src-trg"
+
+    for (auto &&first : getInstalledModels()) {
+        if (first.srcTags.isEmpty())
+            continue;
+
+        QString src = first.srcTags.firstKey();
+        for (auto &&second : getInstalledModels()) {
+            if (!second.srcTags.contains(first.trgTag) || first.srcTags.contains(second.trgTag))
+                continue;
+
+            // Translating directly is better, and one pair is enough.
+            QString languages = src + "-" + second.trgTag;
+            if (found.contains(languages) || findModel(getInstalledModels(), src, second.trgTag))
+                continue;
+
+            found.insert(languages);
+
+            std::optional<Model> model = findModel(getInstalledModels(), src, first.trgTag);
+            std::optional<Model> pivot = findModel(getInstalledModels(), first.trgTag, second.trgTag);
+            pairs.append(ModelPair{*model, *pivot});
+        }
+    }
+
+    return pairs;
+}
+
 std::optional<Model> ModelManager::writeModel(QFile *file, ModelMeta meta, QString filename) {
     // Default value for filename is the basename of the file.
     if (filename.isEmpty())
@@ -232,6 +232,13 @@ public:
      */
     std::optional<ModelPair> getModelPairForLanguagePair(QString src, QString trg, QString pivot = QString("en")) const;
 
+    /**
+     * @Brief language pairs that no installed model translates directly, but
+     * two of them do through a language they share. One pair of models for
+     * each, preferring tiny ones like getModelPairForLanguagePair().
+     */
+    QList<ModelPair> getInstalledModelPairs() const;
+
     /**
      * @Brief extract a model into the directory of models managed by this
      * program. The optional filename argument is used to make up a folder name
@@ -2,6 +2,7 @@
 #include "version.h"
 #include "3rd_party/bergamot-translator/3rd_party/marian-dev/src/marian.h"
 #include "Translation.h"
+#include "Tracing.h"
 
 #include <QApplication>
 #include <QLoggingCategory>
@@ -9,7 +10,45 @@
 #include "cli/CLIParsing.h"
 #include "cli/CommandLineIface.h"
 #include "cli/NativeMsgIface.h"
+#include "cli/NativeMsgDaemon.h"
+#include "cli/NativeMsgHttpServer.h"
+#include "cli/DaemonClient.h"
 #include "types.h"
+#include <csignal>
+
+namespace {
+
+// How often the event loop checks whether we were asked to terminate.
+const int constexpr kTerminationPollMs = 250;
+
+volatile std::sig_atomic_t terminationRequested = 0;
+
+void requestTermination(int signal) {
+    terminationRequested = 1;
+    std::signal(signal, SIG_DFL); // A second one ends us right away
+}
+
+/**
+ * The daemon and native messaging host normally end with SIGTERM or SIGINT,
+ * which would skip writing the trace at exit. Instead, write it and quit the
+ * event loop so everything shuts down as usual.
+ */
+void dumpTraceOnTermination(QCoreApplication &app) {
+    std::signal(SIGINT, requestTermination);
+    std::signal(SIGTERM, requestTermination);
+
+    QTimer *timer = new QTimer(&app);
+    QObject::connect(timer, &QTimer::timeout, &app, [timer]() {
+        if (!terminationRequested)
+            return;
+        timer->stop();
+        translateLocally::tracing::dump();
+        QCoreApplication::quit();
+    });
+    timer->start(kTerminationPollMs);
+}
+
+} // Anonymous namespace
 
 int main(int argc, char *argv[])
 {
@@ -39,18 +78,59 @@ int main(int argc, char *argv[])
         if (!parser.isSet("debug"))
              QLoggingCategory::setFilterRules(QStringLiteral("*.debug=false"));
 
+        // Record a trace of this session, written out when we exit.
+        if (parser.isSet("trace") && !translateLocally::tracing::start(parser.value("trace")))
+            qWarning() << "This build of translateLocally does not support --trace. Rebuild with -DTRACING=ON.";
+
         // Launch application unless we're supposed to be in CLI mode
         translateLocally::AppType runtime = translateLocally::runType(parser);
+
+        if (translateLocally::tracing::enabled() && (runtime == translateLocally::AppType::NativeMsg || runtime == translateLocally::AppType::Daemon))
+            dumpTraceOnTermination(translateLocally);
         switch (runtime) {
             case translateLocally::AppType::CLI:
                 return CommandLineIface().run(parser);
             case translateLocally::AppType::NativeMsg:
         {
+                // Let the daemon do the work if it is running.
+                if (!parser.isSet("no-daemon")) {
+                    NativeMsgProxy * proxy = new NativeMsgProxy(&translateLocally);
+                    if (proxy->connectToDaemon()) {
+                        QObject::connect(proxy, &NativeMsgProxy::finished, &translateLocally, &QCoreApplication::quit);
+                        QTimer::singleShot(0, proxy, &NativeMsgProxy::run);
+                        return translateLocally.exec();
+                    }
+                    delete proxy;
+                }
+
                 NativeMsgIface * nativeMSG = new NativeMsgIface(&translateLocally);
                 QObject::connect(nativeMSG, &NativeMsgIface::finished, &translateLocally, &QCoreApplication::quit);
                 QTimer::singleShot(0, nativeMSG, &NativeMsgIface::run);
                 return translateLocally.exec();
         }
+            case translateLocally::AppType::Daemon:
+        {
+                // Both share the models and cache of a single iface.
+                NativeMsgIface iface;
+                NativeMsgDaemon daemon(iface);
+                NativeMsgHttpServer server(iface);
+
+                if (parser.isSet("daemon") && !daemon.listen())
+                    return 1;
+
+                if (parser.isSet("serve")) {
+                    bool ok = false;
+                    quint16 port = parser.value("serve").toUShort(&ok);
+                    if (!ok) {
+                        qCritical() << "Invalid port:" << parser.value("serve");
+                        return 1;
+                    }
+                    if (!server.listen(port))
+                        return 1;
+                }
+
+                return translateLocally.exec();
+        }
             case translateLocally::AppType::GUI:
                 break; //Handled later outside this scope.
         }
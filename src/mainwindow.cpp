@@ -21,10 +21,13 @@
 #include <QWindow>
 #include "Translation.h"
 #include "cli/NativeMsgManager.h"
+#include "tm/TranslationMemory.h"
 #include "logo/logo_svg.h"
 #include <iostream>
 #include <QScrollBar>
 #include <QMessageBox>
+#include <QTextCursor>
+#include <algorithm>
 
 namespace {
     void addDisabledItem(QComboBox *combobox, QString label) {
@@ -37,6 +40,69 @@ namespace {
         float percentage = (float) value / inputBox->verticalScrollBar()->maximum();
         outputBox->verticalScrollBar()->setValue((int) (outputBox->verticalScrollBar()->maximum() * percentage));
     }
+
+    int countWords(QString const &text) {
+        bool inSpaces = true;
+        int numWords = 0;
+
+        for (QChar c : text) {
+            if (c.isSpace()) {
+                inSpaces = true;
+            } else if (inSpaces) {
+                numWords++;
+                inSpaces = false;
+            }
+        }
+        return numWords;
+    }
+
+    /**
+     * Updates the text of `document` from `previous` to `text` with a single
+     * cursor edit that only replaces the paragraphs that differ between the
+     * two. Unlike setPlainText() this keeps the layout, scroll position and
+     * formatting of all untouched paragraphs. Assumes `previous` is what is
+     * currently in `document`.
+     */
+    void updatePlainText(QTextDocument *document, QString const &previous, QString const &text) {
+        int limit = std::min(previous.size(), text.size());
+
+        // Length of the common prefix and suffix. Together they never cover
+        // more than the shorter of the two texts.
+        int prefix = 0;
+        while (prefix < limit && previous[prefix] == text[prefix])
+            ++prefix;
+
+        if (prefix == previous.size() && prefix == text.size())
+            return; // Nothing changed
+
+        int suffix = 0;
+        while (suffix < limit - prefix && previous[previous.size() - 1 - suffix] == text[text.size() - 1 - suffix])
+            ++suffix;
+
+        // Widen the changed range to whole paragraphs. Both ends fall within
+        // the common prefix and suffix, so they're the same in both texts.
+        int begin = prefix > 0 ? previous.lastIndexOf('\n', prefix - 1) + 1 : 0;
+        int previousEnd = previous.indexOf('\n', previous.size() - suffix);
+        if (previousEnd == -1)
+            previousEnd = previous.size();
+        int end = text.size() - (previous.size() - previousEnd);
+
+        QTextCursor cursor(document);
+        cursor.beginEditBlock();
+        cursor.setPosition(begin);
+        cursor.setPosition(previousEnd, QTextCursor::KeepAnchor);
+        cursor.insertText(text.mid(begin, end - begin));
+        cursor.endEditBlock();
+    }
+
+    // Bounds (in ms) for the translate-as-you-type debounce delay. The lower
+    // bound coalesces the keystrokes of a single burst of typing, the upper
+    // bound makes sure a slow model never feels unresponsive.
+    constexpr int kMinTranslateDelay = 30;
+    constexpr int kMaxTranslateDelay = 750;
+
+    // Weight of the newest measurement in MainWindow::averageSpeed_.
+    constexpr double kSpeedSmoothing = 0.3;
 }
 
 MainWindow::MainWindow(QWidget *parent)
@@ -48,9 +114,14 @@ MainWindow::MainWindow(QWidget *parent)
     , network_(this)
     , translator_(new MarianInterface(this))
     , alignmentWorker_(new AlignmentWorker(this))
+    , translateTimer_(this)
+    , averageSpeed_(0)
 {
     ui_->setupUi(this);
 
+    translateTimer_.setSingleShot(true);
+    connect(&translateTimer_, &QTimer::timeout, this, qOverload<>(&MainWindow::translate));
+
     // Create icon for the main window
     QIcon icon = translateLocally::logo::getLogoFromSVG();
     this->setWindowIcon(icon);
@@ -62,6 +133,10 @@ MainWindow::MainWindow(QWidget *parent)
     // Hide download progress bar
     showDownloadPane(false);
 
+    // The output box is updated with small edits on every translation. Don't
+    // let those pile up on an undo stack nobody can reach.
+    ui_->outputBox->setUndoRedoEnabled(false);
+
     // Hide settings window
     translatorSettingsDialog_.setVisible(false);
 
@@ -74,6 +149,16 @@ MainWindow::MainWindow(QWidget *parent)
             settings_.translationModel.setValue("");
     }
 
+    // Same for the model it pivots through. Without it, the preferred model
+    // would translate into the wrong language.
+    if (!settings_.pivotModel().isEmpty()) {
+        auto pivot = models_.getModelForPath(settings_.pivotModel());
+        if (!pivot || !pivot->isLocal()) {
+            settings_.pivotModel.setValue("");
+            settings_.translationModel.setValue("");
+        }
+    }
+
     // If no model is preferred, load the first available one.
     if (settings_.translationModel().isEmpty() && !models_.getInstalledModels().empty())
         settings_.translationModel.setValue(models_.getInstalledModels().at(0).path);
@@ -100,7 +185,8 @@ MainWindow::MainWindow(QWidget *parent)
         // the currently loaded path. If it is, unload it.
         for (int i = first; i < last; ++i) {
             QVariant data = models_.data(models_.index(i, 0), Qt::UserRole);
-            if (data.canConvert<Model>() && data.value<Model>().path == settings_.translationModel()) {
+            if (data.canConvert<Model>() && (data.value<Model>().path == settings_.translationModel() || data.value<Model>().path == settings_.pivotModel())) {
+                settings_.pivotModel.setValue("");
                 settings_.translationModel.setValue("");
                 break;
             }
@@ -119,34 +205,43 @@ MainWindow::MainWindow(QWidget *parent)
     connect(translator_, &MarianInterface::pendingChanged, ui_->pendingIndicator, &QProgressBar::setVisible);
     connect(translator_, &MarianInterface::error, this, &MainWindow::popupError);
     connect(translator_, &MarianInterface::translationReady, this, [&](Translation translation) {
+        // We add a newline to the output to match the behaviour of the
+        // input box which has an unreachable at the end of the text! You 
+        // can't reach it with cursor keys, but it does show up when you use
+        // the scrollbar. So to match the line count better, also add it to
+        // the output.
+        QString previous = translation_ ? translation_.translation() + QString("\n") : ui_->outputBox->toPlainText();
         translation_ = translation;
-        
-        {   
-            // setPlainText() triggers a scrollpos reset to 0. We don't want
-            // that, it looks really janky. So we block that signal, and then
-            // manually resync the position afterwards.
-            QSignalBlocker blocker(ui_->outputBox->verticalScrollBar());
-
-            // We add a newline to the output to match the behaviour of the
-            // input box which has an unreachable at the end of the text! You 
-            // can't reach it with cursor keys, but it does show up when you use
-            // the scrollbar. So to match the line count better, also add it to
-            // the output.
-            ui_->outputBox->setPlainText(translation_.translation() + QString("\n"));
-        }
 
-        // Restore scroll position after it jumped to 0 due to setPlainText.
+        // Only replace the paragraphs that changed. Replacing the whole
+        // document would relayout all of it and reset the scroll position,
+        // which looks really janky on long texts.
+        ::updatePlainText(ui_->outputBox->document(), previous, translation_.translation() + QString("\n"));
+
+        // Resync scroll position in case the edit changed the document height.
         if (settings_.syncScrolling())
             ::copyScrollPosition(ui_->inputBox, ui_->outputBox);
         
         ui_->inputBox->document()->setModified(false); // Mark document as unmodified to tell highlighter alignment information is okay to use.
+        on_inputBox_cursorPositionChanged(); // Highlights in untouched paragraphs survived the update, refresh them for the new translation.
         ui_->translateAction->setEnabled(true); // Re-enable button after translation is done
         ui_->translateButton->setEnabled(true);
+        QStringList status;
         if (translation_.wordsPerSecond() > 0) { // Display the translation speed only if it's > 0. This prevents the user seeing weird number if pressed translate with empty input
-            ui_->statusbar->showMessage(tr("Translation speed: %1 words per second.").arg(translation_.wordsPerSecond()));
-        } else {
-            ui_->statusbar->clearMessage();
+            averageSpeed_ = averageSpeed_ > 0
+                ? kSpeedSmoothing * translation_.wordsPerSecond() + (1.0 - kSpeedSmoothing) * averageSpeed_
+                : translation_.wordsPerSecond();
+            status << tr("Translation speed: %1 words per second.").arg(translation_.wordsPerSecond());
         }
+        if (settings_.cacheTranslations()) { // Hit/miss counters help picking a sensible cache size
+            auto stats = translator_->cacheStats();
+            if (stats.hits + stats.misses > 0)
+                status << tr("Cache: %1 lines reused, %2 translated.").arg(stats.hits).arg(stats.misses);
+        }
+        if (!status.isEmpty())
+            ui_->statusbar->showMessage(status.join(" "));
+        else
+            ui_->statusbar->clearMessage();
     });
 
     connect(alignmentWorker_, &AlignmentWorker::ready, this, [&](QVector<WordAlignment> alignments, Translation::Direction direction) {
@@ -230,6 +325,12 @@ MainWindow::MainWindow(QWidget *parent)
     // Connect translator setting changes to reloading the model.
     connect(&settings_.cores, &Setting::valueChanged, this, &MainWindow::resetTranslator);
     connect(&settings_.workspace, &Setting::valueChanged, this, &MainWindow::resetTranslator);
+    connect(&settings_.cacheTranslations, &Setting::valueChanged, this, &MainWindow::resetTranslator);
+    connect(&settings_.cacheSize, &Setting::valueChanged, this, &MainWindow::resetTranslator);
+    connect(&settings_.cacheEviction, &Setting::valueChanged, this, &MainWindow::resetTranslator);
+    connect(&settings_.cpuAffinity, &Setting::valueChanged, this, &MainWindow::resetTranslator);
+    connect(&settings_.avoidSmt, &Setting::valueChanged, this, &MainWindow::resetTranslator);
+    connect(&settings_.nice, &Setting::valueChanged, this, &MainWindow::resetTranslator);
 
     // Connect model changes to reloading model and trigger initial loading of model
     bind(settings_.translationModel, std::bind(&MainWindow::resetTranslator, this));
@@ -291,7 +392,25 @@ void MainWindow::on_translateButton_clicked() {
 
 void MainWindow::on_inputBox_textChanged() {
     if (settings_.translateImmediately())
-        translate();
+        scheduleTranslation();
+}
+
+/**
+ * @brief MainWindow::scheduleTranslation debounces translate-as-you-type. The
+ * delay is based on how long we expect translating the current input to take,
+ * given the speed of recent translations: fast models translate (nearly) every
+ * keystroke, slow models wait until the user pauses typing. Any translation
+ * still in progress will be abandoned by MarianInterface once the new input
+ * arrives.
+ */
+void MainWindow::scheduleTranslation() {
+    int delay = kMinTranslateDelay;
+
+    if (averageSpeed_ > 0)
+        delay = qBound(kMinTranslateDelay, static_cast<int>(1000.0 * countWords(ui_->inputBox->toPlainText()) / averageSpeed_), kMaxTranslateDelay);
+
+    // (Re)starting the timer pushes back any translation scheduled earlier.
+    translateTimer_.start(delay);
 }
 
 void MainWindow::showDownloadPane(bool visible)
@@ -309,6 +428,7 @@ void MainWindow::handleDownload(QFile *file, QString filename, QVariant extra) {
     meta.installedOn = QDateTime::currentDateTimeUtc();
     auto model = models_.writeModel(file, meta, filename);
     if (model) { // if writeModel didn't fail
+        settings_.pivotModel.setValue("");
         settings_.translationModel.setValue(model->path, Setting::AlwaysEmit);
     }
 }
@@ -357,8 +477,10 @@ void MainWindow::downloadModelHelperSlot(Model model) {
 void MainWindow::on_localModels_activated(int index) {
     QVariant data = ui_->localModels->itemData(index);
 
-    if (data.canConvert<Model>() && data.value<Model>().isLocal()) {
-        settings_.translationModel.setValue(data.value<Model>().path);
+    if (data.canConvert<ModelPair>()) {
+        selectModel(data.value<ModelPair>().model.path, data.value<ModelPair>().pivot.path);
+    } else if (data.canConvert<Model>() && data.value<Model>().isLocal()) {
+        selectModel(data.value<Model>().path, QString());
     } else if (data.canConvert<Model>()) {
         downloadModel(data.value<Model>());
     } else if (data == Action::FetchRemoteModels) {
@@ -385,6 +507,14 @@ void MainWindow::updateLocalModels() {
         addDisabledItem(ui_->localModels, tr("Press here to get started."));
     }
 
+    // Language pairs that can only be translated through another language.
+    QList<ModelPair> pairs = models_.getInstalledModelPairs();
+    if (!pairs.empty()) {
+        ui_->localModels->insertSeparator(ui_->localModels->count());
+        for (auto &&pair : pairs)
+            ui_->localModels->addItem(tr("%1 to %2, through %3").arg(pair.model.src, pair.pivot.trg, pair.model.trg), QVariant::fromValue(pair));
+    }
+
     // Next, add any models available for download that we don't already have locally
     ui_->localModels->insertSeparator(ui_->localModels->count());
     if (models_.getRemoteModels().empty()) {
@@ -429,7 +559,9 @@ void MainWindow::updateSelectedModel() {
     if (settings_.translationModel() != "") {
         for (int i = 0; i < ui_->localModels->count(); ++i) {
             QVariant item = ui_->localModels->itemData(i);
-            if (item.canConvert<Model>() && item.value<Model>().path == settings_.translationModel()) {
+            if (settings_.pivotModel().isEmpty()
+                ? item.canConvert<Model>() && item.value<Model>().path == settings_.translationModel()
+                : item.canConvert<ModelPair>() && item.value<ModelPair>().model.path == settings_.translationModel() && item.value<ModelPair>().pivot.path == settings_.pivotModel()) {
                 ui_->localModels->setCurrentIndex(i);
                 return;
             }
@@ -446,6 +578,7 @@ void MainWindow::translate() {
 }
 
 void MainWindow::translate(QString const &text) {
+    translateTimer_.stop(); // In case this was triggered by hand while a translation was scheduled.
     ui_->translateAction->setEnabled(false); //Disable the translate button before the translation finishes
     ui_->translateButton->setEnabled(false);
     if (translator_->model().isEmpty()) {
@@ -460,9 +593,37 @@ void MainWindow::translate(QString const &text) {
     }    
 }
 
+/**
+ * @brief MainWindow::selectModel Translate with the model at path, through the model at pivot if that isn't empty.
+ */
+void MainWindow::selectModel(QString const &path, QString const &pivot) {
+    // If only the pivot changes, translationModel doesn't, but it's a
+    // different translator all the same.
+    bool pivotChanged = settings_.pivotModel() != pivot;
+    settings_.pivotModel.setValue(pivot);
+    settings_.translationModel.setValue(path, pivotChanged ? Setting::AlwaysEmit : Setting::EmitWhenChanged);
+}
+
 void MainWindow::resetTranslator() {
     // Note: settings_.translationModel() can be empty string, meaning unload the current model
-    translator_->setModel(settings_.translationModel(), settings_.marianSettings());
+    QString translationMemory;
+    QString modelID, pivotID; // For the daemon, if there is one
+    if (std::optional<Model> model = models_.getModelForPath(settings_.translationModel())) {
+        translationMemory = translateLocally::TranslationMemory::pathFor(*model);
+        modelID = model->id();
+
+        // Through a pivot, it's the language pair of both together.
+        std::optional<Model> pivot = models_.getModelForPath(settings_.pivotModel());
+        if (pivot && !model->srcTags.isEmpty())
+            translationMemory = translateLocally::TranslationMemory::pathFor(model->srcTags.firstKey(), pivot->trgTag);
+        if (pivot)
+            pivotID = pivot->id();
+    }
+
+    if (!settings_.useDaemon())
+        modelID = pivotID = QString();
+
+    translator_->setModel(settings_.translationModel(), settings_.marianSettings(), translationMemory, settings_.pivotModel(), modelID, pivotID);
     
     // Schedule re-translation immediately if we're in automatic mode.
     if (!settings_.translationModel().isEmpty() && settings_.translateImmediately())
@@ -3,6 +3,7 @@
 #include <QMainWindow>
 #include <QJsonObject>
 #include <QPointer>
+#include <QTimer>
 #include "AlignmentHighlighter.h"
 #include "AlignmentWorker.h"
 #include "Network.h"
@@ -70,6 +71,8 @@ private slots:
 
     void translate(QString const &input);
 
+    void scheduleTranslation();
+
     void updateLocalModels();
 
     void updateSelectedModel();
@@ -95,6 +98,15 @@ private:
     QPointer<MarianInterface> translator_;
     Translation translation_;
 
+    // Debounces translate-as-you-type. Its interval adapts to how long the
+    // last translations took, see scheduleTranslation().
+    QTimer translateTimer_;
+
+    // Moving average of measured translation speed, in words per second. Zero
+    // if we haven't measured anything yet.
+    double averageSpeed_;
+
+    void selectModel(QString const &path, QString const &pivot);
     void resetTranslator();
     void showDownloadPane(bool visible);
     void downloadModel(Model model);
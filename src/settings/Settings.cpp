@@ -1,5 +1,7 @@
 #include "Settings.h"
 #include "constants.h"
+#include "Affinity.h"
+#include <algorithm>
 #include <thread>
 
 void Setting::emitValueChanged(QString name, QVariant value) {
@@ -11,6 +13,7 @@ Settings::Settings(QObject *parent)
 , backing_(QSettings::NativeFormat, QSettings::UserScope, "translateLocally", "translateLocally")
 , translateImmediately(backing_, "translate_immediately", true)
 , translationModel(backing_, "translation_model", "")
+, pivotModel(backing_, "pivot_model", "")
 , cores(backing_, "cpu_cores", std::thread::hardware_concurrency())
 , workspace(backing_, "workspace", 128)
 , splitOrientation(backing_, "split", Qt::Vertical)
@@ -19,6 +22,11 @@ Settings::Settings(QObject *parent)
 , syncScrolling(backing_, "sync_scrolling", true)
 , windowGeometry(backing_, "window_geometry")
 , cacheTranslations(backing_, "cache_translations", true)
+, cacheSize(backing_, "cache_size", 64)
+, cacheEviction(backing_, "cache_eviction", "lru")
+, cpuAffinity(backing_, "cpu_affinity", "")
+, avoidSmt(backing_, "avoid_smt", false)
+, nice(backing_, "nice", 0)
 , repos(backing_, "newrepos", QMap<QString, translateLocally::Repository>{{translateLocally::kDefaultRepositoryURL, translateLocally::Repository{
                                                                                  translateLocally::kDefaultRepositoryName,
                                                                                  translateLocally::kDefaultRepositoryURL,
@@ -28,7 +36,11 @@ Settings::Settings(QObject *parent)
     // Firefox browser extension: https://github.com/jelmervdl/firefox-translations (unlisted & public)
     "{c9cdf885-0431-4eed-8e18-967b1758c951}",
     "{2fa36771-561b-452c-b6c3-7486f42c25ae}"
-}) {
+})
+, nativeMaxRequests(backing_, "native_max_requests", 256)
+, nativeMaxPendingSize(backing_, "native_max_pending_size", 64)
+, nativeShards(backing_, "native_shards", 1)
+, useDaemon(backing_, "use_daemon", true) {
     //
 }
 
@@ -36,6 +48,11 @@ translateLocally::marianSettings Settings::marianSettings() const {
     return {
         cores.value(),
         workspace.value(),
-        cacheTranslations.value()
+        cacheTranslations.value(),
+        cacheSize.value(),
+        translateLocally::cacheEvictionFromString(cacheEviction.value()),
+        translateLocally::affinity::parseCpuList(cpuAffinity.value()),
+        avoidSmt.value(),
+        static_cast<int>(std::min(nice.value(), 19u))
     };
 }
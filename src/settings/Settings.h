@@ -98,6 +98,7 @@ public:
 
     SettingImpl<bool> translateImmediately;
     SettingImpl<QString> translationModel;
+    SettingImpl<QString> pivotModel; // Path of the model translationModel's output goes through, if any
     SettingImpl<unsigned int> cores;
     SettingImpl<unsigned int> workspace;
     SettingImpl<Qt::Orientation> splitOrientation;
@@ -106,6 +107,15 @@ public:
     SettingImpl<bool> syncScrolling;
     SettingImpl<QByteArray> windowGeometry;
     SettingImpl<bool> cacheTranslations;
+    SettingImpl<unsigned int> cacheSize; // in MB
+    SettingImpl<QString> cacheEviction; // "lru" or "fifo"
+    SettingImpl<QString> cpuAffinity; // e.g. "0-3,8", empty for any CPU
+    SettingImpl<bool> avoidSmt;
+    SettingImpl<unsigned int> nice; // 0 (normal) to 19 (lowest)
     SettingImpl<QMap<QString, translateLocally::Repository>> repos;
     SettingImpl<QSet<QString>> nativeMessagingClients;
+    SettingImpl<unsigned int> nativeMaxRequests; // requests in flight before we stop reading
+    SettingImpl<unsigned int> nativeMaxPendingSize; // in MB, of requests in flight before we answer "busy"
+    SettingImpl<unsigned int> nativeShards; // translation services, each with own CPUs and model copy. 0: one per NUMA node
+    SettingImpl<bool> useDaemon; // GUI translates through the daemon if it is running
 };
@@ -10,6 +10,7 @@
 #include <QFileDialog>
 #include <QMessageBox>
 #include <QInputDialog>
+#include <QRegularExpressionValidator>
 
 
 TranslatorSettingsDialog::TranslatorSettingsDialog(QWidget *parent, Settings *settings, ModelManager *modelManager)
@@ -44,6 +45,16 @@ TranslatorSettingsDialog::TranslatorSettingsDialog(QWidget *parent, Settings *se
     for (auto option : cores_options)
         ui_->coresBox->addItem(QString("%1").arg(option), option);
 
+    ui_->cacheEvictionBox->addItem(tr("Forget least recently used translations"), "lru");
+    ui_->cacheEvictionBox->addItem(tr("Forget oldest translations"), "fifo");
+
+    // CPU lists like "0-3,8"
+    ui_->cpuAffinityEdit->setValidator(new QRegularExpressionValidator(QRegularExpression("^\\s*(\\d+(-\\d+)?(\\s*,\\s*\\d+(-\\d+)?)*)?\\s*$"), this));
+
+    // Cache options only make sense when there is a cache
+    connect(ui_->cacheTranslationsCheckbox, &QCheckBox::toggled, ui_->cacheSizeBox, &QWidget::setEnabled);
+    connect(ui_->cacheTranslationsCheckbox, &QCheckBox::toggled, ui_->cacheEvictionBox, &QWidget::setEnabled);
+
     ui_->localModelTable->setModel(&modelProxy_);
     ui_->localModelTable->setSortingEnabled(true);
     ui_->localModelTable->horizontalHeader()->setSectionResizeMode(ModelManager::Column::Source, QHeaderView::ResizeToContents);
@@ -103,6 +114,13 @@ void TranslatorSettingsDialog::updateSettings()
     ui_->alignmentColorButton->setColor(settings_->alignmentColor());
     ui_->syncScrollingCheckbox->setChecked(settings_->syncScrolling());
     ui_->cacheTranslationsCheckbox->setChecked(settings_->cacheTranslations());
+    ui_->cacheSizeBox->setValue(settings_->cacheSize());
+    ui_->cacheSizeBox->setEnabled(settings_->cacheTranslations());
+    ui_->cacheEvictionBox->setCurrentIndex(ui_->cacheEvictionBox->findData(settings_->cacheEviction()));
+    ui_->cacheEvictionBox->setEnabled(settings_->cacheTranslations());
+    ui_->cpuAffinityEdit->setText(settings_->cpuAffinity());
+    ui_->avoidSmtCheckbox->setChecked(settings_->avoidSmt());
+    ui_->niceBox->setValue(settings_->nice());
     repositoryModel_.load(settings_->repos.value());
 }
 
@@ -115,6 +133,11 @@ void TranslatorSettingsDialog::applySettings()
     settings_->alignmentColor.setValue(ui_->alignmentColorButton->color());
     settings_->syncScrolling.setValue(ui_->syncScrollingCheckbox->isChecked());
     settings_->cacheTranslations.setValue(ui_->cacheTranslationsCheckbox->isChecked());
+    settings_->cacheSize.setValue(ui_->cacheSizeBox->value());
+    settings_->cacheEviction.setValue(ui_->cacheEvictionBox->currentData().toString());
+    settings_->cpuAffinity.setValue(ui_->cpuAffinityEdit->text().trimmed());
+    settings_->avoidSmt.setValue(ui_->avoidSmtCheckbox->isChecked());
+    settings_->nice.setValue(ui_->niceBox->value());
     settings_->repos.setValue(repositoryModel_.dump());
 }
 
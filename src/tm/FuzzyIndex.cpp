@@ -0,0 +1,198 @@
+#include "FuzzyIndex.h"
+#include <algorithm>
+#include <numeric>
+
+namespace translateLocally {
+
+namespace {
+
+const std::size_t kMaxLength = 0xFFFF; // Tokens, lengths_ is 16 bit
+
+// Postings looked at per lookup, rarest words first. Frequent words (like
+// "the") beyond that say little about which segments are alike anyway.
+const std::size_t kMaxPostings = 100000;
+
+bool isSpace(unsigned char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
+
+bool isWordChar(unsigned char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c >= 0x80;
+}
+
+// FNV-1a, optionally of the ASCII lowercase version.
+std::uint64_t hash(std::string_view token, bool lowercase) {
+    std::uint64_t h = 14695981039346656037ull;
+    for (unsigned char c : token) {
+        if (lowercase && c >= 'A' && c <= 'Z')
+            c += 'a' - 'A';
+        h ^= c;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// Calls fun(token, isWord) for every token in text.
+template <typename Fun> void tokenize(std::string_view text, Fun fun) {
+    std::size_t i = 0;
+    while (i < text.size()) {
+        unsigned char c = text[i];
+        if (isSpace(c)) {
+            ++i;
+        } else if (isWordChar(c)) {
+            std::size_t end = i + 1;
+            while (end < text.size() && isWordChar(text[end]))
+                ++end;
+            fun(text.substr(i, end - i), true);
+            i = end;
+        } else {
+            fun(text.substr(i, 1), false);
+            ++i;
+        }
+    }
+}
+
+std::vector<std::uint64_t> tokens(std::string_view text) {
+    std::vector<std::uint64_t> tokens;
+    tokenize(text, [&](std::string_view token, bool) {
+        tokens.push_back(hash(token, false));
+    });
+    return tokens;
+}
+
+// Whether segments of n and m tokens can be threshold similar: the edit
+// distance is at least the difference in length.
+bool withinLength(std::size_t n, std::size_t m, double threshold) {
+    std::size_t longest = std::max(n, m);
+    std::size_t difference = longest - std::min(n, m);
+    return difference <= (1.0 - threshold) * longest;
+}
+
+} // Anonymous namespace
+
+void FuzzyIndex::add(std::uint64_t id, std::string_view source) {
+    std::size_t begin = words_.size();
+    std::size_t length = 0;
+
+    tokenize(source, [&](std::string_view token, bool word) {
+        ++length;
+        if (word) {
+            auto it = vocabulary_.emplace(hash(token, true), static_cast<std::uint32_t>(vocabulary_.size())).first;
+            words_.push_back(it->second);
+        }
+    });
+
+    // Every word once per segment
+    std::sort(words_.begin() + begin, words_.end());
+    words_.erase(std::unique(words_.begin() + begin, words_.end()), words_.end());
+
+    ids_.push_back(id);
+    lengths_.push_back(static_cast<std::uint16_t>(std::min(length, kMaxLength)));
+    bounds_.push_back(words_.size());
+}
+
+void FuzzyIndex::finish() {
+    // Count first, so the postings can go in one array.
+    starts_.assign(vocabulary_.size() + 1, 0);
+    for (std::uint32_t word : words_)
+        ++starts_[word + 1];
+    std::partial_sum(starts_.begin(), starts_.end(), starts_.begin());
+
+    std::vector<std::size_t> next(starts_.begin(), starts_.end() - 1);
+    postings_.resize(words_.size());
+    for (std::size_t segment = 0, i = 0; segment < bounds_.size(); ++segment)
+        for (; i < bounds_[segment]; ++i)
+            postings_[next[words_[i]]++] = static_cast<std::uint32_t>(segment);
+
+    std::vector<std::uint32_t>().swap(words_);
+    std::vector<std::size_t>().swap(bounds_);
+}
+
+std::vector<std::uint64_t> FuzzyIndex::candidates(std::string_view source, double threshold, std::size_t limit) const {
+    std::size_t length = 0;
+    std::vector<std::uint32_t> words;
+    tokenize(source, [&](std::string_view token, bool word) {
+        ++length;
+        if (!word)
+            return;
+        auto it = vocabulary_.find(hash(token, true));
+        if (it != vocabulary_.end())
+            words.push_back(it->second);
+    });
+    length = std::min(length, kMaxLength);
+
+    std::sort(words.begin(), words.end());
+    words.erase(std::unique(words.begin(), words.end()), words.end());
+
+    // Rarest first
+    auto count = [&](std::uint32_t word) {
+        return starts_[word + 1] - starts_[word];
+    };
+    std::sort(words.begin(), words.end(), [&](std::uint32_t a, std::uint32_t b) {
+        return count(a) < count(b);
+    });
+
+    // Words in common per segment. Kept between lookups, as clearing the
+    // segments that were counted is much cheaper than allocating it again.
+    thread_local std::vector<std::uint32_t> shared;
+    if (shared.size() < ids_.size())
+        shared.resize(ids_.size(), 0);
+
+    std::vector<std::uint32_t> counted;
+    std::size_t scanned = 0;
+    for (std::uint32_t word : words) {
+        if (scanned > 0 && scanned + count(word) > kMaxPostings)
+            break;
+        scanned += count(word);
+
+        for (std::size_t i = starts_[word]; i < starts_[word + 1]; ++i) {
+            std::uint32_t segment = postings_[i];
+            if (!withinLength(lengths_[segment], length, threshold))
+                continue;
+            if (shared[segment]++ == 0)
+                counted.push_back(segment);
+        }
+    }
+
+    std::size_t n = std::min(limit, counted.size());
+    std::partial_sort(counted.begin(), counted.begin() + n, counted.end(), [&](std::uint32_t a, std::uint32_t b) {
+        return shared[a] > shared[b] || (shared[a] == shared[b] && a < b);
+    });
+
+    for (std::uint32_t segment : counted)
+        shared[segment] = 0;
+
+    std::vector<std::uint64_t> ids;
+    ids.reserve(n);
+    for (std::size_t i = 0; i < n; ++i)
+        ids.push_back(ids_[counted[i]]);
+    return ids;
+}
+
+std::size_t FuzzyIndex::size() const {
+    return ids_.size();
+}
+
+double FuzzyIndex::similarity(std::string_view a, std::string_view b) {
+    std::vector<std::uint64_t> x = tokens(a);
+    std::vector<std::uint64_t> y = tokens(b);
+    if (x.empty() && y.empty())
+        return 1.0;
+
+    // Levenshtein distance in tokens, one row at a time.
+    std::vector<std::size_t> row(y.size() + 1);
+    std::iota(row.begin(), row.end(), 0);
+    for (std::size_t i = 1; i <= x.size(); ++i) {
+        std::size_t diagonal = row[0];
+        row[0] = i;
+        for (std::size_t j = 1; j <= y.size(); ++j) {
+            std::size_t above = row[j];
+            row[j] = std::min({row[j] + 1, row[j - 1] + 1, diagonal + (x[i - 1] == y[j - 1] ? 0 : 1)});
+            diagonal = above;
+        }
+    }
+
+    return 1.0 - static_cast<double>(row[y.size()]) / std::max(x.size(), y.size());
+}
+
+} // namespace translateLocally
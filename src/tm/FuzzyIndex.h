@@ -0,0 +1,71 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace translateLocally {
+
+/**
+ * Finds the segments of a translation memory that are most like a given
+ * segment, e.g. the same sentence with a different number or product name.
+ *
+ * Segments are split into tokens: words (runs of letters, digits and anything
+ * that isn't ASCII), and every other character that isn't a space by itself.
+ * An inverted index from (lowercased) word to the segments it occurs in gives
+ * the candidates that share the most words. Those are then compared token by
+ * token: the similarity of two segments is 1 - edit distance / length of the
+ * longer one, in tokens.
+ *
+ * The index is built once with add() and finish(). After that, it is
+ * read-only and can be used from several threads.
+ */
+class FuzzyIndex {
+public:
+    /**
+     * @brief Adds a segment. id is handed back by candidates().
+     */
+    void add(std::uint64_t id, std::string_view source);
+
+    /**
+     * @brief Builds the index of the segments added so far.
+     */
+    void finish();
+
+    /**
+     * @brief Ids of at most limit segments that could be at least threshold
+     * similar to source, the ones with the most words in common first.
+     */
+    std::vector<std::uint64_t> candidates(std::string_view source, double threshold, std::size_t limit) const;
+
+    /**
+     * @brief Number of segments in the index.
+     */
+    std::size_t size() const;
+
+    /**
+     * @brief Similarity of a and b, from 0 (nothing in common) to 1 (same
+     * tokens).
+     */
+    static double similarity(std::string_view a, std::string_view b);
+
+private:
+    // Per segment
+    std::vector<std::uint64_t> ids_;
+    std::vector<std::uint16_t> lengths_; // In tokens, capped
+
+    // Hash of a lowercased word to its index
+    std::unordered_map<std::uint64_t, std::uint32_t> vocabulary_;
+
+    // Only while building: the words of each segment, one after the other,
+    // and where the words of each segment end.
+    std::vector<std::uint32_t> words_;
+    std::vector<std::size_t> bounds_;
+
+    // Postings of word i are postings_[starts_[i]] up to postings_[starts_[i + 1]]
+    std::vector<std::size_t> starts_;
+    std::vector<std::uint32_t> postings_; // Segment indices
+};
+
+} // namespace translateLocally
@@ -0,0 +1,371 @@
+#include "TranslationMemory.h"
+#include "FuzzyIndex.h"
+#include "inventory/ModelManager.h"
+#include <QDir>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QtEndian>
+#include <QStandardPaths>
+#include <QXmlStreamReader>
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+namespace translateLocally {
+
+namespace {
+
+const char kMagic[4] = {'T', 'L', 'T', 'M'};
+const std::uint32_t kVersion = 1;
+const std::size_t kHeaderSize = 24; // magic, version, buckets, entries
+const std::size_t kBucketSize = 16; // hash, offset
+const std::size_t kEntryHeaderSize = 8; // source size, target size
+const std::size_t kFuzzyCandidates = 64; // Compared in full per fuzzy lookup
+
+// Integers in the file are little-endian, whatever the platform.
+template <typename T> T readInt(uchar const *data) {
+    return qFromLittleEndian<T>(data); // Copes with entries not being aligned
+}
+
+template <typename T> void appendInt(QByteArray &out, T value) {
+    value = qToLittleEndian(value);
+    out.append(reinterpret_cast<char const *>(&value), sizeof(T));
+}
+
+// FNV-1a. Stored in the file, so it must not change between versions (or
+// platforms, like std::hash may).
+std::uint64_t hash(char const *data, std::size_t size) {
+    std::uint64_t h = 14695981039346656037ull;
+    for (std::size_t i = 0; i < size; ++i) {
+        h ^= static_cast<unsigned char>(data[i]);
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+std::string trimmed(QByteArray const &text) {
+    QByteArray trimmed = text.trimmed();
+    return std::string(trimmed.constData(), trimmed.size());
+}
+
+// Whether a TMX language like "en-GB" is the language code "en".
+bool isLanguage(QString const &lang, QString const &code) {
+    return lang.compare(code, Qt::CaseInsensitive) == 0
+        || lang.section(QChar('-'), 0, 0).section(QChar('_'), 0, 0).compare(code, Qt::CaseInsensitive) == 0;
+}
+
+// Text of a <seg>, without the native codes (e.g. the HTML of a link) that
+// TMX keeps in <bpt>, <ept>, <ph>, <it> and <ut>.
+QString readSegment(QXmlStreamReader &xml) {
+    QString text;
+    int skipping = 0;
+    while (!xml.atEnd()) {
+        switch (xml.readNext()) {
+            case QXmlStreamReader::StartElement:
+                if (skipping || xml.name() == QLatin1String("bpt") || xml.name() == QLatin1String("ept") || xml.name() == QLatin1String("ph") || xml.name() == QLatin1String("it") || xml.name() == QLatin1String("ut"))
+                    ++skipping;
+                break;
+            case QXmlStreamReader::EndElement:
+                if (skipping)
+                    --skipping;
+                else if (xml.name() == QLatin1String("seg"))
+                    return text;
+                break;
+            case QXmlStreamReader::Characters:
+                if (!skipping)
+                    text += xml.text();
+                break;
+            default:
+                break;
+        }
+    }
+    return text;
+}
+
+bool readTsv(QFile &in, std::unordered_map<std::string, std::string> &entries, std::size_t &imported) {
+    while (!in.atEnd()) {
+        QByteArray line = in.readLine();
+        int tab = line.indexOf('\t');
+        if (tab < 0)
+            continue;
+
+        int end = line.indexOf('\t', tab + 1);
+        std::string source = trimmed(line.left(tab));
+        std::string target = trimmed(line.mid(tab + 1, end < 0 ? -1 : end - tab - 1));
+        if (source.empty() || target.empty())
+            continue;
+
+        entries[std::move(source)] = std::move(target);
+        ++imported;
+    }
+    return true;
+}
+
+bool readTmx(QFile &in, QString const &src, QString const &trg, std::unordered_map<std::string, std::string> &entries, std::size_t &imported, QString &error) {
+    QXmlStreamReader xml(&in);
+    QString source, target;
+    QString lang;
+
+    while (!xml.atEnd()) {
+        xml.readNext();
+        if (xml.isStartElement()) {
+            if (xml.name() == QLatin1String("tu")) {
+                source.clear();
+                target.clear();
+            } else if (xml.name() == QLatin1String("tuv")) {
+                // TMX 1.4 uses xml:lang, older versions lang.
+                lang = xml.attributes().value(QLatin1String("xml:lang")).toString();
+                if (lang.isEmpty())
+                    lang = xml.attributes().value(QLatin1String("lang")).toString();
+            } else if (xml.name() == QLatin1String("seg")) {
+                QString text = readSegment(xml);
+                if (isLanguage(lang, src))
+                    source = text;
+                else if (isLanguage(lang, trg))
+                    target = text;
+            }
+        } else if (xml.isEndElement() && xml.name() == QLatin1String("tu")) {
+            std::string sourceText = trimmed(source.toUtf8());
+            std::string targetText = trimmed(target.toUtf8());
+            if (!sourceText.empty() && !targetText.empty()) {
+                entries[std::move(sourceText)] = std::move(targetText);
+                ++imported;
+            }
+        }
+    }
+
+    if (xml.hasError()) {
+        error = QString("Invalid TMX at line %1: %2").arg(xml.lineNumber()).arg(xml.errorString());
+        return false;
+    }
+    return true;
+}
+
+} // Anonymous namespace
+
+TranslationMemory::TranslationMemory(QString const &path)
+: file_(path)
+, data_(nullptr)
+, size_(0)
+, buckets_(0)
+, entries_(0)
+, hits_(0) {
+    if (!file_.open(QIODevice::ReadOnly) || file_.size() < static_cast<qint64>(kHeaderSize))
+        return;
+
+    uchar const *data = file_.map(0, file_.size());
+    if (!data)
+        return;
+
+    std::size_t size = file_.size();
+    std::uint64_t buckets = readInt<std::uint64_t>(data + 8);
+
+    // Anything else, and we might read past the end.
+    if (std::memcmp(data, kMagic, sizeof(kMagic)) != 0
+        || readInt<std::uint32_t>(data + 4) != kVersion
+        || buckets == 0 || (buckets & (buckets - 1)) != 0
+        || buckets > (size - kHeaderSize) / kBucketSize)
+        return;
+
+    data_ = data;
+    size_ = size;
+    buckets_ = buckets;
+    entries_ = readInt<std::uint64_t>(data + 16);
+}
+
+TranslationMemory::~TranslationMemory() {
+    //
+}
+
+std::shared_ptr<TranslationMemory const> TranslationMemory::open(QString const &path) {
+    if (path.isEmpty() || !QFileInfo::exists(path))
+        return nullptr;
+
+    auto memory = std::make_shared<TranslationMemory>(path);
+    if (memory->size() == 0)
+        return nullptr;
+
+    return memory;
+}
+
+std::optional<std::string> TranslationMemory::find(std::string const &source) const {
+    if (!data_)
+        return std::nullopt;
+
+    std::uint64_t h = hash(source.data(), source.size());
+    std::uint64_t mask = buckets_ - 1;
+
+    // Linear probing, the table is at most half full.
+    for (std::uint64_t i = h & mask, probes = 0; probes < buckets_; i = (i + 1) & mask, ++probes) {
+        uchar const *bucket = data_ + kHeaderSize + i * kBucketSize;
+        std::uint64_t offset = readInt<std::uint64_t>(bucket + 8);
+        if (offset == 0)
+            break;
+
+        if (readInt<std::uint64_t>(bucket) != h || offset > size_ - kEntryHeaderSize)
+            continue;
+
+        std::uint32_t sourceSize = readInt<std::uint32_t>(data_ + offset);
+        std::uint32_t targetSize = readInt<std::uint32_t>(data_ + offset + 4);
+        if (sourceSize != source.size() || offset + kEntryHeaderSize + sourceSize + targetSize > size_)
+            continue;
+
+        char const *text = reinterpret_cast<char const *>(data_ + offset + kEntryHeaderSize);
+        if (std::memcmp(text, source.data(), sourceSize) == 0) {
+            ++hits_;
+            return std::string(text + sourceSize, targetSize);
+        }
+    }
+
+    return std::nullopt;
+}
+
+std::vector<TranslationMemory::FuzzyMatch> TranslationMemory::findFuzzy(std::string const &source, double threshold, std::size_t limit) const {
+    if (!data_)
+        return {};
+
+    std::call_once(fuzzyOnce_, [this]() {
+        auto index = std::make_unique<FuzzyIndex>();
+        forEach([&](std::uint64_t offset, std::string_view segment, std::string_view) {
+            index->add(offset, segment);
+        });
+        index->finish();
+        fuzzy_ = std::move(index);
+    });
+
+    std::vector<FuzzyMatch> matches;
+    for (std::uint64_t offset : fuzzy_->candidates(source, threshold, kFuzzyCandidates)) {
+        // forEach() checked these already
+        std::uint32_t sourceSize = readInt<std::uint32_t>(data_ + offset);
+        std::uint32_t targetSize = readInt<std::uint32_t>(data_ + offset + 4);
+        char const *text = reinterpret_cast<char const *>(data_ + offset + kEntryHeaderSize);
+
+        double similarity = FuzzyIndex::similarity(source, std::string_view(text, sourceSize));
+        if (similarity >= threshold)
+            matches.push_back(FuzzyMatch{std::string(text, sourceSize), std::string(text + sourceSize, targetSize), similarity});
+    }
+
+    std::stable_sort(matches.begin(), matches.end(), [](FuzzyMatch const &a, FuzzyMatch const &b) {
+        return a.similarity > b.similarity;
+    });
+    if (matches.size() > limit)
+        matches.resize(limit);
+    return matches;
+}
+
+std::size_t TranslationMemory::size() const {
+    return data_ ? entries_ : 0;
+}
+
+std::size_t TranslationMemory::hits() const {
+    return hits_;
+}
+
+template <typename Fun> void TranslationMemory::forEach(Fun fun) const {
+    if (!data_)
+        return;
+
+    for (std::uint64_t i = 0; i < buckets_; ++i) {
+        std::uint64_t offset = readInt<std::uint64_t>(data_ + kHeaderSize + i * kBucketSize + 8);
+        if (offset == 0 || offset > size_ - kEntryHeaderSize)
+            continue;
+
+        std::uint32_t sourceSize = readInt<std::uint32_t>(data_ + offset);
+        std::uint32_t targetSize = readInt<std::uint32_t>(data_ + offset + 4);
+        if (offset + kEntryHeaderSize + sourceSize + targetSize > size_)
+            continue;
+
+        char const *text = reinterpret_cast<char const *>(data_ + offset + kEntryHeaderSize);
+        fun(offset, std::string_view(text, sourceSize), std::string_view(text + sourceSize, targetSize));
+    }
+}
+
+QString TranslationMemory::pathFor(QString const &src, QString const &trg) {
+    return QString("%1/tm/%2-%3.tm").arg(QStandardPaths::writableLocation(QStandardPaths::AppDataLocation), src, trg);
+}
+
+QString TranslationMemory::pathFor(Model const &model) {
+    // srcTags are all the languages the model accepts, usually just one.
+    if (model.srcTags.isEmpty() || model.trgTag.isEmpty())
+        return QString();
+    return pathFor(model.srcTags.firstKey(), model.trgTag);
+}
+
+bool TranslationMemory::import(QString const &path, QString const &file, QString const &src, QString const &trg, std::size_t &imported, QString &error) {
+    imported = 0;
+
+    std::unordered_map<std::string, std::string> entries;
+
+    // What's in there already stays, unless file has a new translation.
+    TranslationMemory(path).forEach([&](std::uint64_t, std::string_view source, std::string_view target) {
+        entries.emplace(source, target);
+    });
+
+    QFile in(file);
+    if (!in.open(QIODevice::ReadOnly)) {
+        error = QString("Could not read %1: %2").arg(file, in.errorString());
+        return false;
+    }
+
+    if (file.endsWith(".tmx", Qt::CaseInsensitive)) {
+        if (!readTmx(in, src, trg, entries, imported, error))
+            return false;
+    } else {
+        readTsv(in, entries, imported);
+    }
+
+    // At most half full, so probe sequences stay short.
+    std::uint64_t buckets = 16;
+    while (buckets < 2 * entries.size())
+        buckets *= 2;
+
+    // Entries are written in the order of entries, so their offsets are
+    // known before writing any of them.
+    std::vector<std::uint64_t> table(2 * buckets, 0); // hash, offset, little-endian
+    std::uint64_t offset = kHeaderSize + buckets * kBucketSize;
+
+    for (auto &&entry : entries) {
+        std::uint64_t h = hash(entry.first.data(), entry.first.size());
+        std::uint64_t i = h & (buckets - 1);
+        while (table[2 * i + 1] != 0)
+            i = (i + 1) & (buckets - 1);
+        table[2 * i] = qToLittleEndian(h);
+        table[2 * i + 1] = qToLittleEndian(offset);
+        offset += kEntryHeaderSize + entry.first.size() + entry.second.size();
+    }
+
+    QByteArray header(kMagic, sizeof(kMagic));
+    appendInt<std::uint32_t>(header, kVersion);
+    appendInt<std::uint64_t>(header, buckets);
+    appendInt<std::uint64_t>(header, entries.size());
+
+    QDir().mkpath(QFileInfo(path).absolutePath());
+
+    // Translators that have the old one open keep reading it until they're done.
+    QSaveFile out(path);
+    if (!out.open(QIODevice::WriteOnly)) {
+        error = QString("Could not write %1: %2").arg(path, out.errorString());
+        return false;
+    }
+
+    out.write(header);
+    out.write(reinterpret_cast<char const *>(table.data()), table.size() * sizeof(std::uint64_t));
+    for (auto &&entry : entries) {
+        QByteArray sizes;
+        appendInt<std::uint32_t>(sizes, entry.first.size());
+        appendInt<std::uint32_t>(sizes, entry.second.size());
+        out.write(sizes);
+        out.write(entry.first.data(), entry.first.size());
+        out.write(entry.second.data(), entry.second.size());
+    }
+
+    if (!out.commit()) {
+        error = QString("Could not write %1: %2").arg(path, out.errorString());
+        return false;
+    }
+
+    return true;
+}
+
+} // namespace translateLocally
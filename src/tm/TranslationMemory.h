@@ -0,0 +1,122 @@
+#pragma once
+#include <QFile>
+#include <QString>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct Model;
+
+namespace translateLocally {
+
+class FuzzyIndex;
+
+/**
+ * Translations of segments that were translated before, e.g. for an earlier
+ * release of the same documentation. There is one translation memory per
+ * language pair, in a single file that is a hash index followed by the
+ * segments:
+ *
+ *   header:  "TLTM" magic, format version, number of buckets, of entries
+ *   buckets: (hash, offset of the entry) for open addressing, offset 0 if empty
+ *   entries: source size, target size, source text, target text (UTF-8)
+ *
+ * Integers are little-endian 32 or 64 bit. The file is memory mapped, so a
+ * lookup touches one bucket (usually) and one entry, and nothing has to be
+ * loaded up front. Lookups are exact: the source has to match byte for byte,
+ * after leading and trailing whitespace is removed. They are thread-safe.
+ *
+ * Near matches are found with findFuzzy(), through an index that is built in
+ * memory the first time it is needed.
+ *
+ * The file is only ever replaced as a whole by import(). Translators that have
+ * it open keep using the old one until they open it again.
+ */
+class TranslationMemory {
+public:
+    /**
+     * @brief Opens the translation memory at path. Empty if there is none,
+     * or it is not a valid translation memory.
+     */
+    explicit TranslationMemory(QString const &path);
+    ~TranslationMemory();
+
+    /**
+     * @return nullptr if there is no (valid) translation memory at path, so
+     * callers can skip lookups altogether.
+     */
+    static std::shared_ptr<TranslationMemory const> open(QString const &path);
+
+    /**
+     * @brief The translation of source, if it is in the translation memory.
+     */
+    std::optional<std::string> find(std::string const &source) const;
+
+    struct FuzzyMatch {
+        std::string source;
+        std::string target;
+        double similarity; // See FuzzyIndex::similarity()
+    };
+
+    /**
+     * @brief Segments that are at least threshold (0 to 1) similar to source,
+     * the most similar first. The first call builds the index, which takes a
+     * while for large translation memories.
+     * @param limit number of matches at most.
+     */
+    std::vector<FuzzyMatch> findFuzzy(std::string const &source, double threshold, std::size_t limit) const;
+
+    /**
+     * @brief Number of segments in the translation memory.
+     */
+    std::size_t size() const;
+
+    /**
+     * @brief Number of times find() found a translation.
+     */
+    std::size_t hits() const;
+
+    /**
+     * @brief Where the translation memory for translating from src into trg
+     * is kept. src and trg are language codes, e.g. "de" and "en".
+     */
+    static QString pathFor(QString const &src, QString const &trg);
+
+    /**
+     * @brief Same, for the language pair model translates.
+     */
+    static QString pathFor(Model const &model);
+
+    /**
+     * @brief Adds the segments in file to the translation memory at path,
+     * replacing the translation of segments that were in there already. file
+     * is either tab-separated (source, then target) or TMX, for which the
+     * segments in languages src and trg are used.
+     * @param imported set to the number of segments read from file.
+     * @return false if file could not be read or the translation memory could
+     * not be written. error says why.
+     */
+    static bool import(QString const &path, QString const &file, QString const &src, QString const &trg, std::size_t &imported, QString &error);
+
+private:
+    QFile file_;
+    uchar const *data_;
+    std::size_t size_;
+    std::uint64_t buckets_;
+    std::uint64_t entries_;
+    mutable std::atomic<std::size_t> hits_;
+
+    mutable std::once_flag fuzzyOnce_;
+    mutable std::unique_ptr<FuzzyIndex> fuzzy_;
+
+    // Calls fun(offset, source, target) for every entry.
+    template <typename Fun> void forEach(Fun fun) const;
+};
+
+} // namespace translateLocally
@@ -1,14 +1,48 @@
 #pragma once
 #include <stddef.h>
+#include <vector>
 #include <QString>
 #include <QVariant>
 
 namespace translateLocally {
 
+/**
+ * Which entry to evict from a full translation cache: the one used longest ago
+ * (LRU) or the one inserted longest ago (FIFO). FIFO skips the bookkeeping on
+ * every cache hit, LRU keeps frequently used entries around for longer.
+ */
+enum class CacheEviction {
+    LRU,
+    FIFO
+};
+
+inline CacheEviction cacheEvictionFromString(QString const &name) {
+    return name.compare("fifo", Qt::CaseInsensitive) == 0 ? CacheEviction::FIFO : CacheEviction::LRU;
+}
+
 struct marianSettings {
     size_t cpu_threads;
     size_t workspace;
     bool translation_cache;
+    size_t translation_cache_size; // in MB
+    CacheEviction translation_cache_eviction;
+    std::vector<int> cpu_affinity; // CPUs to run workers on, empty for any
+    bool avoid_smt; // at most one worker per physical core
+    int nice; // priority of the workers: 0 is normal, 19 lowest
+};
+
+/**
+ * Words per batch each translation worker handles at once (marian's
+ * mini-batch-words).
+ */
+static const size_t constexpr kMiniBatchWords = 1000;
+
+/**
+ * Hit and miss counters of a translation cache.
+ */
+struct CacheStats {
+    size_t hits;
+    size_t misses;
 };
 
 struct Repository {